@@ -0,0 +1,182 @@
+// Counts heap allocations made while decoding a SendEmail job and assembling its message,
+// for a job carrying its content inline and for one rendered from a template.
+// Usage: email_alloc_bench [emails]
+#include "../include/email_sender.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+std::atomic<size_t> allocations{0};
+
+void *counted_alloc(size_t size, size_t alignment = alignof(std::max_align_t))
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size = size == 0 ? 1 : size;
+    if (alignment > alignof(std::max_align_t))
+    {
+        // aligned_alloc wants the size to be a multiple of the alignment
+        return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    }
+    return std::malloc(size);
+}
+
+void *checked(void *ptr)
+{
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+}
+
+// Every replaceable form of new and delete is defined on top of malloc and free, so that each
+// allocation is counted and released by a matching operator. They are kept out of line: once
+// inlined, GCC sees malloc paired with operator delete (or operator new with free) and reports
+// -Wmismatched-new-delete
+[[gnu::noinline]] void *operator new(size_t size)
+{
+    return checked(counted_alloc(size));
+}
+
+[[gnu::noinline]] void *operator new[](size_t size)
+{
+    return checked(counted_alloc(size));
+}
+
+[[gnu::noinline]] void *operator new(size_t size, std::align_val_t alignment)
+{
+    return checked(counted_alloc(size, static_cast<size_t>(alignment)));
+}
+
+[[gnu::noinline]] void *operator new[](size_t size, std::align_val_t alignment)
+{
+    return checked(counted_alloc(size, static_cast<size_t>(alignment)));
+}
+
+[[gnu::noinline]] void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size);
+}
+
+[[gnu::noinline]] void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size);
+}
+
+[[gnu::noinline]] void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size, static_cast<size_t>(alignment));
+}
+
+[[gnu::noinline]] void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size, static_cast<size_t>(alignment));
+}
+
+[[gnu::noinline]] void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void *ptr, size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    std::free(ptr);
+}
+
+int main(int argc, char *argv[])
+{
+    int emails = argc > 1 ? std::atoi(argv[1]) : 100000;
+    SmtpCredentials credentials{"smtps://smtp.example.com", "sender@example.com", "secret"};
+
+    // Arguments as a worker holds them after claiming a job
+    json args = json::parse(R"({"recipient":"test@example.com","subject":"Test Email","body":")" +
+                            std::string(2048, 'x') + R"("})");
+
+    std::string message;
+    size_t bytes = 0;
+    size_t before = allocations.load();
+    for (int i = 0; i < emails; ++i)
+    {
+        EmailPayload payload = EmailPayload::decode(args);
+        SendEmail::compose_message(message, credentials.user, payload);
+        bytes += message.size();
+    }
+    size_t counted = allocations.load() - before;
+
+    spdlog::info("{} emails, {} bytes composed, {:.2f} allocations per email",
+                 emails, bytes, static_cast<double>(counted) / emails);
+
+    // The same message rendered from a template at send time
+    TemplateStore templates;
+    templates.add("test", "{{subject}}", "Hello {{name}},\n" + std::string(2048, 'x') + "\nOrder {{order}}");
+    json template_args = json::parse(R"({"recipient":"test@example.com","template":"test",
+                                         "vars":{"subject":"Test Email","name":"Jane","order":12345}})");
+    const EmailTemplate *email_template = templates.find("test");
+    bytes = 0;
+    before = allocations.load();
+    for (int i = 0; i < emails; ++i)
+    {
+        EmailPayload payload = EmailPayload::decode(template_args);
+        SendEmail::compose_message(message, credentials.user, payload, email_template);
+        bytes += message.size();
+    }
+    counted = allocations.load() - before;
+
+    spdlog::info("{} template emails, {} bytes rendered, {:.2f} allocations per email, {} vs {} argument bytes per job",
+                 emails, bytes, static_cast<double>(counted) / emails, template_args.dump().size(), args.dump().size());
+    return 0;
+}
@@ -0,0 +1,87 @@
+// Compares enqueue and claim/ack throughput of the queue backends.
+// Usage: queue_backend_bench [jobs] [producer threads]
+#include "../include/queue_backend.h"
+#include <chrono>
+#include <cstdlib>
+#include <spdlog/spdlog.h>
+#include <thread>
+
+namespace
+{
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void run(const std::string &type, int jobs, int producers)
+{
+    QueueBackendConfig config;
+    config.type = type;
+    config.reset = true;
+    config.sqlite_path = "bench.db";
+    config.journal_path = "bench_journal";
+    std::shared_ptr<QueueBackend> backend = create_queue_backend(config);
+    if (!backend)
+    {
+        spdlog::error("Could not open {} backend", type);
+        return;
+    }
+
+    json args = {{"recipient", "test@example.com"},
+                 {"subject", "Benchmark"},
+                 {"body", std::string(512, 'x')}};
+
+    // Enqueue from several threads so that the journal can group its flushes
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < producers; ++t)
+    {
+        threads.emplace_back([&, t]()
+                             {
+            for (int i = t; i < jobs; i += producers)
+            {
+                Job job{args, "SendEmail"};
+                backend->enqueue(job);
+            } });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    double enqueue_time = seconds_since(start);
+
+    // Claim and complete every job like a worker does
+    start = std::chrono::steady_clock::now();
+    int done = 0;
+    while (done < jobs)
+    {
+        std::vector<std::unique_ptr<Job>> claimed = backend->claim("wrk_bench", 1);
+        if (claimed.empty())
+        {
+            break;
+        }
+        Job &job = *claimed.front();
+        job.set_reserved_by(std::nullopt);
+        job.increase_attempts();
+        job.set_latest_attempt_to_now();
+        job.set_state("succeeded");
+        backend->ack(job);
+        done += 1;
+    }
+    double claim_time = seconds_since(start);
+
+    spdlog::warn("{:>8}: enqueue {:>10.0f} jobs/s, claim+ack {:>10.0f} jobs/s ({} jobs, {} producers)",
+                 type, jobs / enqueue_time, done / claim_time, jobs, producers);
+}
+}
+
+int main(int argc, char *argv[])
+{
+    int jobs = argc > 1 ? std::atoi(argv[1]) : 10000;
+    int producers = argc > 2 ? std::atoi(argv[2]) : 4;
+    spdlog::set_level(spdlog::level::warn);
+
+    run("sqlite", jobs, producers);
+    run("journal", jobs, producers);
+    return 0;
+}
@@ -0,0 +1,333 @@
+// Sends batches of emails through SmtpSession to an in-process fake SMTP server that delays every
+// reply by a round trip time, once with PIPELINING and CHUNKING, once with PIPELINING only and once
+// with neither. Every fifth recipient is rejected, to check that failures are attributed to their
+// message. A last run has the server close every connection with a 421 after one and a half
+// batches of accepted messages, so the session has to reconnect both during a batch and between two batches without
+// losing or repeating a message. Exits with 1 if a result does not match what the server did.
+// Usage: smtp_pipeline_bench [emails] [batch] [rtt_ms]
+#include "../include/smtp_session.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+// Minimal ESMTP server. Commands are parsed as soon as they arrive and each reply is sent one round
+// trip later, so that pipelined commands overlap like they would on a slow link. With a message
+// limit, a connection is closed with a 421 once it accepted that many messages
+class FakeSmtpServer
+{
+private:
+    int listener;
+    bool pipelining;
+    bool chunking;
+    std::chrono::milliseconds rtt;
+    int message_limit;
+    std::atomic<bool> stopping{false};
+    std::thread acceptor;
+    std::vector<std::thread> connections;
+
+    void serve(int fd)
+    {
+        std::deque<std::pair<Clock::time_point, std::string>> replies;
+        auto reply = [&](std::string text)
+        {
+            replies.emplace_back(Clock::now() + rtt, std::move(text));
+        };
+        std::string input;
+        bool in_data = false;
+        bool in_auth = false;
+        size_t chunk_left = 0;
+        bool bdat_last = false;
+        int recipients = 0;
+        int accepted_here = 0;
+        bool closing = false;
+        char buffer[64 * 1024];
+        auto accept_message = [&]
+        {
+            reply("250 2.0.0 Queued\r\n");
+            accepted += 1;
+            if (message_limit > 0 && ++accepted_here == message_limit)
+            {
+                // Commands already received are dropped, as by a server that goes away
+                reply("421 4.7.0 Too many messages, closing connection\r\n");
+                closing = true;
+            }
+        };
+
+        reply("220 fake ESMTP\r\n");
+        while (!stopping)
+        {
+            int wait_ms = 100;
+            if (!replies.empty())
+            {
+                auto due = std::chrono::duration_cast<std::chrono::milliseconds>(replies.front().first - Clock::now()).count();
+                wait_ms = static_cast<int>(std::max<long long>(due, 0));
+            }
+            pollfd pfd{fd, POLLIN, 0};
+            if (poll(&pfd, 1, wait_ms) > 0)
+            {
+                ssize_t received = ::recv(fd, buffer, sizeof(buffer), 0);
+                if (received <= 0)
+                {
+                    break;
+                }
+                input.append(buffer, received);
+            }
+            while (!replies.empty() && replies.front().first <= Clock::now())
+            {
+                ::send(fd, replies.front().second.data(), replies.front().second.size(), MSG_NOSIGNAL);
+                replies.pop_front();
+            }
+            if (closing && replies.empty())
+            {
+                break;
+            }
+
+            while (!closing)
+            {
+                if (chunk_left > 0)
+                {
+                    size_t taken = std::min(chunk_left, input.size());
+                    input.erase(0, taken);
+                    chunk_left -= taken;
+                    if (chunk_left > 0)
+                    {
+                        break;
+                    }
+                    if (recipients > 0)
+                    {
+                        accept_message();
+                    }
+                    else
+                    {
+                        reply("554 5.5.1 No valid recipients\r\n");
+                    }
+                    recipients = bdat_last ? 0 : recipients;
+                    continue;
+                }
+                if (in_data)
+                {
+                    size_t end = input.find("\r\n.\r\n");
+                    if (end == std::string::npos)
+                    {
+                        break;
+                    }
+                    input.erase(0, end + 5);
+                    in_data = false;
+                    recipients = 0;
+                    accept_message();
+                    continue;
+                }
+                size_t end = input.find("\r\n");
+                if (end == std::string::npos)
+                {
+                    break;
+                }
+                std::string line{input, 0, end};
+                input.erase(0, end + 2);
+                if (in_auth)
+                {
+                    in_auth = false;
+                    reply("235 2.7.0 Authenticated\r\n");
+                }
+                else if (line.rfind("EHLO", 0) == 0)
+                {
+                    reply(std::string("250-fake\r\n") + (pipelining ? "250-PIPELINING\r\n" : "") +
+                          (chunking ? "250-CHUNKING\r\n" : "") + "250 AUTH PLAIN\r\n");
+                }
+                else if (line.rfind("AUTH PLAIN", 0) == 0)
+                {
+                    in_auth = line.size() <= 11;
+                    reply(in_auth ? "334 \r\n" : "235 2.7.0 Authenticated\r\n");
+                }
+                else if (line.rfind("MAIL FROM:", 0) == 0)
+                {
+                    recipients = 0;
+                    reply("250 2.1.0 Ok\r\n");
+                }
+                else if (line.rfind("RCPT TO:", 0) == 0)
+                {
+                    bool rejected = line.find("reject") != std::string::npos;
+                    recipients += rejected ? 0 : 1;
+                    reply(rejected ? "550 5.1.1 Mailbox unavailable\r\n" : "250 2.1.5 Ok\r\n");
+                }
+                else if (line == "DATA")
+                {
+                    in_data = recipients > 0;
+                    reply(in_data ? "354 End data with <CR><LF>.<CR><LF>\r\n" : "554 5.5.1 No valid recipients\r\n");
+                }
+                else if (line.rfind("BDAT ", 0) == 0)
+                {
+                    chunk_left = std::strtoull(line.c_str() + 5, nullptr, 10);
+                    bdat_last = line.find("LAST") != std::string::npos;
+                    if (chunk_left == 0)
+                    {
+                        reply(recipients > 0 ? "250 2.0.0 Chunk accepted\r\n" : "554 5.5.1 No valid recipients\r\n");
+                    }
+                }
+                else if (line == "RSET" || line == "NOOP")
+                {
+                    recipients = 0;
+                    reply("250 2.0.0 Ok\r\n");
+                }
+                else if (line == "QUIT")
+                {
+                    reply("221 2.0.0 Bye\r\n");
+                }
+                else
+                {
+                    reply("500 5.5.2 Unknown command\r\n");
+                }
+            }
+        }
+        ::close(fd);
+    }
+
+public:
+    std::atomic<int> accepted{0};       // Messages accepted over all connections
+
+    FakeSmtpServer(bool pipelining_, bool chunking_, std::chrono::milliseconds rtt_, int message_limit_ = 0) : pipelining{pipelining_},
+                                                                                                             chunking{chunking_},
+                                                                                                             rtt{rtt_},
+                                                                                                             message_limit{message_limit_}
+    {
+        listener = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+        if (::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(listener, 16) != 0)
+        {
+            throw std::runtime_error("Failed to listen on loopback");
+        }
+        acceptor = std::thread{[this]
+                               {
+                                   while (!stopping)
+                                   {
+                                       pollfd pfd{listener, POLLIN, 0};
+                                       if (poll(&pfd, 1, 100) > 0)
+                                       {
+                                           int fd = ::accept(listener, nullptr, nullptr);
+                                           if (fd >= 0)
+                                           {
+                                               // Replies are small and written one by one
+                                               int nodelay = 1;
+                                               setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+                                               connections.emplace_back(&FakeSmtpServer::serve, this, fd);
+                                           }
+                                       }
+                                   }
+                               }};
+    }
+
+    ~FakeSmtpServer()
+    {
+        stopping = true;
+        acceptor.join();
+        for (std::thread &connection : connections)
+        {
+            connection.join();
+        }
+        ::close(listener);
+    }
+
+    std::string url() const
+    {
+        sockaddr_in address{};
+        socklen_t size = sizeof(address);
+        getsockname(listener, reinterpret_cast<sockaddr *>(&address), &size);
+        return "smtp://127.0.0.1:" + std::to_string(ntohs(address.sin_port));
+    }
+};
+
+// Returns the number of results that do not match the recipient
+int run(const char *name, bool pipelining, bool chunking, int emails, int batch_size, std::chrono::milliseconds rtt, int message_limit = 0)
+{
+    FakeSmtpServer server{pipelining, chunking, rtt, message_limit};
+    SmtpSession session{SmtpCredentials{server.url(), "sender@example.com", "secret", false}};
+
+    std::string body{"Subject: Test\r\n\r\n" + std::string(2048, 'x') + "\r\n.starts with a dot\r\n"};
+    std::string from{"sender@example.com"};
+    std::vector<std::string> recipients;
+    for (int i = 0; i < emails; ++i)
+    {
+        recipients.push_back((i % 5 == 3 ? "reject-" : "user-") + std::to_string(i) + "@example.com");
+    }
+    std::vector<MessageStream> streams(batch_size);
+    std::vector<SmtpMessage> batch;
+
+    int mismatches = 0;
+    int delivered = 0;
+    Clock::time_point started = Clock::now();
+    for (int first = 0; first < emails; first += batch_size)
+    {
+        batch.clear();
+        for (int i = first; i < std::min(first + batch_size, emails); ++i)
+        {
+            MessageStream &stream = streams[i - first];
+            stream.clear();
+            stream.add_text(body);
+            batch.push_back(SmtpMessage{&from, &recipients[i], &stream});
+        }
+        std::vector<SmtpResult> results{session.send(batch)};
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            bool rejected = recipients[first + i].rfind("reject", 0) == 0;
+            delivered += results[i].delivered() ? 1 : 0;
+            if (results[i].code != (rejected ? 550 : 250))
+            {
+                spdlog::error("{}: {} got {} {}", name, recipients[first + i], results[i].code, results[i].reply);
+                mismatches += 1;
+            }
+        }
+    }
+    if (server.accepted != delivered)
+    {
+        spdlog::error("{}: the server accepted {} emails, {} were reported as delivered", name, server.accepted.load(), delivered);
+        mismatches += 1;
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - started).count();
+    spdlog::info("{:>22}: {} emails ({} delivered) in {:.3f} s, {:.1f} emails/s, {:.2f} round trips per email",
+                 name, emails, delivered, seconds, emails / seconds,
+                 seconds * 1000 / rtt.count() / emails);
+    session.close();
+    return mismatches;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    int emails = argc > 1 ? std::atoi(argv[1]) : 200;
+    int batch_size = argc > 2 ? std::max(std::atoi(argv[2]), 1) : 50;
+    std::chrono::milliseconds rtt{argc > 3 ? std::max(std::atoi(argv[3]), 1) : 10};
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    int mismatches = 0;
+    mismatches += run("pipelining + chunking", true, true, emails, batch_size, rtt);
+    mismatches += run("pipelining", true, false, emails, batch_size, rtt);
+    mismatches += run("serial", false, false, emails, batch_size, rtt);
+    // Four out of five emails are accepted, so connections end in the middle and at the end of batches
+    mismatches += run("421 and reconnect", true, true, emails, batch_size, rtt, batch_size * 6 / 5);
+
+    curl_global_cleanup();
+    if (mismatches > 0)
+    {
+        spdlog::error("{} results were attributed to the wrong message", mismatches);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+#ifndef ADMISSION_CONTROLLER_H
+#define ADMISSION_CONTROLLER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "queue_backend.h"
+
+// Limits applied to submissions before any of them reaches the queue backend
+struct AdmissionConfig
+{
+    size_t max_body_size = 1024 * 1024;    // Larger request bodies are rejected before parsing
+    size_t max_queue_depth = 10000;        // Reject submissions while this many jobs are waiting
+    size_t max_in_flight = 64;             // Enqueues allowed to run concurrently
+    double client_rate = 20.0;             // Submissions per second refilled into each client's bucket
+    double client_burst = 40.0;            // Bucket size, i.e. the largest burst a client may send
+    size_t max_clients = 10000;            // Buckets kept before idle ones are dropped
+    std::chrono::milliseconds depth_refresh{250};   // How often the queue depth is read from the backend
+    std::chrono::seconds overload_retry_after{5};   // Retry-After sent while the queue is full
+};
+
+// Read the limits from the MAX_BODY_SIZE, MAX_QUEUE_DEPTH, MAX_IN_FLIGHT, CLIENT_RATE and
+// CLIENT_BURST environment variables, falling back to the defaults above
+AdmissionConfig admission_config_from_env();
+
+// Decides whether a submission is accepted. Every check only touches in-memory state: the queue
+// depth is read from the backend by a background thread once per refresh interval and corrected by
+// the number of submissions admitted since, so a request thread never waits for the backend.
+class AdmissionController
+{
+private:
+    struct TokenBucket
+    {
+        double tokens;
+        std::chrono::steady_clock::time_point refilled_at;
+    };
+
+    QueueBackend *backend;
+    AdmissionConfig config;
+    std::vector<std::string> queues;
+
+    std::mutex buckets_mutex;
+    std::unordered_map<std::string, TokenBucket> buckets;
+
+    std::atomic<size_t> in_flight;
+    std::atomic<size_t> cached_depth;
+    std::atomic<size_t> admitted_since_refresh;
+
+    std::thread refresher;
+    std::mutex refresher_mutex;
+    std::condition_variable refresher_wake;
+    bool stopping;                      // Guarded by refresher_mutex
+
+    void refresh_depth();
+    void refresh_loop();
+    size_t queue_depth() const;
+    void drop_idle_buckets(std::chrono::steady_clock::time_point now);
+
+public:
+    // Holds an in-flight slot and returns it when it goes out of scope
+    class Slot
+    {
+    private:
+        AdmissionController *controller;
+
+    public:
+        explicit Slot(AdmissionController *controller_);
+        ~Slot();
+        Slot(Slot &&other) noexcept;
+        // Prevent copying
+        Slot(const Slot &) = delete;
+        Slot &operator=(const Slot &) = delete;
+        Slot &operator=(Slot &&) = delete;
+    };
+
+    AdmissionController(QueueBackend &backend_, const AdmissionConfig &config_, const std::vector<std::string> &queues_ = {"default"});
+    ~AdmissionController();
+    // Prevent copying
+    AdmissionController(const AdmissionController &) = delete;
+    AdmissionController &operator=(const AdmissionController &) = delete;
+
+    // Read the queue depth once and start refreshing it in the background
+    void start();
+    void stop();
+
+    const AdmissionConfig &get_config() const;
+    // Take a token from the client's bucket. Returns how long the client has to wait if the bucket is empty
+    std::optional<std::chrono::seconds> throttle(const std::string &client);
+    // Reserve an in-flight slot if the queue has room. Returns std::nullopt if the system is overloaded
+    std::optional<Slot> acquire();
+};
+
+#endif // ADMISSION_CONTROLLER_H
@@ -0,0 +1,99 @@
+#ifndef ATTACHMENT_H
+#define ATTACHMENT_H
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+// Read-only memory mapping of an attachment file. Its pages live in the page cache, so a file
+// sent by many jobs at once is only held in memory once.
+class MappedFile
+{
+private:
+    int fd;
+    const char *data;
+    size_t size;
+
+public:
+    MappedFile(int fd_, const char *data_, size_t size_);
+    ~MappedFile();
+    // Prevent copying
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // Returns nullptr if the file cannot be opened or mapped
+    static std::shared_ptr<const MappedFile> open(const std::string &path);
+    const char *get_data() const;
+    size_t get_size() const;
+};
+
+// Resolves attachment references of jobs to files below a root directory. A reference is either
+// {"path": "<relative path>"} or {"hash": "<content hash>"}, the latter naming a file of the
+// content-addressed store at <root>/<hash>, so identical attachments are stored once. Files that
+// are sent by several jobs at the same time share one mapping.
+class AttachmentStore
+{
+private:
+    std::string root;
+    std::mutex files_mutex;
+    std::unordered_map<std::string, std::weak_ptr<const MappedFile>> open_files;
+
+    std::string resolve(const json &reference) const;
+
+public:
+    explicit AttachmentStore(const std::string &root_);
+
+    // Cheap check of a submitted reference. Returns an error message, or nullptr if it is valid
+    static const char *validate(const json &reference);
+    // Throws std::runtime_error if the referenced file cannot be opened
+    std::shared_ptr<const MappedFile> open(const json &reference);
+};
+
+// Outgoing message read piece by piece while it is written to the SMTP connection. Text is copied
+// from strings, attachments are base64 encoded straight from their mapping into the reader's
+// buffer, so the memory used per send does not depend on the size of the attachments.
+class MessageStream
+{
+private:
+    struct Part
+    {
+        const std::string *text;                // Either a text
+        std::shared_ptr<const MappedFile> file; // or a file sent base64 encoded
+    };
+
+    std::vector<Part> parts;
+    std::deque<std::string> texts;              // Texts owned by the stream, a deque keeps them in place
+    size_t current;                             // Part being read
+    size_t offset;                              // Bytes of the current part consumed so far
+    char line[80];                              // Encoded line that did not fit into the last read
+    size_t line_size;
+    size_t line_offset;
+
+    size_t encode_line(const MappedFile &file, char *out);
+
+public:
+    MessageStream();
+
+    // Start a new message. Releases the files of the previous one
+    void clear();
+    // Append a text that outlives the stream
+    void add_text(const std::string &text);
+    // Append a text owned by the stream
+    void add_owned_text(std::string text);
+    // Append a file, base64 encoded in lines of 76 characters
+    void add_base64(std::shared_ptr<const MappedFile> file);
+    // Size of the whole message, attachments included
+    size_t size() const;
+    // Read the message again from its start
+    void rewind();
+    // Copy up to max_size bytes of the message into out. Returns 0 at the end of the message
+    size_t read(char *out, size_t max_size);
+};
+
+#endif // ATTACHMENT_H
@@ -4,6 +4,9 @@
 #include <chrono>
 #include <string>
 
+// Format a time as UTC in the format "%Y-%m-%d %H:%M:%S", which is also used by SQLite's CURRENT_TIMESTAMP
 std::string chrono_to_string(const std::chrono::system_clock::time_point &tp);
+// Inverse of chrono_to_string, i.e. parses UTC in the format "%Y-%m-%d %H:%M:%S"
+std::chrono::system_clock::time_point string_to_chrono(const std::string &value);
 
 #endif // CHRONO_TO_STRING
@@ -1,19 +1,73 @@
 #ifndef EMAIL_SENDER_H
 #define EMAIL_SENDER_H
 
+#include <memory>
 #include <string>
 #include "queueable.h"
+#include "email_template.h"
+#include "attachment.h"
+#include "smtp_session.h"
 
-class SendEmail: public Queueable
+// Arguments of a SendEmail job. The fields refer to the values inside the job arguments,
+// so decoding does not copy them. A job either carries its subject and body inline or the id
+// of a registered template and the variables to render it with. Attachments are only referenced,
+// see AttachmentStore.
+struct EmailPayload
+{
+    const std::string &recipient;
+    const std::string *subject;         // Inline content, nullptr for template mails
+    const std::string *body;
+    const std::string *template_id;     // Template mails, nullptr for inline content
+    const json *vars;
+    const json *attachments;            // Array of attachment references, nullptr if there are none
+
+    // Throws if a field is missing or not a string
+    static EmailPayload decode(const json &args);
+    // Cheap check of submitted arguments. Template mails are checked against the registered
+    // templates if they are given. Returns an error message, or nullptr if the arguments are valid
+    static const char *validate(const json &args, const TemplateStore *templates = nullptr);
+};
+
+class SendEmail: public TypedQueueable<EmailPayload>
 {
 private:
+    const SmtpCredentials *credentials;
+    const TemplateStore *templates;
+    AttachmentStore *attachments;       // Shared by all workers, nullptr if attachments are disabled
+    std::unique_ptr<SmtpSession> session;   // Connection reused between the jobs handled by this instance
+    std::vector<std::string> messages;  // Reused buffers for the headers and text of the messages of a batch
+    std::vector<MessageStream> streams; // Feed the messages and their attachments to the session
+
+    // Compose the message of the payload into buffer and content. Throws if its template or an
+    // attachment is missing
+    void prepare(const EmailPayload &payload, std::string &buffer, MessageStream &content);
+
 public:
+    static constexpr const char *job_name = "SendEmail";
+    static constexpr int type_id = 1;
+
     SendEmail();
     ~SendEmail();
-    // Function to send an email using libcurl
-    void send_email(const json &args, const json &credentials);
-    void dispatch(const json &args);
-    void handle(const json &args, std::optional<json> credentials) override;
+    // Maximum number of attachments per email
+    static constexpr size_t max_attachments = 20;
+
+    // Assemble the message into the given buffer, which is sized up front. Template mails are
+    // rendered straight into the buffer, email_template must then be the template of the payload.
+    // If a MIME boundary is given, the text becomes the first part of a multipart message whose
+    // attachment parts and closing boundary are added by the caller.
+    static void compose_message(std::string &buffer,
+                                const std::string &from_email,
+                                const EmailPayload &payload,
+                                const EmailTemplate *email_template = nullptr,
+                                const std::string *boundary = nullptr);
+    std::optional<std::string> dispatch(const json &args,
+                                        const std::optional<std::string> &idempotency_key = std::nullopt,
+                                        std::chrono::system_clock::time_point *key_taken_at = nullptr);
+    void configure(const JobContext &context) override;
+    void handle_payload(const EmailPayload &payload) override;
+    void cancel() override;
+    // Send the emails of a batch over one connection, see SmtpSession. A refused email fails its job only
+    void handle_payloads(const std::vector<EmailPayload> &payloads, std::vector<std::exception_ptr> &errors) override;
 };
 
 
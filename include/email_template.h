@@ -0,0 +1,70 @@
+#ifndef EMAIL_TEMPLATE_H
+#define EMAIL_TEMPLATE_H
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+// Text with {{variable}} placeholders, compiled once into a list of segments. Literal segments
+// point into a single string holding all literal text, so rendering is a sequence of appends
+// without any parsing.
+class CompiledTemplate
+{
+private:
+    struct Segment
+    {
+        bool variable;
+        size_t offset;                  // Literal: position in literals, variable: index into variables
+        size_t length;
+    };
+
+    std::string literals;
+    std::vector<std::string> variables;
+    std::vector<Segment> segments;
+
+public:
+    CompiledTemplate() = default;
+    // Throws std::invalid_argument if a placeholder is not closed or has no name
+    explicit CompiledTemplate(const std::string &source);
+
+    const std::vector<std::string> &get_variables() const;
+    // Upper bound of the rendered size, used to size the output buffer up front
+    size_t rendered_size(const json &vars) const;
+    // Append the text with its placeholders replaced by the given variables. Line breaks in values
+    // are replaced by spaces if single_line is set, so that values cannot inject mail headers.
+    // Throws std::runtime_error if a variable is missing.
+    void render(std::string &buffer, const json &vars, bool single_line = false) const;
+};
+
+// Replace the line breaks appended to buffer since start by spaces, so that a header value
+// cannot inject further mail headers
+void flatten_line_breaks(std::string &buffer, size_t start);
+
+struct EmailTemplate
+{
+    CompiledTemplate subject;
+    CompiledTemplate body;
+};
+
+// Templates registered at startup, looked up by their id. The store is not modified once the
+// workers are running, so lookups need no locking and every worker can keep its own copy.
+class TemplateStore
+{
+private:
+    std::unordered_map<std::string, std::shared_ptr<const EmailTemplate>> templates;
+
+public:
+    // Compile and register a template. Throws std::invalid_argument if it does not compile
+    void add(const std::string &id, const std::string &subject, const std::string &body);
+    // Register every <id>.json file of the directory, each holding a "subject" and a "body".
+    // Returns the number of registered templates
+    size_t load_directory(const std::string &directory);
+    // Returns nullptr if no template with this id is registered
+    const EmailTemplate *find(const std::string &id) const;
+};
+
+#endif // EMAIL_TEMPLATE_H
@@ -0,0 +1,43 @@
+#ifndef IDEMPOTENCY_CACHE_H
+#define IDEMPOTENCY_CACHE_H
+
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+// In-process front of the idempotency keys stored by the queue backend. An LRU of recent keys answers
+// repeated submissions with the id of their job without a round trip to the backend. The backend
+// stays authoritative: a miss here only means the key has to be checked by enqueue_once, which takes
+// the key and stores the job in the same round trip.
+class IdempotencyCache
+{
+private:
+    struct Item
+    {
+        std::string key;
+        std::string job_id;
+        std::chrono::steady_clock::time_point stored_at;
+    };
+
+    size_t capacity;
+    std::chrono::seconds window;
+    std::mutex cache_mutex;
+    std::list<Item> recent;             // Most recently used first
+    std::unordered_map<std::string, std::list<Item>::iterator> items;
+
+public:
+    IdempotencyCache(size_t capacity_ = 100000, std::chrono::seconds window_ = std::chrono::hours(24));
+
+    // Id of the job that took the key within the window, if it is still cached
+    std::optional<std::string> find(const std::string &key);
+    // Cache the job holding the key. taken_at is when the backend stored the key, so that the key is
+    // forgotten here no later than in the backend
+    void remember(const std::string &key, const std::string &job_id, std::chrono::system_clock::time_point taken_at);
+    // Drop the keys older than the window
+    void expire();
+};
+
+#endif // IDEMPOTENCY_CACHE_H
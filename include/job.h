@@ -2,11 +2,13 @@
 #define JOB_H
 
 #include <chrono>
+#include <optional>
 #include <string>
 #include <nlohmann/json.hpp>
-#include <sqlite3.h>
 #include "randomhex.h"
 
+class QueueBackend;
+
 using json = nlohmann::json;
 
 class Job
@@ -15,6 +17,7 @@ class Job
 private:
     std::string id;
     std::string name;                                                           // Name of Queueable subclass, which the job handles
+    int type_id;                                                                // Type id of that subclass, 0 if unknown
     std::string queue;                                                          // Queue name (indicates priority)
     json args;
     int attempts;
@@ -24,9 +27,26 @@ private:
     std::string state;
     std::optional<std::string> error_details;
     std::optional<std::string> reserved_by;                                     //id of worker which wants to execute this job
+    std::optional<std::string> claimed_by;                                      // Worker that held the reservation when the job was loaded, not stored
+    unsigned dirty_fields;                                                      // Fields changed since the job was loaded or written
 
 public:
-    Job(const json &args_,
+    // Fields a state transition may change. The setters mark them, so that backends can write only
+    // the changed columns instead of the whole job
+    enum Field : unsigned
+    {
+        field_type_id = 1 << 0,
+        field_queue = 1 << 1,
+        field_attempts = 1 << 2,
+        field_created_at = 1 << 3,
+        field_next_execution_at = 1 << 4,
+        field_last_executed_at = 1 << 5,
+        field_state = 1 << 6,
+        field_error_details = 1 << 7,
+        field_reserved_by = 1 << 8,
+    };
+
+    Job(json args_,
         const std::string &name_ = "Queueable",
         const std::string &queue_ = "default",
         const int &attempts_ = 0,
@@ -36,7 +56,7 @@ public:
         std::optional<std::string> error_details_ = std::nullopt,
         std::optional<std::string> reserved_by_ = std::nullopt);
     Job(const std::string &id_,
-        const json &args_,
+        json args_,
         const std::string &name_ = "Queueable",
         const std::string &queue_ = "default",
         const int &attempts_ = 0,
@@ -45,10 +65,30 @@ public:
         const std::string &state_ = "waiting",
         std::optional<std::string> error_details_ = std::nullopt,
         std::optional<std::string> reserved_by_ = std::nullopt);
-    void save(sqlite3 *db = nullptr) const;
-    std::string get_id() const;
+    bool save(QueueBackend *backend = nullptr) const;
+    const std::string &get_id() const;
     std::string get_name() const;
-    json get_args() const;
+    int get_type_id() const;
+    const json &get_args() const;
+    std::string get_queue() const;
+    int get_attempts() const;
+    std::chrono::system_clock::time_point get_created_at() const;
+    std::optional<std::chrono::system_clock::time_point> get_next_execution_at() const;
+    std::optional<std::chrono::system_clock::time_point> get_last_executed_at() const;
+    std::string get_state() const;
+    std::optional<std::string> get_error_details() const;
+    std::optional<std::string> get_reserved_by() const;
+    // Worker the job was claimed by. Kept when the reservation is cleared, so that backends can check
+    // that the worker still holds it when the result is stored
+    std::optional<std::string> get_claimed_by() const;
+    // State reported to clients: waiting jobs reserved by a worker are reported as running
+    std::string get_status() const;
+    unsigned get_dirty_fields() const;
+    bool is_dirty(Field field) const;
+    // Called once the changes have been written, and by backends after loading a job
+    void clear_dirty();
+    void set_type_id(int type_id_);
+    void set_created_at(std::chrono::system_clock::time_point created_at_);
     void set_reserved_by(std::optional<std::string> worker_id);
     void increase_attempts();
     void set_latest_attempt_to_now();
@@ -0,0 +1,49 @@
+#ifndef JOB_STATUS_CACHE_H
+#define JOB_STATUS_CACHE_H
+
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include "job.h"
+#include "queue_backend.h"
+
+// Bounded LRU of recent job states in front of the queue backend. Workers update it on every state
+// transition, so clients polling a job are usually answered from memory instead of competing with
+// the claim and complete writes for the database. States of unfinished jobs are only trusted for a
+// short time, as they may have been changed by workers of another process.
+class JobStatusCache
+{
+private:
+    struct Item
+    {
+        std::string id;
+        json status;
+        bool finished;
+        std::chrono::steady_clock::time_point stored_at;
+    };
+
+    size_t capacity;
+    std::chrono::milliseconds unfinished_ttl;
+    std::mutex cache_mutex;
+    std::list<Item> recent;             // Most recently used first
+    std::unordered_map<std::string, std::list<Item>::iterator> items;
+
+    // Must be called with cache_mutex held
+    void store(const std::string &id, json status, bool finished);
+
+public:
+    JobStatusCache(size_t capacity_ = 10000, std::chrono::milliseconds unfinished_ttl_ = std::chrono::seconds(2));
+
+    // Status of a job as returned by the API. The arguments are left out, they may hold personal data.
+    static json describe(const Job &job);
+
+    // Record the current state of a job
+    void update(const Job &job);
+    // Status of a job, read from the backend on a miss. Returns std::nullopt if the job is unknown
+    std::optional<json> get(const std::string &id, QueueBackend &backend);
+};
+
+#endif // JOB_STATUS_CACHE_H
@@ -0,0 +1,167 @@
+#ifndef JOURNAL_QUEUE_H
+#define JOURNAL_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include "queue_backend.h"
+
+// A fixed-size journal file mapped into memory. Records are appended until the segment is full,
+// after which it is sealed and only read from until it is reclaimed by compaction.
+struct JournalSegment
+{
+    uint32_t number;
+    std::string path;
+    int fd;
+    char *data;
+    size_t capacity;
+    size_t write_pos;                   // End of the last complete record
+    size_t synced_pos;                  // Everything before this offset has been flushed to disk
+
+    JournalSegment(uint32_t number_, const std::string &path_, int fd_, char *data_, size_t capacity_);
+    ~JournalSegment();
+    // Prevent copying
+    JournalSegment(const JournalSegment &) = delete;
+    JournalSegment &operator=(const JournalSegment &) = delete;
+    bool sync(size_t from, size_t to) const;
+};
+
+// Queue backend appending every enqueue and state transition to a segmented, memory-mapped
+// journal. An in-memory index maps each unfinished job to its latest state and to the offset
+// of its full snapshot, so jobs are only materialized from the mapping when they are claimed.
+// Appends are made durable in groups by a background flusher, segments that only hold finished
+// jobs are reclaimed by a background compactor and the index is rebuilt by replaying all
+// segments when the journal is opened. Idempotency keys are journaled as small records of their
+// own and kept in memory until they expire. An enqueued job is only indexed, and thereby claimable,
+// once its records have been flushed, so a failed enqueue never leaves a job behind for the workers.
+// Reservations are not journaled. After a restart every unfinished job is handed out again,
+// including jobs a worker was executing when the process stopped, so jobs are delivered at least once.
+// While the process runs, a reservation is a lease that expires after the lease timeout.
+// The states of the most recently finished jobs are kept without their arguments, so that clients can
+// still look them up. After a restart only those whose record was not reclaimed yet are known.
+class JournalQueue: public QueueBackend
+{
+private:
+    // Location of a record inside the journal
+    struct Location
+    {
+        uint32_t segment;
+        size_t offset;
+        size_t size;
+    };
+
+    // State of an unfinished job. The arguments are only kept in the snapshot record.
+    struct Entry
+    {
+        Location snapshot;
+        std::string name;
+        int type_id;
+        std::string queue;
+        std::chrono::system_clock::time_point created_at;
+        std::optional<std::chrono::system_clock::time_point> next_execution_at;
+        std::optional<std::chrono::system_clock::time_point> last_executed_at;
+        int attempts;
+        std::string state;
+        std::optional<std::string> error_details;
+        std::optional<std::string> reserved_by;
+        std::chrono::system_clock::time_point lease_expires;    // Only meaningful while reserved_by is set
+    };
+
+    // Job holding an idempotency key
+    struct KeyEntry
+    {
+        std::string job_id;
+        std::chrono::system_clock::time_point created_at;
+        Location record;
+    };
+
+    std::string directory;
+    size_t segment_size;
+    bool sync_appends;                  // Wait for the group flush before acknowledging an append
+    double compaction_ratio;            // Compact the oldest segment once its live data drops below this fraction
+    std::vector<std::string> queues;
+    std::chrono::seconds lease_timeout;
+
+    std::mutex journal_mutex;
+    std::condition_variable flush_cv;   // Wakes the flusher when there is unsynced data
+    std::condition_variable synced_cv;  // Wakes appenders when their record has been flushed
+    std::condition_variable stop_cv;    // Wakes the compactor on shutdown
+    std::map<uint32_t, std::shared_ptr<JournalSegment>> segments;
+    std::shared_ptr<JournalSegment> active;
+    std::unordered_map<uint32_t, size_t> live_bytes;    // Bytes of live snapshots per segment
+    uint64_t appended_bytes;
+    uint64_t synced_bytes;
+
+    std::unordered_map<std::string, Entry> index;
+    std::unordered_map<std::string, std::deque<std::string>> ready;     // Due job ids per queue, oldest first
+    std::multimap<std::chrono::system_clock::time_point, std::string> delayed;
+    std::deque<std::pair<std::chrono::system_clock::time_point, std::string>> leases;  // Reserved job ids by lease expiry
+    std::unordered_map<std::string, size_t> waiting;    // Number of waiting jobs per queue
+    std::unordered_map<std::string, KeyEntry> idempotency_keys;
+    std::unordered_set<std::string> pending_keys;       // Keys whose job is appended but not flushed yet
+    std::unordered_map<uint32_t, size_t> unpublished;   // Appended records per segment that are not indexed yet
+    size_t finished_capacity;
+    std::unordered_map<std::string, Entry> finished;    // Recently finished jobs, their snapshot is not used
+    std::deque<std::string> finished_order;             // Oldest first, to bound finished to finished_capacity
+
+    bool stopping;
+    bool failed;        // Set once a flush failed, unflushed records may be lost so later appends are refused
+    std::thread flusher;
+    std::thread compactor;
+
+    std::shared_ptr<JournalSegment> open_segment(uint32_t number, bool create);
+    bool roll_segment();
+    std::optional<Location> append(uint8_t type, const std::string &payload);
+    bool wait_for_sync(uint64_t target, std::unique_lock<std::mutex> &lock);
+    void replay(JournalSegment &segment);
+    void apply_snapshot(const std::string &id, const json &record, const Location &location);
+    void apply_key(const json &record, const Location &location);
+    std::optional<Location> append_key(const std::string &key, const KeyEntry &entry);
+    json snapshot_payload(const Job &job) const;
+    void publish(const std::string &id, const json &record, const Location &location);
+    void discard(const std::string &id);
+    std::unique_ptr<Job> materialize(const std::string &id, const Entry &entry) const;
+    std::string update_payload(const std::string &id, const Entry &entry) const;
+    void make_waiting(const std::string &id, Entry &entry);
+    void remember_finished(const std::string &id, Entry entry);
+    SaveResult finish(const Job &job);
+    // Whether the job was claimed by a worker that no longer holds its reservation
+    bool lost_lease(const Job &job, const Entry &entry) const;
+    void flush_loop();
+    void compact_loop();
+    bool compact_oldest();
+
+public:
+    JournalQueue(const std::string &directory_ = "journal",
+                 size_t segment_size_ = 64 * 1024 * 1024,
+                 bool sync_appends_ = true,
+                 const std::vector<std::string> &queues_ = {"default"},
+                 std::chrono::seconds lease_timeout_ = std::chrono::seconds(300),
+                 size_t finished_capacity_ = 100000);
+    ~JournalQueue();
+    // Prevent copying
+    JournalQueue(const JournalQueue &) = delete;
+    JournalQueue &operator=(const JournalQueue &) = delete;
+
+    bool open(bool reset = false);
+
+    bool enqueue(const Job &job) override;
+    std::vector<std::unique_ptr<Job>> claim(const std::string &worker_id, size_t max_jobs = 1) override;
+    SaveResult ack(const Job &job) override;
+    SaveResult nack(const Job &job) override;
+    SaveResult schedule(const Job &job, std::chrono::system_clock::time_point at) override;
+    size_t release(const std::vector<const Job *> &jobs) override;
+    size_t renew(const std::string &worker_id, const std::vector<std::string> &job_ids) override;
+    bool sync() override;
+    size_t depth(const std::string &queue = "default") override;
+    std::optional<IdempotencyKey> enqueue_once(const Job &job, const std::string &idempotency_key) override;
+    size_t expire_idempotency_keys(std::chrono::system_clock::time_point before) override;
+    std::unique_ptr<Job> get_job(const std::string &id) override;
+    std::vector<std::unique_ptr<Job>> list_jobs(const JobQuery &query) override;
+};
+
+#endif // JOURNAL_QUEUE_H
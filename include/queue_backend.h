@@ -0,0 +1,105 @@
+#ifndef QUEUE_BACKEND_H
+#define QUEUE_BACKEND_H
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "job.h"
+
+// Filter and page of a job listing
+struct JobQuery
+{
+    std::optional<std::string> state;   // waiting, running, succeeded or failed (see Job::get_status)
+    std::optional<std::string> queue;
+    size_t limit = 50;
+    size_t offset = 0;
+};
+
+// Job holding an idempotency key and the time the key was taken, from which it expires
+struct IdempotencyKey
+{
+    std::string job_id;
+    std::chrono::system_clock::time_point taken_at;
+};
+
+// Outcome of storing the result of a job
+enum class SaveResult
+{
+    saved,
+    lease_lost,     // The job was claimed again after the lease of its worker expired, nothing was written
+    failed,
+};
+
+// Storage engine behind the job queue. Implementations must be safe to share between
+// the HTTP threads that enqueue jobs and the worker threads that claim them.
+class QueueBackend
+{
+public:
+    virtual ~QueueBackend() = default;
+    // Persist a new job so that it can be claimed by a worker
+    virtual bool enqueue(const Job &job) = 0;
+    // Reserve up to max_jobs due jobs for the given worker. A reservation is a lease: once it is older
+    // than the lease timeout, e.g. because its worker was killed, the job is handed out again
+    virtual std::vector<std::unique_ptr<Job>> claim(const std::string &worker_id, size_t max_jobs = 1) = 0;
+    // Store the final state of a successfully executed job and release its reservation. Backends may
+    // write only the fields marked dirty on the job, so it must have been claimed from this backend.
+    // Nothing is written once the job is no longer reserved by the worker it was claimed by
+    // (Job::get_claimed_by), e.g. because its lease expired and another worker claimed it
+    virtual SaveResult ack(const Job &job) = 0;
+    // Store the final state of a failed job and release its reservation, like ack
+    virtual SaveResult nack(const Job &job) = 0;
+    // Put a job back into the waiting state so that it is claimed again at the given time. Its attempts,
+    // last execution and error details are stored as well, so that a job retried later keeps them.
+    // A claimed job must still be reserved by its worker, like for ack
+    virtual SaveResult schedule(const Job &job, std::chrono::system_clock::time_point at) = 0;
+    // Hand claimed jobs that were not executed back to their queue, ahead of the jobs waiting there.
+    // Their state and attempts are left untouched. Returns the number of released jobs
+    virtual size_t release(const std::vector<const Job *> &jobs) = 0;
+    // Restart the leases of the jobs that are still reserved by the worker, e.g. while it executes a
+    // long batch. Returns the number of renewed leases
+    virtual size_t renew(const std::string &worker_id, const std::vector<std::string> &job_ids) = 0;
+    // Make the writes acknowledged so far durable, e.g. before the process exits
+    virtual bool sync() = 0;
+    // Number of jobs waiting in the given queue, including those scheduled for later. Claimed jobs are not counted
+    virtual size_t depth(const std::string &queue = "default") = 0;
+    // Enqueue a job unless its idempotency key is already taken. Returns the job holding the key, i.e. the
+    // new job or the one enqueued earlier with the same key, or std::nullopt on failure
+    virtual std::optional<IdempotencyKey> enqueue_once(const Job &job, const std::string &idempotency_key) = 0;
+    // Release the idempotency keys taken before the given time. Returns the number of released keys
+    virtual size_t expire_idempotency_keys(std::chrono::system_clock::time_point before) = 0;
+    // Look up a single job. Returns nullptr if the backend does not know the job
+    virtual std::unique_ptr<Job> get_job(const std::string &id) = 0;
+    // Jobs matching the query, newest first
+    virtual std::vector<std::unique_ptr<Job>> list_jobs(const JobQuery &query) = 0;
+};
+
+// Startup configuration used to select and open a backend
+struct QueueBackendConfig
+{
+    std::string type = "sqlite";                       // sqlite, redis or journal
+    std::string sqlite_path = "database.db";
+    bool reset = false;                                // Drop existing jobs when the backend is opened
+    std::string redis_host = "127.0.0.1";
+    int redis_port = 6379;
+    std::string journal_path = "journal";              // Directory holding the journal segments
+    size_t journal_segment_size = 64 * 1024 * 1024;
+    bool journal_sync = true;                          // Acknowledge appends only after they were flushed
+    std::vector<std::string> queues = {"default"};     // Queues served by the workers, highest priority first
+    std::chrono::seconds idempotency_window{24 * 60 * 60}; // How long idempotency keys are kept
+    std::chrono::seconds lease_timeout{300};           // How long a claimed job stays reserved for its worker
+};
+
+// Read the configuration from the QUEUE_BACKEND, QUEUE_RESET, SQLITE_PATH, REDIS_HOST, REDIS_PORT,
+// JOURNAL_DIR, JOURNAL_SYNC, IDEMPOTENCY_WINDOW (seconds) and LEASE_TIMEOUT (seconds) environment
+// variables, falling back to the defaults above
+QueueBackendConfig queue_backend_config_from_env();
+// Open the backend selected by the configuration. Returns nullptr if it could not be opened
+std::shared_ptr<QueueBackend> create_queue_backend(const QueueBackendConfig &config);
+
+// Process-wide backend used by Job::save and Queueable::dispatch when no backend is passed
+void set_default_queue_backend(std::shared_ptr<QueueBackend> backend);
+QueueBackend *default_queue_backend();
+
+#endif // QUEUE_BACKEND_H
@@ -1,32 +1,209 @@
 #ifndef QUEUEABLE_H
 #define QUEUEABLE_H
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
 #include <spdlog/spdlog.h>
 #include "./job.h"
 
+// Reported by handle_batch for a job it did not start, e.g. because it was cancelled. The worker
+// hands such jobs back to the queue instead of failing them
+class JobDeferred : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Reported for a job that failed for a reason that may pass, e.g. a busy or unreachable SMTP server.
+// The worker schedules such jobs again after a growing delay and fails them after max_attempts
+class JobRetry : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Type-specific settings handed to job handlers when a worker creates them, e.g. SMTP credentials.
+// Values are looked up by their type, so new job types can bring their own settings.
+class JobContext
+{
+private:
+    std::unordered_map<std::type_index, std::shared_ptr<const void>> values;
+
+public:
+    template <typename T>
+    void set(T value)
+    {
+        values[std::type_index(typeid(T))] = std::make_shared<const T>(std::move(value));
+    }
+
+    // Returns nullptr if no value of this type was set
+    template <typename T>
+    const T *get() const
+    {
+        auto it = values.find(std::type_index(typeid(T)));
+        return it == values.end() ? nullptr : static_cast<const T *>(it->second.get());
+    }
+};
+
 class Queueable
 {
 private:
 public:
+    // Every subclass defines its own name and a small, stable type id which is stored with its jobs.
+    // Type id 0 is reserved for jobs of unknown type.
+    static constexpr const char *job_name = "Queueable";
+    static constexpr int type_id = 0;
+
     Queueable();
-    virtual void dispatch(const json &args, const std::string &name = "Queueable"); // TODO: Do I need to put in options?
-    virtual void handle(const json &args, std::optional<json> credentials = std::nullopt);
+    virtual ~Queueable() = default;
+    // Enqueue a job and return its id, or std::nullopt if it could not be stored. Jobs dispatched again
+    // with the same idempotency key are not enqueued twice, the id of the first job is returned instead.
+    // If key_taken_at is given, it receives the time the idempotency key was first taken.
+    virtual std::optional<std::string> dispatch(const json &args,
+                                                const std::string &name = "Queueable",
+                                                int type_id_ = 0,
+                                                const std::optional<std::string> &idempotency_key = std::nullopt,
+                                                std::chrono::system_clock::time_point *key_taken_at = nullptr); // TODO: Do I need to put in options?
+    // Called once after a worker created the handler, before it handles any jobs
+    virtual void configure(const JobContext &context);
+    virtual void handle(const json &args);
+    // Handle several jobs of this type at once. errors[i] is set if the i-th job failed, errors has
+    // the size of batch. The default handles the jobs one by one; job types that can share work
+    // between jobs override it, e.g. to send several emails over one connection.
+    virtual void handle_batch(const std::vector<const json *> &batch, std::vector<std::exception_ptr> &errors);
+    // Called from another thread when a shutdown is about to give up on the running handle_batch. It
+    // should return soon after, reporting the jobs it did not start with JobDeferred. Does nothing by default
+    virtual void cancel();
 };
 
-// QueableFactory and QueueableRegistry provide a way to register subclasses of the Queueable class
-// and then create instances of these via their name
-using QueueableFactory = std::function<std::unique_ptr<Queueable>(void)>;
+// Base class for job types with a typed payload. The payload is decoded from the job arguments once
+// per job and handed to handle_payload by reference. Payload::decode(const json &) may keep references
+// into the arguments, which stay valid until handle_payload returns.
+template <typename Payload>
+class TypedQueueable: public Queueable
+{
+public:
+    using payload_type = Payload;
+
+    void handle(const json &args) final
+    {
+        handle_payload(Payload::decode(args));
+    }
 
-class QueueableRegistry
+    void handle_batch(const std::vector<const json *> &batch, std::vector<std::exception_ptr> &errors) final
+    {
+        std::vector<Payload> payloads;
+        std::vector<size_t> positions;
+        payloads.reserve(batch.size());
+        positions.reserve(batch.size());
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            try
+            {
+                payloads.push_back(Payload::decode(*batch[i]));
+                positions.push_back(i);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+        }
+        std::vector<std::exception_ptr> payload_errors(payloads.size());
+        handle_payloads(payloads, payload_errors);
+        for (size_t i = 0; i < payloads.size(); ++i)
+        {
+            errors[positions[i]] = payload_errors[i];
+        }
+    }
+
+    virtual void handle_payload(const Payload &payload) = 0;
+    // Batch counterpart of handle_payload, see Queueable::handle_batch. Handles them one by one by default
+    virtual void handle_payloads(const std::vector<Payload> &payloads, std::vector<std::exception_ptr> &errors)
+    {
+        for (size_t i = 0; i < payloads.size(); ++i)
+        {
+            try
+            {
+                handle_payload(payloads[i]);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+        }
+    }
+};
+
+// Type-erased interface of QueueableRegistry used by the workers
+class QueueableRegistryBase
+{
+public:
+    virtual ~QueueableRegistryBase() = default;
+    // Create one configured handler per registered type, indexed by type id. Workers keep and reuse them.
+    virtual std::vector<std::unique_ptr<Queueable>> create_handlers(const JobContext &context) const = 0;
+    // Type id of the job type with the given name, or 0 if it is not registered
+    virtual int lookup_type_id(std::string_view name) const = 0;
+};
+
+// Registers the given Queueable subclasses at compile time. Workers dispatch jobs by the type id
+// stored with them instead of looking up names at runtime.
+template <typename... Types>
+class QueueableRegistry: public QueueableRegistryBase
 {
 private:
-    std::unordered_map<std::string, QueueableFactory> registry;
+    static constexpr std::array<int, sizeof...(Types)> type_ids{Types::type_id...};
+
+    static constexpr bool valid_type_ids()
+    {
+        for (size_t i = 0; i < type_ids.size(); ++i)
+        {
+            if (type_ids[i] <= 0)
+            {
+                return false;
+            }
+            for (size_t j = i + 1; j < type_ids.size(); ++j)
+            {
+                if (type_ids[i] == type_ids[j])
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    static_assert(valid_type_ids(), "Registered Queueable types need unique, positive type ids");
 
 public:
-    QueueableRegistry(/* args */);
-    ~QueueableRegistry();
-    void registerQueueable(const std::string &name, QueueableFactory factory);
-    std::unique_ptr<Queueable> createQueueable(const std::string &name) const;
+    static constexpr size_t table_size = std::max({0, Types::type_id...}) + 1;
+
+    std::vector<std::unique_ptr<Queueable>> create_handlers(const JobContext &context) const override
+    {
+        std::vector<std::unique_ptr<Queueable>> handlers(table_size);
+        ((handlers[Types::type_id] = std::make_unique<Types>()), ...);
+        for (std::unique_ptr<Queueable> &handler : handlers)
+        {
+            if (handler)
+            {
+                handler->configure(context);
+            }
+        }
+        return handlers;
+    }
+
+    int lookup_type_id(std::string_view name) const override
+    {
+        int id = 0;
+        ((name == Types::job_name ? (id = Types::type_id) : 0), ...);
+        return id;
+    }
 };
 
 // Dummy class for experimenting
@@ -36,11 +213,14 @@ private:
     //std::string log_msg;
 
 public:
+    static constexpr const char *job_name = "LogQueueable";
+    static constexpr int type_id = 2;
+
     LogQueueable();
     // LogQueueable(const std::string &log_msg);
     ~LogQueueable();
-    void handle(const json &args, std::optional<json> credentials = std::nullopt) override;
-    void dispatch(const json &args);
+    void handle(const json &args) override;
+    std::optional<std::string> dispatch(const json &args);
 };
 
 #endif // QUEUEABLE_H
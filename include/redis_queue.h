@@ -0,0 +1,84 @@
+#ifndef REDIS_QUEUE_H
+#define REDIS_QUEUE_H
+
+#include <mutex>
+#include <vector>
+#include <hiredis/hiredis.h>
+#include "queue_backend.h"
+
+// Queue backend keeping jobs in Redis. Every job is stored in a hash, due jobs are kept in one
+// list per queue, delayed jobs in one sorted set per queue scored by their execution time and claimed jobs
+// are moved to a per-worker processing list until they are acked, nacked or rescheduled. Their
+// leases are kept in a sorted set scored by expiry, expired ones are moved back by the next claim.
+// Idempotency keys are plain string keys holding the job id, which Redis expires by itself.
+// Every call borrows a connection from a small pool, so that worker and HTTP threads do not
+// wait for each other's round trips.
+class RedisQueue: public QueueBackend
+{
+private:
+    // A connection borrowed from the pool for one call. A connection that saw an error is closed
+    // instead of being returned, so that the next call opens a new one
+    class Connection
+    {
+    private:
+        RedisQueue *queue;
+        redisContext *ctx;
+
+    public:
+        explicit Connection(RedisQueue *queue_);
+        ~Connection();
+        // Prevent copying
+        Connection(const Connection &) = delete;
+        Connection &operator=(const Connection &) = delete;
+
+        // nullptr if no connection could be opened
+        redisContext *get() const;
+    };
+
+    std::string host;
+    int port;
+    std::vector<std::string> queues;
+    std::chrono::seconds idempotency_window;
+    std::chrono::seconds lease_timeout;
+    std::vector<redisContext *> idle;   // Open connections not in use. hiredis contexts must not be shared between threads
+    std::mutex pool_mutex;              // Guards idle
+    std::string claim_sha;              // SHA1 of the Lua scripts loaded on connect
+    std::string update_sha;
+    std::string release_sha;
+    std::string renew_sha;
+    std::string enqueue_once_sha;
+
+    redisContext *open_connection();
+    SaveResult update(const Job &job, const std::vector<std::string> &fields, const std::string &score = "");
+
+public:
+    RedisQueue(const std::string &host_ = "127.0.0.1",
+               int port_ = 6379,
+               const std::vector<std::string> &queues_ = {"default"},
+               std::chrono::seconds idempotency_window_ = std::chrono::hours(24),
+               std::chrono::seconds lease_timeout_ = std::chrono::seconds(300));
+    ~RedisQueue();
+    // Prevent copying
+    RedisQueue(const RedisQueue &) = delete;
+    RedisQueue &operator=(const RedisQueue &) = delete;
+
+    // Open the first connection and load the scripts. Later calls reconnect on their own
+    bool connect();
+    bool flush();
+
+    bool enqueue(const Job &job) override;
+    std::vector<std::unique_ptr<Job>> claim(const std::string &worker_id, size_t max_jobs = 1) override;
+    SaveResult ack(const Job &job) override;
+    SaveResult nack(const Job &job) override;
+    SaveResult schedule(const Job &job, std::chrono::system_clock::time_point at) override;
+    size_t release(const std::vector<const Job *> &jobs) override;
+    size_t renew(const std::string &worker_id, const std::vector<std::string> &job_ids) override;
+    bool sync() override;
+    size_t depth(const std::string &queue = "default") override;
+    std::optional<IdempotencyKey> enqueue_once(const Job &job, const std::string &idempotency_key) override;
+    size_t expire_idempotency_keys(std::chrono::system_clock::time_point before) override;
+    std::unique_ptr<Job> get_job(const std::string &id) override;
+    std::vector<std::unique_ptr<Job>> list_jobs(const JobQuery &query) override;
+};
+
+#endif // REDIS_QUEUE_H
@@ -0,0 +1,125 @@
+#ifndef SMTP_SESSION_H
+#define SMTP_SESSION_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <curl/curl.h>
+#include "attachment.h"
+
+// SMTP settings handed to SendEmail through the JobContext
+struct SmtpCredentials
+{
+    std::string server;
+    std::string user;
+    std::string password;
+    bool require_tls = true;            // Refuse servers without TLS, disable only for local relays
+};
+
+// A message handed to SmtpSession::send. The content must end with CRLF
+struct SmtpMessage
+{
+    const std::string *from;
+    const std::string *recipient;
+    MessageStream *content;
+};
+
+// Outcome of one message: the reply that decided it, i.e. 250 to the end of its data if it was
+// accepted, or the first reply rejecting it. code is 0 if the connection failed before that
+struct SmtpResult
+{
+    int code;
+    std::string reply;
+    bool cancelled = false;             // The session was cancelled before the message was sent
+
+    bool delivered() const;
+    // A 5xx reply, sending the message again will fail the same way
+    bool is_permanent() const;
+};
+
+// Authenticated connection to the SMTP server that sends messages in batches. curl connects,
+// negotiates TLS and authenticates; the mail transactions are then written over the connection
+// directly. If the server advertises PIPELINING, the commands of a message are sent without
+// waiting for each reply, and with CHUNKING (BDAT) the transactions of the whole batch are sent
+// back to back, so a batch costs about one round trip instead of four per message. Without
+// these extensions the commands are sent one at a time. The connection is kept between batches.
+class SmtpSession
+{
+private:
+    enum Step
+    {
+        reset,
+        mail,
+        recipient,
+        data,
+        end_of_data,
+        chunk
+    };
+    struct Pending
+    {
+        size_t message;
+        Step step;
+    };
+
+    SmtpCredentials credentials;
+    std::chrono::milliseconds timeout;
+    CURL *curl;
+    curl_socket_t socket;               // Guarded by socket_mutex against cancel()
+    std::mutex socket_mutex;
+    std::atomic<bool> cancelled;
+    size_t started;                     // Messages of the current batch whose transaction was begun
+    bool pipelining;
+    bool chunking;
+    bool reading_ehlo;                  // Parse state of the replies captured while connecting
+    bool transaction_open;              // A mail transaction may still be open on the server
+    bool awaiting_data;                 // The server answered DATA with 354 and waits for the content
+    std::vector<int64_t> data_started;  // Trace time each message's data began, empty while tracing is off
+    int64_t data_traced_until;          // End of the last data span of the batch
+    std::deque<Pending> pending;        // Commands whose reply has not been read yet
+    std::string output;                 // Commands not yet written
+    std::string input;                  // Received bytes not yet parsed
+    std::string stuffed;                // Reused buffer for dot-stuffed content
+    std::vector<char> buffer;           // Receive buffer
+    std::vector<char> content_buffer;   // Message content on its way to the connection
+
+    static size_t capture_reply(char *ptr, size_t size, size_t nmemb, void *userp);
+    static int check_cancelled(void *userp, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
+    void connect();
+    bool is_alive();
+    void wait(bool for_writing);
+    bool receive();
+    void write(const char *data, size_t size);
+    void flush();
+    bool write_content(MessageStream &content, bool dot_stuffing);
+    std::pair<int, std::string> read_reply();
+    void queue(const std::string &command, size_t message, Step step);
+    void collect(std::vector<SmtpResult> &results);
+    void trace_data(size_t message);
+    void transact(const std::vector<SmtpMessage> &messages, std::vector<SmtpResult> &results);
+
+public:
+    explicit SmtpSession(const SmtpCredentials &credentials_, std::chrono::milliseconds timeout_ = std::chrono::seconds(60));
+    ~SmtpSession();
+    // Prevent copying
+    SmtpSession(const SmtpSession &) = delete;
+    SmtpSession &operator=(const SmtpSession &) = delete;
+
+    // Send the messages, connecting first if there is no connection or the server closed it. A
+    // connection lost during the batch, e.g. to a 421 reply, is replaced once and the messages
+    // without a reply are sent again. Returns one result per message; if the connection fails
+    // again, the messages that were not decided yet get code 0
+    std::vector<SmtpResult> send(const std::vector<SmtpMessage> &messages);
+    void close();
+    // Abort the batch being sent, or the next one if none is, may be called from any thread.
+    // Messages that were not sent yet are returned as cancelled, those being sent fail with the
+    // connection. Later batches are sent as usual
+    void cancel();
+    bool is_connected() const;
+    bool supports_pipelining() const;
+    bool supports_chunking() const;
+};
+
+#endif // SMTP_SESSION_H
@@ -0,0 +1,56 @@
+#ifndef SQLITE_QUEUE_H
+#define SQLITE_QUEUE_H
+
+#include <mutex>
+#include <sqlite3.h>
+#include "queue_backend.h"
+
+// Queue backend storing jobs in the jobs table of an SQLite database. Idempotency keys are kept in a
+// separate table whose primary key enforces their uniqueness, so expired keys can simply be deleted.
+// A claim stores its time in reserved_at, reservations older than the lease timeout are dropped by
+// the next claim.
+class SqliteQueue: public QueueBackend
+{
+private:
+    std::string path;
+    sqlite3 *db;
+    std::mutex db_mutex;                // Serializes access to the shared connection
+    std::vector<std::string> queues;    // Queues served by claim, highest priority first
+    std::chrono::seconds lease_timeout;
+    std::chrono::steady_clock::time_point leases_checked;   // Last expire_leases run, guarded by db_mutex
+
+    bool add_lease_column();
+    size_t expire_leases();
+    bool upsert(const Job &job);
+    SaveResult update_fields(const Job &job);
+    // Result of a write that matched no row: the claim of the job was lost, or the job does not exist
+    SaveResult lost_or_missing(const Job &job);
+
+public:
+    SqliteQueue(const std::string &path_ = "database.db",
+                const std::vector<std::string> &queues_ = {"default"},
+                std::chrono::seconds lease_timeout_ = std::chrono::seconds(300));
+    ~SqliteQueue();
+    // Prevent copying
+    SqliteQueue(const SqliteQueue &) = delete;
+    SqliteQueue &operator=(const SqliteQueue &) = delete;
+
+    bool open();
+    bool create_tables(bool drop_existing = false);
+
+    bool enqueue(const Job &job) override;
+    std::vector<std::unique_ptr<Job>> claim(const std::string &worker_id, size_t max_jobs = 1) override;
+    SaveResult ack(const Job &job) override;
+    SaveResult nack(const Job &job) override;
+    SaveResult schedule(const Job &job, std::chrono::system_clock::time_point at) override;
+    size_t release(const std::vector<const Job *> &jobs) override;
+    size_t renew(const std::string &worker_id, const std::vector<std::string> &job_ids) override;
+    bool sync() override;
+    size_t depth(const std::string &queue = "default") override;
+    std::optional<IdempotencyKey> enqueue_once(const Job &job, const std::string &idempotency_key) override;
+    size_t expire_idempotency_keys(std::chrono::system_clock::time_point before) override;
+    std::unique_ptr<Job> get_job(const std::string &id) override;
+    std::vector<std::unique_ptr<Job>> list_jobs(const JobQuery &query) override;
+};
+
+#endif // SQLITE_QUEUE_H
@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Optional tracing of the job lifecycle in the Chrome trace event format, readable by
+// chrome://tracing and ui.perfetto.dev. Every thread records its spans into its own buffer, which
+// is written to the trace file when it fills up, when the thread exits and on trace_close(), so
+// recording a span takes no lock shared between threads. While tracing is off a span costs one
+// relaxed atomic load.
+//
+// Timestamps are microseconds of the system clock, so that the time a job spent waiting in the
+// queue can be drawn from its creation time, and traces of several processes line up.
+
+extern std::atomic<bool> tracing_enabled;
+
+inline bool trace_enabled()
+{
+    return tracing_enabled.load(std::memory_order_relaxed);
+}
+
+// Start writing events to the given file. Returns false if it cannot be created
+bool trace_open(const std::string &path);
+// Write the remaining events of all threads and close the file
+void trace_close();
+
+int64_t trace_now();
+// Name the track of the calling thread in the trace viewer
+void trace_thread_name(const std::string &name);
+// Record a span of the calling thread. id, if not empty, is shown as the job id of the span
+void trace_complete(const char *name, const char *category, int64_t start_us, int64_t duration_us, const std::string &id = "");
+// Record a span that is not bound to a thread, e.g. the time a job waited in the queue. Spans with
+// the same id are drawn on one track
+void trace_async(const char *name, const char *category, const std::string &id, int64_t start_us, int64_t end_us);
+
+// Records the time between its construction and destruction as a span of the calling thread.
+// Name and category must be string literals, id must outlive the span.
+class TraceSpan
+{
+private:
+    const char *name;
+    const char *category;
+    const std::string *id;
+    int64_t start;
+
+public:
+    TraceSpan(const char *name_, const char *category_, const std::string *id_ = nullptr);
+    ~TraceSpan();
+    // Prevent copying
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+};
+
+#endif // TRACE_H
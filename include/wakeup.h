@@ -0,0 +1,67 @@
+#ifndef WAKEUP_H
+#define WAKEUP_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/un.h>
+
+// Cross-process doorbell for idle workers. Every process running workers binds a UNIX datagram
+// socket in a directory shared with the processes serving the API; these send an empty datagram to
+// each socket there after enqueueing a job, so idle workers claim it right away instead of at their
+// next poll. Wakeups carry no data and may be lost (a full receive buffer drops them), the workers
+// keep polling the queue as a fallback.
+class WakeupNotifier
+{
+private:
+    std::string directory;
+    int socket_fd;
+    std::mutex peers_mutex;
+    std::vector<sockaddr_un> peers;
+    std::chrono::steady_clock::time_point scanned_at;
+
+    void scan();
+
+public:
+    explicit WakeupNotifier(const std::string &directory_);
+    ~WakeupNotifier();
+    // Prevent copying
+    WakeupNotifier(const WakeupNotifier &) = delete;
+    WakeupNotifier &operator=(const WakeupNotifier &) = delete;
+
+    // Wake the workers of every listening process. The directory is scanned for new listeners at
+    // most once per second; sockets left behind by processes that exited are removed
+    void notify();
+};
+
+// Receives the wakeups of one process on <directory>/worker-<pid>-<random>.sock and hands them to a callback
+// from a thread of its own
+class WakeupListener
+{
+private:
+    std::string path;
+    int socket_fd;
+    std::function<void()> on_wakeup;
+    std::thread thread;
+    std::atomic<bool> stopping;
+
+    void run();
+
+public:
+    WakeupListener(const std::string &directory, std::function<void()> on_wakeup_);
+    ~WakeupListener();
+    // Prevent copying
+    WakeupListener(const WakeupListener &) = delete;
+    WakeupListener &operator=(const WakeupListener &) = delete;
+
+    // Bind the socket and start receiving. Returns false if the socket could not be bound
+    bool start();
+    // Stop receiving and remove the socket
+    void stop();
+};
+
+#endif // WAKEUP_H
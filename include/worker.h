@@ -2,34 +2,99 @@
 #define WORKER_H
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
-#include <sqlite3.h>
+#include <mutex>
 #include "job.h"
+#include "queue_backend.h"
 #include "randomhex.h"
 #include "queueable.h"
+#include "job_status_cache.h"
 
 // Atomic flag to stop workers gracefully
 extern std::atomic<bool> stopWorkers;
 
+// Counters of the jobs a worker executed, read by the WorkerPool to size itself
+struct WorkerStats
+{
+    std::atomic<uint64_t> jobs{0};
+    std::atomic<uint64_t> failures{0};
+    std::atomic<uint64_t> busy_us{0};   // Time spent in job handlers, i.e. mostly waiting for the SMTP server
+};
+
 class Worker
 {
 private:
-    int polling_interval;
+    std::chrono::milliseconds polling_interval;                                 // Longest wait between two claims of an idle worker
+    size_t batch_size;                                                          // Jobs claimed at once and handed to handle_batch
+    int max_attempts;                                                           // Attempts after which a job reporting JobRetry fails
+    std::chrono::milliseconds retry_delay;                                      // Delay before the first retry, doubled with every further one
     std::string worker_id;
-    sqlite3 *db;
-    const QueueableRegistry *registry;
-    std::optional<json> smtp_credentials;
+    QueueBackend *backend;
+    const QueueableRegistryBase *registry;
+    JobContext context;
+    JobStatusCache *status_cache;                                               // Updated on every state transition, may be nullptr
+    std::vector<std::unique_ptr<Queueable>> handlers;                           // One reused handler per job type, indexed by type id
+    WorkerStats stats;
+    std::atomic<bool> stopping;                                                 // Set by stop(), ends run() after the current batch
+    std::atomic<bool> stopped;                                                  // Set once run() has returned
+    bool woken;                                                                 // Set by wake(), guarded by wake_mutex
+    std::mutex wake_mutex;
+    std::condition_variable wake_condition;
+    std::vector<std::string> leased;                                            // Ids of the batch being executed, guarded by lease_mutex
+    std::chrono::steady_clock::time_point leased_at;                            // When their leases were taken or last renewed
+    std::mutex lease_mutex;
+
+    // Handler of the job type, resolving the type id from the name if the job was stored without one.
+    // Returns nullptr if the type is not registered
+    Queueable *find_handler(Job &job);
+    // Record the exception thrown for the job and store it as failed
+    void fail_job(Job &job, const std::exception_ptr &error);
+    // Schedule a job that reported JobRetry again, or fail it once it used up its attempts
+    void retry_job(Job &job, const std::exception_ptr &error);
+    // Record the outcome of an executed job that did not succeed
+    void job_failed(Job &job, const std::exception_ptr &error);
+    // Hand claimed jobs that were not started back to the queue in one batch
+    void release_jobs(const std::vector<Job *> &jobs);
+    // Set once the worker should not start any more jobs
+    bool is_draining() const;
+    // Remember the jobs of the batch being executed, so that renew_leases can reach them
+    void hold_leases(const std::vector<std::unique_ptr<Job>> &jobs);
 
 public:
-    Worker(const QueueableRegistry &registry_, std::optional<json> credentials = std::nullopt);
+    Worker(const QueueableRegistryBase &registry_,
+           QueueBackend &backend_,
+           const JobContext &context_ = JobContext{},
+           JobStatusCache *status_cache_ = nullptr,
+           std::chrono::milliseconds polling_interval_ = std::chrono::seconds(5),
+           size_t batch_size_ = 1,
+           int max_attempts_ = 5,
+           std::chrono::milliseconds retry_delay_ = std::chrono::seconds(30));
     ~Worker();
     // Prevent copying
     Worker(const Worker &) = delete;
     Worker &operator=(const Worker &) = delete;
     
     void run();
-    std::unique_ptr<Job> next_job(sqlite3 *db);
+    // Ask this worker to exit after its current batch, without stopping the others. Jobs of the batch
+    // that were not started yet are released
+    void stop();
+    // Abort the batch that is running, called from another thread once a shutdown deadline has passed.
+    // Jobs the handler did not start are released, those it was executing fail or are retried
+    void cancel();
+    // Cut the idle wait short, e.g. because a job was just enqueued
+    void wake();
+    // Renew the leases of the running batch once they are older than the given age, so that a long
+    // batch keeps its jobs. Called from another thread while the worker executes the batch
+    void renew_leases(std::chrono::milliseconds older_than);
+    bool is_stopped() const;
+    const WorkerStats &get_stats() const;
+    // Claim up to batch_size due jobs
+    std::vector<std::unique_ptr<Job>> next_jobs();
     void execute_job(Job &job);
+    // Execute the claimed jobs, handing each run of jobs of the same type to its handler at once
+    void execute_batch(std::vector<std::unique_ptr<Job>> &jobs);
     void cleanup_job(Job &job, bool succeeded=true);
 };
 
@@ -0,0 +1,129 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "worker.h"
+
+// Bounds and thresholds of the autoscaling worker pool
+struct WorkerPoolConfig
+{
+    size_t min_workers = 1;                         // Workers kept while the queue is empty
+    size_t max_workers = 8;
+    std::chrono::milliseconds polling_interval{5000};   // Longest wait of an idle worker between claims
+    size_t batch_size = 16;                         // Jobs a worker claims at once, e.g. emails sent over one SMTP exchange
+    std::chrono::milliseconds scale_interval{1000};     // How often the pool samples the queue and its workers
+    std::chrono::milliseconds drain_timeout{5000};      // How long stop() lets running batches finish
+    std::chrono::milliseconds lease_renewal{100000};    // Age after which the leases of a running batch are renewed
+    int max_attempts = 5;                           // Attempts of a job whose failures may pass, e.g. a busy SMTP server
+    std::chrono::milliseconds retry_delay{30000};       // Delay before its first retry, doubled with every further one
+    size_t backlog_per_worker = 10;                 // Waiting jobs per worker above which the pool grows
+    int grow_samples = 2;                           // Consecutive samples above the backlog before growing
+    int shrink_samples = 30;                        // Consecutive idle samples before a worker is retired
+    double saturation_latency = 2.0;                // Stop growing once jobs take this many times longer than the baseline
+    double saturation_failures = 0.2;               // or this share of jobs fails
+};
+
+// Read the pool settings from the MIN_WORKERS, MAX_WORKERS, POLL_INTERVAL_MS, WORKER_BATCH,
+// SHUTDOWN_TIMEOUT_MS, MAX_ATTEMPTS and RETRY_DELAY_MS environment variables, falling back to the
+// defaults above
+WorkerPoolConfig worker_pool_config_from_env();
+
+// What the pool observed during one scale interval
+struct ScalingSample
+{
+    size_t workers;
+    size_t depth;                       // Waiting jobs at the end of the interval
+    uint64_t jobs;                      // Jobs executed during the interval
+    uint64_t failures;
+    uint64_t busy_us;                   // Time the workers spent in job handlers
+    std::chrono::microseconds interval;
+};
+
+// Decides the pool size from the samples. The pool grows when the backlog stays above what the
+// current workers can take, and shrinks one worker at a time once they have been idle for a while,
+// so short gaps in a burst do not make it oscillate. Job latency is compared against the lowest
+// latency seen so far: if adding workers only makes the SMTP server slower or makes it fail jobs,
+// the current size becomes a ceiling until the server has been healthy for a while.
+class ScalingPolicy
+{
+private:
+    WorkerPoolConfig config;
+    int grow_streak;
+    int shrink_streak;
+    int healthy_streak;
+    double baseline_latency_us;         // 0 until the first job was executed
+    size_t ceiling;
+
+public:
+    explicit ScalingPolicy(const WorkerPoolConfig &config_);
+
+    // Returns the number of workers the pool should run from now on
+    size_t next_size(const ScalingSample &sample);
+    size_t get_ceiling() const;
+};
+
+// Runs between min_workers and max_workers workers, resized by a ScalingPolicy from a controller thread.
+// The controller also renews the leases of the batches the workers are executing
+class WorkerPool
+{
+private:
+    struct Member
+    {
+        std::unique_ptr<Worker> worker;
+        std::thread thread;
+        uint64_t jobs;                  // Counters of the worker at the previous sample
+        uint64_t failures;
+        uint64_t busy_us;
+        bool counted;                   // Stopped at the previous sample, so all its jobs have been sampled
+    };
+
+    const QueueableRegistryBase *registry;
+    QueueBackend *backend;
+    JobContext context;
+    JobStatusCache *status_cache;
+    WorkerPoolConfig config;
+    std::vector<std::string> queues;
+    ScalingPolicy policy;
+
+    std::vector<Member> members;
+    std::mutex members_mutex;           // Guards members against wake(), which runs on other threads
+    std::vector<Member> retired;        // Finishing their current job, joined once they have stopped
+    std::thread controller;
+    std::mutex controller_mutex;
+    std::condition_variable controller_wake;
+    bool stopping;
+
+    void add_worker();
+    void retire_worker();
+    void join_retired(bool wait);
+    ScalingSample sample(std::chrono::microseconds interval);
+    void control();
+
+public:
+    WorkerPool(const QueueableRegistryBase &registry_,
+               QueueBackend &backend_,
+               const JobContext &context_,
+               JobStatusCache *status_cache_,
+               const WorkerPoolConfig &config_,
+               const std::vector<std::string> &queues_ = {"default"});
+    ~WorkerPool();
+    // Prevent copying
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    // Start min_workers workers and the controller thread
+    void start();
+    // Stop the controller and all workers. Workers stop claiming at once and release the jobs they
+    // have not started; running batches get drain_timeout to finish before they are cancelled
+    void stop();
+    // Let idle workers claim right away instead of at their next poll
+    void wake();
+};
+
+#endif // WORKER_POOL_H
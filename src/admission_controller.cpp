@@ -0,0 +1,190 @@
+#include "../include/admission_controller.h"
+#include <cmath>
+#include <cstdlib>
+
+AdmissionConfig admission_config_from_env()
+{
+    AdmissionConfig config;
+    if (const char *size = std::getenv("MAX_BODY_SIZE"))
+    {
+        config.max_body_size = static_cast<size_t>(std::atoll(size));
+    }
+    if (const char *depth = std::getenv("MAX_QUEUE_DEPTH"))
+    {
+        config.max_queue_depth = static_cast<size_t>(std::atoll(depth));
+    }
+    if (const char *in_flight = std::getenv("MAX_IN_FLIGHT"))
+    {
+        config.max_in_flight = static_cast<size_t>(std::atoll(in_flight));
+    }
+    if (const char *rate = std::getenv("CLIENT_RATE"))
+    {
+        config.client_rate = std::atof(rate);
+    }
+    if (const char *burst = std::getenv("CLIENT_BURST"))
+    {
+        config.client_burst = std::atof(burst);
+    }
+    return config;
+}
+
+// AdmissionController::Slot
+AdmissionController::Slot::Slot(AdmissionController *controller_) : controller{controller_}
+{
+}
+
+AdmissionController::Slot::~Slot()
+{
+    if (controller)
+    {
+        controller->in_flight -= 1;
+    }
+}
+
+AdmissionController::Slot::Slot(Slot &&other) noexcept : controller{other.controller}
+{
+    other.controller = nullptr;
+}
+
+// AdmissionController
+AdmissionController::AdmissionController(QueueBackend &backend_,
+                                         const AdmissionConfig &config_,
+                                         const std::vector<std::string> &queues_) : backend{&backend_},
+                                                                                    config{config_},
+                                                                                    queues{queues_},
+                                                                                    in_flight{0},
+                                                                                    cached_depth{0},
+                                                                                    admitted_since_refresh{0},
+                                                                                    stopping{false}
+{
+}
+
+AdmissionController::~AdmissionController()
+{
+    stop();
+}
+
+void AdmissionController::start()
+{
+    refresh_depth();
+    refresher = std::thread(&AdmissionController::refresh_loop, this);
+}
+
+void AdmissionController::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock{refresher_mutex};
+        stopping = true;
+    }
+    refresher_wake.notify_all();
+    if (refresher.joinable())
+    {
+        refresher.join();
+    }
+}
+
+const AdmissionConfig &AdmissionController::get_config() const
+{
+    return config;
+}
+
+std::optional<std::chrono::seconds> AdmissionController::throttle(const std::string &client)
+{
+    if (config.client_rate <= 0)
+    {
+        return std::nullopt; // Rate limiting disabled
+    }
+    std::lock_guard<std::mutex> lock{buckets_mutex};
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    auto it = buckets.find(client);
+    if (it == buckets.end())
+    {
+        if (buckets.size() >= config.max_clients)
+        {
+            drop_idle_buckets(now);
+        }
+        it = buckets.emplace(client, TokenBucket{config.client_burst, now}).first;
+    }
+
+    TokenBucket &bucket = it->second;
+    double elapsed = std::chrono::duration<double>(now - bucket.refilled_at).count();
+    bucket.tokens = std::min(config.client_burst, bucket.tokens + elapsed * config.client_rate);
+    bucket.refilled_at = now;
+    if (bucket.tokens >= 1.0)
+    {
+        bucket.tokens -= 1.0;
+        return std::nullopt;
+    }
+    double wait = (1.0 - bucket.tokens) / config.client_rate;
+    return std::chrono::seconds(static_cast<int64_t>(std::ceil(wait)));
+}
+
+// Forget clients whose bucket has refilled completely, they start with a full bucket anyway.
+// Must be called with buckets_mutex held.
+void AdmissionController::drop_idle_buckets(std::chrono::steady_clock::time_point now)
+{
+    for (auto it = buckets.begin(); it != buckets.end();)
+    {
+        double elapsed = std::chrono::duration<double>(now - it->second.refilled_at).count();
+        if (it->second.tokens + elapsed * config.client_rate >= config.client_burst)
+        {
+            it = buckets.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    // Every client is active: make room by dropping an arbitrary one rather than growing without bound
+    if (buckets.size() >= config.max_clients)
+    {
+        buckets.erase(buckets.begin());
+    }
+}
+
+void AdmissionController::refresh_depth()
+{
+    // Admissions made while the depth is queried may be missing from it, so only the ones made
+    // before are dropped from the count
+    size_t admitted = admitted_since_refresh.load();
+    size_t depth = 0;
+    for (const std::string &queue : queues)
+    {
+        depth += backend->depth(queue);
+    }
+    cached_depth = depth;
+    admitted_since_refresh.fetch_sub(admitted);
+}
+
+void AdmissionController::refresh_loop()
+{
+    std::unique_lock<std::mutex> lock{refresher_mutex};
+    while (!refresher_wake.wait_for(lock, config.depth_refresh, [this]
+                                    { return stopping; }))
+    {
+        lock.unlock();
+        refresh_depth();
+        lock.lock();
+    }
+}
+
+size_t AdmissionController::queue_depth() const
+{
+    return cached_depth.load() + admitted_since_refresh.load();
+}
+
+std::optional<AdmissionController::Slot> AdmissionController::acquire()
+{
+    if (in_flight.fetch_add(1) >= config.max_in_flight)
+    {
+        in_flight -= 1;
+        return std::nullopt;
+    }
+    Slot slot{this};
+    if (queue_depth() >= config.max_queue_depth)
+    {
+        return std::nullopt;
+    }
+    admitted_since_refresh += 1;
+    return std::optional<Slot>{std::move(slot)};
+}
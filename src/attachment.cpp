@@ -0,0 +1,329 @@
+#include "../include/attachment.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+const size_t line_input = 57;           // Input bytes per line, encoded into 76 characters (RFC 2045)
+const size_t max_line_size = 78;        // Encoded line including CRLF
+
+bool is_hash(const std::string &value)
+{
+    return value.size() >= 16 && value.size() <= 128 &&
+           std::all_of(value.begin(), value.end(), [](char c)
+                       { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+}
+}
+
+// MappedFile
+MappedFile::MappedFile(int fd_, const char *data_, size_t size_) : fd{fd_}, data{data_}, size{size_}
+{
+}
+
+MappedFile::~MappedFile()
+{
+    if (size > 0)
+    {
+        munmap(const_cast<char *>(data), size);
+    }
+    close(fd);
+}
+
+std::shared_ptr<const MappedFile> MappedFile::open(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        spdlog::error("Failed to open attachment {}: {}", path, std::strerror(errno));
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        spdlog::error("Attachment {} is not a regular file", path);
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    const char *data = nullptr;
+    if (size > 0)
+    {
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            spdlog::error("Failed to map attachment {}: {}", path, std::strerror(errno));
+            close(fd);
+            return nullptr;
+        }
+        // Attachments are read front to back exactly once per send
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(mapping);
+    }
+    return std::shared_ptr<const MappedFile>{new MappedFile{fd, data, size}};
+}
+
+const char *MappedFile::get_data() const
+{
+    return data;
+}
+
+size_t MappedFile::get_size() const
+{
+    return size;
+}
+
+// AttachmentStore
+AttachmentStore::AttachmentStore(const std::string &root_) : root{root_}
+{
+}
+
+const char *AttachmentStore::validate(const json &reference)
+{
+    if (!reference.is_object())
+    {
+        return "Attachment must be an object";
+    }
+    auto path = reference.find("path");
+    auto hash = reference.find("hash");
+    if ((path == reference.end()) == (hash == reference.end()))
+    {
+        return "Attachment needs either a path or a hash";
+    }
+    if (hash != reference.end() && (!hash->is_string() || !is_hash(hash->get_ref<const std::string &>())))
+    {
+        return "Attachment hash must be a lowercase hex digest";
+    }
+    if (path != reference.end())
+    {
+        if (!path->is_string())
+        {
+            return "Attachment path must be a string";
+        }
+        std::filesystem::path relative{path->get_ref<const std::string &>()};
+        if (relative.empty() || relative.is_absolute() ||
+            std::any_of(relative.begin(), relative.end(), [](const std::filesystem::path &p)
+                        { return p == ".."; }))
+        {
+            return "Attachment path must be relative to the attachment directory";
+        }
+    }
+    for (const char *field : {"filename", "content_type"})
+    {
+        auto it = reference.find(field);
+        if (it != reference.end() && !it->is_string())
+        {
+            return "Attachment filename and content type must be strings";
+        }
+    }
+    return nullptr;
+}
+
+std::string AttachmentStore::resolve(const json &reference) const
+{
+    if (const char *error = validate(reference))
+    {
+        throw std::runtime_error(error);
+    }
+    auto hash = reference.find("hash");
+    std::filesystem::path path{root};
+    path /= hash != reference.end() ? hash->get<std::string>() : reference["path"].get<std::string>();
+
+    // Symlinks must not lead out of the attachment directory
+    std::error_code ec;
+    std::filesystem::path canonical = std::filesystem::canonical(path, ec);
+    if (ec)
+    {
+        throw std::runtime_error("Attachment not found: " + path.string());
+    }
+    std::filesystem::path canonical_root = std::filesystem::canonical(root, ec);
+    if (ec)
+    {
+        throw std::runtime_error("Attachment directory not found: " + root);
+    }
+    auto mismatch = std::mismatch(canonical_root.begin(), canonical_root.end(), canonical.begin(), canonical.end());
+    if (mismatch.first != canonical_root.end())
+    {
+        throw std::runtime_error("Attachment outside of the attachment directory: " + path.string());
+    }
+    return canonical.string();
+}
+
+std::shared_ptr<const MappedFile> AttachmentStore::open(const json &reference)
+{
+    std::string path{resolve(reference)};
+    std::lock_guard<std::mutex> lock{files_mutex};
+    std::weak_ptr<const MappedFile> &shared = open_files[path];
+    std::shared_ptr<const MappedFile> file = shared.lock();
+    if (!file)
+    {
+        file = MappedFile::open(path);
+        if (!file)
+        {
+            open_files.erase(path);
+            throw std::runtime_error("Failed to open attachment " + path);
+        }
+        shared = file;
+    }
+
+    // Drop the entries of files no job is sending anymore
+    if (open_files.size() > 64)
+    {
+        for (auto it = open_files.begin(); it != open_files.end();)
+        {
+            it = it->second.expired() ? open_files.erase(it) : std::next(it);
+        }
+    }
+    return file;
+}
+
+// MessageStream
+MessageStream::MessageStream() : current{0}, offset{0}, line_size{0}, line_offset{0}
+{
+}
+
+void MessageStream::clear()
+{
+    parts.clear();
+    texts.clear();
+    current = 0;
+    offset = 0;
+    line_size = 0;
+    line_offset = 0;
+}
+
+size_t MessageStream::size() const
+{
+    size_t total = 0;
+    for (const Part &part : parts)
+    {
+        if (part.text)
+        {
+            total += part.text->size();
+            continue;
+        }
+        size_t length = part.file->get_size();
+        size_t lines = (length + line_input - 1) / line_input;
+        total += (length + 2) / 3 * 4 + lines * 2;
+    }
+    return total;
+}
+
+void MessageStream::rewind()
+{
+    current = 0;
+    offset = 0;
+    line_size = 0;
+    line_offset = 0;
+}
+
+void MessageStream::add_text(const std::string &text)
+{
+    parts.push_back(Part{&text, nullptr});
+}
+
+void MessageStream::add_owned_text(std::string text)
+{
+    texts.push_back(std::move(text));
+    parts.push_back(Part{&texts.back(), nullptr});
+}
+
+void MessageStream::add_base64(std::shared_ptr<const MappedFile> file)
+{
+    parts.push_back(Part{nullptr, std::move(file)});
+}
+
+// Encode the next line of the file into out, which must hold max_line_size bytes
+size_t MessageStream::encode_line(const MappedFile &file, char *out)
+{
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(file.get_data()) + offset;
+    size_t length = std::min(line_input, file.get_size() - offset);
+    size_t written = 0;
+    size_t i = 0;
+    for (; i + 3 <= length; i += 3)
+    {
+        uint32_t triple = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        out[written++] = base64_alphabet[(triple >> 18) & 0x3f];
+        out[written++] = base64_alphabet[(triple >> 12) & 0x3f];
+        out[written++] = base64_alphabet[(triple >> 6) & 0x3f];
+        out[written++] = base64_alphabet[triple & 0x3f];
+    }
+    if (i < length)
+    {
+        // The last one or two bytes of the file are padded
+        uint32_t triple = in[i] << 16;
+        if (i + 1 < length)
+        {
+            triple |= in[i + 1] << 8;
+        }
+        out[written++] = base64_alphabet[(triple >> 18) & 0x3f];
+        out[written++] = base64_alphabet[(triple >> 12) & 0x3f];
+        out[written++] = i + 1 < length ? base64_alphabet[(triple >> 6) & 0x3f] : '=';
+        out[written++] = '=';
+    }
+    out[written++] = '\r';
+    out[written++] = '\n';
+    offset += length;
+    return written;
+}
+
+size_t MessageStream::read(char *out, size_t max_size)
+{
+    size_t written = 0;
+    while (written < max_size)
+    {
+        // Finish a line that did not fit into the previous read
+        if (line_offset < line_size)
+        {
+            size_t n = std::min(line_size - line_offset, max_size - written);
+            std::memcpy(out + written, line + line_offset, n);
+            line_offset += n;
+            written += n;
+            continue;
+        }
+        if (current >= parts.size())
+        {
+            break;
+        }
+
+        Part &part = parts[current];
+        if (part.text)
+        {
+            size_t n = std::min(part.text->size() - offset, max_size - written);
+            std::memcpy(out + written, part.text->data() + offset, n);
+            offset += n;
+            written += n;
+            if (offset == part.text->size())
+            {
+                current += 1;
+                offset = 0;
+            }
+            continue;
+        }
+
+        if (offset >= part.file->get_size())
+        {
+            current += 1;
+            offset = 0;
+            continue;
+        }
+        if (max_size - written >= max_line_size)
+        {
+            written += encode_line(*part.file, out + written);
+        }
+        else
+        {
+            line_size = encode_line(*part.file, line);
+            line_offset = 0;
+        }
+    }
+    return written;
+}
@@ -1,10 +1,27 @@
 #include "../include/chronotostring.h"
+#include <cstdio>
+#include <ctime>
 
 std::string chrono_to_string(const std::chrono::system_clock::time_point &tp)
 {
+    // UTC, so that stored times compare correctly with SQLite's CURRENT_TIMESTAMP. gmtime_r is
+    // used because API and worker threads format times concurrently
     std::time_t t = std::chrono::system_clock::to_time_t(tp);
-    std::tm tm = *std::localtime(&t);
+    std::tm tm{};
+    gmtime_r(&t, &tm);
     char buffer[100];
     std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
     return std::string(buffer);
 }
+
+std::chrono::system_clock::time_point string_to_chrono(const std::string &value)
+{
+    std::tm tm{};
+    if (std::sscanf(value.c_str(), "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+    {
+        return std::chrono::system_clock::time_point{};
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return std::chrono::system_clock::from_time_t(timegm(&tm));
+}
@@ -1,34 +1,137 @@
 #include "../include/email_sender.h"
-#include <curl/curl.h>
+#include "../include/randomhex.h"
+#include "../include/trace.h"
+#include <algorithm>
+#include <filesystem>
 //#include <iostream>
 #include <spdlog/spdlog.h>
 
-// Struct to track reading progress
-struct UploadStatus
+namespace
 {
-    size_t bytes_read;
-    std::string *payload;
-};
+// Header of the MIME part of an attachment. Quotes and line breaks are dropped from the parameters
+std::string attachment_header(const std::string &boundary, const json &reference)
+{
+    auto clean = [](std::string value)
+    {
+        value.erase(std::remove_if(value.begin(), value.end(), [](char c)
+                                   { return c == '"' || c == '\\' || c == '\r' || c == '\n'; }),
+                    value.end());
+        return value;
+    };
+    std::string default_name{reference.contains("hash") ? reference["hash"].get<std::string>()
+                                                          : std::filesystem::path(reference["path"].get<std::string>()).filename().string()};
+    std::string filename{clean(reference.value("filename", default_name))};
+    std::string content_type{clean(reference.value("content_type", "application/octet-stream"))};
+    return "--" + boundary + "\r\n" +
+           "Content-Type: " + content_type + "; name=\"" + filename + "\"\r\n" +
+           "Content-Transfer-Encoding: base64\r\n" +
+           "Content-Disposition: attachment; filename=\"" + filename + "\"\r\n\r\n";
+}
 
-// Callback function for reading email content
-size_t payload_source(void *ptr, size_t size, size_t nmemb, void *userp)
+}
+
+EmailPayload EmailPayload::decode(const json &args)
 {
-    UploadStatus *upload_ctx = static_cast<UploadStatus *>(userp);
-    size_t max_size = size * nmemb;
+    const std::string &recipient{args.at("recipient").get_ref<const std::string &>()};
+    auto attachments = args.find("attachments");
+    const json *attachment_refs = attachments != args.end() && !attachments->empty() ? &*attachments : nullptr;
+    auto template_id = args.find("template");
+    if (template_id != args.end())
+    {
+        auto vars = args.find("vars");
+        static const json no_vars = json::object();
+        return EmailPayload{recipient,
+                            nullptr,
+                            nullptr,
+                            &template_id->get_ref<const std::string &>(),
+                            vars != args.end() ? &*vars : &no_vars,
+                            attachment_refs};
+    }
+    return EmailPayload{recipient,
+                        &args.at("subject").get_ref<const std::string &>(),
+                        &args.at("body").get_ref<const std::string &>(),
+                        nullptr,
+                        nullptr,
+                        attachment_refs};
+}
 
-    if (upload_ctx->bytes_read >= upload_ctx->payload->size())
+const char *EmailPayload::validate(const json &args, const TemplateStore *templates)
+{
+    if (!args.is_object())
+    {
+        return "Expected a JSON object";
+    }
+    auto non_empty_string = [&args](const char *field)
+    {
+        auto it = args.find(field);
+        return it != args.end() && it->is_string() && !it->get_ref<const std::string &>().empty();
+    };
+    if (!non_empty_string("recipient"))
     {
-        return 0; // End of data
+        return "Missing recipient";
+    }
+    auto attachments = args.find("attachments");
+    if (attachments != args.end())
+    {
+        if (!attachments->is_array() || attachments->size() > SendEmail::max_attachments)
+        {
+            return "Attachments must be an array of at most 20 references";
+        }
+        for (const json &reference : *attachments)
+        {
+            if (const char *error = AttachmentStore::validate(reference))
+            {
+                return error;
+            }
+        }
     }
 
-    size_t to_copy = std::min(max_size, upload_ctx->payload->size() - upload_ctx->bytes_read);
-    memcpy(ptr, upload_ctx->payload->c_str() + upload_ctx->bytes_read, to_copy);
-    upload_ctx->bytes_read += to_copy;
+    if (!args.contains("template"))
+    {
+        if (!non_empty_string("subject"))
+        {
+            return "Missing subject";
+        }
+        if (!non_empty_string("body"))
+        {
+            return "Missing body";
+        }
+        return nullptr;
+    }
 
-    return to_copy;
+    if (!non_empty_string("template"))
+    {
+        return "Invalid template";
+    }
+    auto vars = args.find("vars");
+    if (vars != args.end() && !vars->is_object())
+    {
+        return "Template variables must be an object";
+    }
+    if (templates == nullptr)
+    {
+        return nullptr;
+    }
+    const EmailTemplate *email_template = templates->find(args["template"].get_ref<const std::string &>());
+    if (email_template == nullptr)
+    {
+        return "Unknown template";
+    }
+    // Every variable has to be given, so that the job cannot fail when it is rendered
+    for (const CompiledTemplate *text : {&email_template->subject, &email_template->body})
+    {
+        for (const std::string &name : text->get_variables())
+        {
+            if (vars == args.end() || !vars->contains(name) || (*vars)[name].is_null() || (*vars)[name].is_structured())
+            {
+                return "Missing template variable";
+            }
+        }
+    }
+    return nullptr;
 }
 
-SendEmail::SendEmail()
+SendEmail::SendEmail() : credentials{nullptr}, templates{nullptr}, attachments{nullptr}
 {
 }
 
@@ -36,100 +139,209 @@ SendEmail::~SendEmail()
 {
 }
 
-void SendEmail::dispatch(const json &args)
+std::optional<std::string> SendEmail::dispatch(const json &args,
+                                               const std::optional<std::string> &idempotency_key,
+                                               std::chrono::system_clock::time_point *key_taken_at)
 {
-    Queueable::dispatch(args, "SendEmail");
+    return Queueable::dispatch(args, job_name, type_id, idempotency_key, key_taken_at);
 }
 
-void SendEmail::handle(const json &args, std::optional<json> credentials)
+void SendEmail::configure(const JobContext &context)
 {
-    json credentials_{credentials.value()};
-    std::string recipient{args["recipient"]};
-    spdlog::info("Sending mail to {}...", recipient);
-    send_email(args, credentials_);
+    credentials = context.get<SmtpCredentials>();
+    templates = context.get<TemplateStore>();
+    const std::shared_ptr<AttachmentStore> *store = context.get<std::shared_ptr<AttachmentStore>>();
+    attachments = store ? store->get() : nullptr;
+    // Created up front, so that cancel() can reach it from another thread. It connects on first use
+    if (credentials)
+    {
+        session = std::make_unique<SmtpSession>(*credentials);
+    }
 }
 
-void SendEmail::send_email(const json &args, const json &credentials)
+void SendEmail::cancel()
 {
-    spdlog::info("Sending email with args = {}", args.dump());
-    const std::string from_email{credentials["smtp_user"]};
-    const std::string smtp_server{credentials["smtp_server"]};
-    const std::string smtp_user{credentials["smtp_user"]};
-    const std::string smtp_password{credentials["smtp_password"]};
-    const std::string to_email{args["recipient"]};
-    const std::string subject{args["subject"]};
-    const std::string body{args["body"]};
-    
-    CURL *curl;
-    CURLcode res;
-
-    // Initialize curl
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
-
-    if (curl)
+    if (session)
     {
-        struct curl_slist *recipients = nullptr;
-
-        // Set up the SMTP server settings
-        curl_easy_setopt(curl, CURLOPT_URL, smtp_server.c_str());      // Set SMTP server
-        curl_easy_setopt(curl, CURLOPT_MAIL_FROM, from_email.c_str()); // Set sender's email
-
-
-        // Add recipient's email
-        recipients = curl_slist_append(recipients, to_email.c_str());
-        curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
-
-        // Set the email body
-        std::string email_data = "To: " + to_email + "\r\n" +
-                                 "From: " + from_email + "\r\n" +
-                                 "Subject: " + subject + "\r\n" +
-                                 "\r\n" +
-                                 body + "\r\n";
+        session->cancel();
+    }
+}
 
-        // Create an UploadStatus struct to track data reading
-        UploadStatus upload_ctx = {0, &email_data};
+void SendEmail::handle_payload(const EmailPayload &payload)
+{
+    std::vector<std::exception_ptr> errors(1);
+    handle_payloads({payload}, errors);
+    if (errors.front())
+    {
+        std::rethrow_exception(errors.front());
+    }
+}
 
-        // Set up reading function for email data
-        curl_easy_setopt(curl, CURLOPT_READFUNCTION, payload_source);
-        curl_easy_setopt(curl, CURLOPT_READDATA, &upload_ctx);
-        curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+void SendEmail::compose_message(std::string &buffer,
+                                const std::string &from_email,
+                                const EmailPayload &payload,
+                                const EmailTemplate *email_template,
+                                const std::string *boundary)
+{
+    static const std::string to_header{"To: "};
+    static const std::string from_header{"\r\nFrom: "};
+    static const std::string subject_header{"\r\nSubject: "};
+    static const std::string header_end{"\r\n\r\n"};
+    static const std::string line_end{"\r\n"};
+    static const std::string multipart_header{"\r\nMIME-Version: 1.0\r\nContent-Type: multipart/mixed; boundary=\""};
+    static const std::string text_part_header{"\"\r\n\r\n--"};
+    static const std::string text_part_type{"\r\nContent-Type: text/plain; charset=utf-8\r\nContent-Transfer-Encoding: 8bit"};
 
-        // Set the authentication for the SMTP server (username/password)
-        curl_easy_setopt(curl, CURLOPT_USERNAME, smtp_user.c_str());
-        curl_easy_setopt(curl, CURLOPT_PASSWORD, smtp_password.c_str());
+    buffer.clear();
+    if (payload.template_id && email_template == nullptr)
+    {
+        throw std::runtime_error("No template given for email template " + *payload.template_id);
+    }
+    size_t subject_size = email_template ? email_template->subject.rendered_size(*payload.vars) : payload.subject->size();
+    size_t body_size = email_template ? email_template->body.rendered_size(*payload.vars) : payload.body->size();
+    size_t mime_size = boundary ? multipart_header.size() + text_part_header.size() + text_part_type.size() + 2 * boundary->size() : 0;
+    buffer.reserve(to_header.size() + payload.recipient.size() +
+                   from_header.size() + from_email.size() +
+                   subject_header.size() + subject_size + mime_size +
+                   header_end.size() + body_size + line_end.size());
+    buffer.append(to_header).append(payload.recipient);
+    buffer.append(from_header).append(from_email);
+    buffer.append(subject_header);
+    if (email_template)
+    {
+        email_template->subject.render(buffer, *payload.vars, true);
+    }
+    else
+    {
+        size_t subject_start = buffer.size();
+        buffer.append(*payload.subject);
+        flatten_line_breaks(buffer, subject_start);
+    }
+    if (boundary)
+    {
+        buffer.append(multipart_header).append(*boundary);
+        buffer.append(text_part_header).append(*boundary);
+        buffer.append(text_part_type);
+    }
+    buffer.append(header_end);
+    if (email_template)
+    {
+        email_template->body.render(buffer, *payload.vars);
+    }
+    else
+    {
+        buffer.append(*payload.body);
+    }
+    buffer.append(line_end);
+}
 
-        // Enable SSL/TLS (for secure connection)
-        curl_easy_setopt(curl, CURLOPT_USE_SSL, (long)CURLUSESSL_ALL);
+void SendEmail::prepare(const EmailPayload &payload, std::string &buffer, MessageStream &content)
+{
+    const EmailTemplate *email_template = nullptr;
+    if (payload.template_id)
+    {
+        email_template = templates ? templates->find(*payload.template_id) : nullptr;
+        if (email_template == nullptr)
+        {
+            throw std::runtime_error("Unknown email template " + *payload.template_id);
+        }
+    }
 
-        spdlog::info("Sending email to {}", to_email.c_str());
-        // std::cout << "Sending email to " << to_email.c_str() << std::endl;
+    // Attachments are opened before anything is sent, a missing file fails the job
+    content.clear();
+    if (payload.attachments)
+    {
+        if (attachments == nullptr)
+        {
+            throw std::runtime_error("Attachments are not enabled, set ATTACHMENT_DIR");
+        }
+        std::string boundary{"etq_" + generateHex(24)};
+        compose_message(buffer, credentials->user, payload, email_template, &boundary);
+        content.add_text(buffer);
+        for (const json &reference : *payload.attachments)
+        {
+            std::shared_ptr<const MappedFile> file = attachments->open(reference);
+            content.add_owned_text(attachment_header(boundary, reference));
+            content.add_base64(std::move(file));
+        }
+        content.add_owned_text("--" + boundary + "--\r\n");
+    }
+    else
+    {
+        compose_message(buffer, credentials->user, payload, email_template);
+        content.add_text(buffer);
+    }
+}
 
-        // Send the email
-        res = curl_easy_perform(curl);
+void SendEmail::handle_payloads(const std::vector<EmailPayload> &payloads, std::vector<std::exception_ptr> &errors)
+{
+    // The session and its connection are kept for the lifetime of this handler.
+    // curl_global_init is called once in main()
+    if (!session)
+    {
+        std::fill(errors.begin(), errors.end(), std::make_exception_ptr(std::runtime_error("No SMTP credentials configured")));
+        return;
+    }
+    if (messages.size() < payloads.size())
+    {
+        messages.resize(payloads.size());
+        streams.resize(payloads.size());
+    }
 
-        // Check for errors
-        if (res != CURLE_OK)
+    int64_t compose_started = trace_enabled() ? trace_now() : 0;
+    std::vector<SmtpMessage> batch;
+    std::vector<size_t> positions;
+    batch.reserve(payloads.size());
+    positions.reserve(payloads.size());
+    for (size_t i = 0; i < payloads.size(); ++i)
+    {
+        try
         {
-            spdlog::error("Email sending failed: {}", curl_easy_strerror(res));
-            // std::cerr << "Email sending failed: " << curl_easy_strerror(res) << std::endl;
+            prepare(payloads[i], messages[i], streams[i]);
+            batch.push_back(SmtpMessage{&credentials->user, &payloads[i].recipient, &streams[i]});
+            positions.push_back(i);
         }
-        else
+        catch (...)
         {
-            spdlog::info("Email sent successfully!");
-            // std::cout << "Email sent successfully!" << std::endl;
+            errors[i] = std::current_exception();
         }
-
-        // Clean up
-        curl_slist_free_all(recipients);
-        curl_easy_cleanup(curl);
     }
-    else
+    if (compose_started != 0)
+    {
+        trace_complete("compose", "smtp", compose_started, trace_now() - compose_started);
+    }
+
+    spdlog::info("Sending {} emails", batch.size());
+    std::vector<SmtpResult> results{session->send(batch)};
+    for (size_t i = 0; i < results.size(); ++i)
     {
-        spdlog::error("Failed to initialize curl.");
-        // std::cerr << "Failed to initialize curl." << std::endl;
+        const EmailPayload &payload = payloads[positions[i]];
+        if (results[i].delivered())
+        {
+            spdlog::info("Email to {} sent successfully", payload.recipient);
+            continue;
+        }
+        if (results[i].cancelled)
+        {
+            errors[positions[i]] = std::make_exception_ptr(JobDeferred("Email to " + payload.recipient + " was not sent before the shutdown"));
+            continue;
+        }
+        spdlog::error("Email to {} failed: {} {}", payload.recipient, results[i].code, results[i].reply);
+        if (results[i].is_permanent())
+        {
+            errors[positions[i]] = std::make_exception_ptr(std::runtime_error(
+                "SMTP server refused the email: " + std::to_string(results[i].code) + " " + results[i].reply));
+            continue;
+        }
+        // A 4xx reply or a lost connection may pass, the email is sent again later
+        errors[positions[i]] = std::make_exception_ptr(JobRetry(
+            results[i].code == 0 ? "Failed to send the email: " + results[i].reply
+                                 : "SMTP server deferred the email: " + std::to_string(results[i].code) + " " + results[i].reply));
     }
 
-    // Cleanup global curl environment
-    curl_global_cleanup();
+    // Release the attachment mappings
+    for (size_t i = 0; i < payloads.size(); ++i)
+    {
+        streams[i].clear();
+    }
 }
@@ -0,0 +1,178 @@
+#include "../include/email_template.h"
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+namespace
+{
+const size_t scalar_size = 32;          // Upper bound of a rendered number or boolean
+
+std::string trim(const std::string &value)
+{
+    size_t begin = value.find_first_not_of(" \t");
+    if (begin == std::string::npos)
+    {
+        return "";
+    }
+    size_t end = value.find_last_not_of(" \t");
+    return value.substr(begin, end - begin + 1);
+}
+}
+
+// CompiledTemplate
+CompiledTemplate::CompiledTemplate(const std::string &source)
+{
+    std::unordered_map<std::string, size_t> variable_index;
+    size_t pos = 0;
+    while (pos < source.size())
+    {
+        size_t open = source.find("{{", pos);
+        size_t literal_end = open == std::string::npos ? source.size() : open;
+        if (literal_end > pos)
+        {
+            segments.push_back(Segment{false, literals.size(), literal_end - pos});
+            literals.append(source, pos, literal_end - pos);
+        }
+        if (open == std::string::npos)
+        {
+            break;
+        }
+
+        size_t close = source.find("}}", open + 2);
+        if (close == std::string::npos)
+        {
+            throw std::invalid_argument("Unterminated placeholder at offset " + std::to_string(open));
+        }
+        std::string name{trim(source.substr(open + 2, close - open - 2))};
+        if (name.empty())
+        {
+            throw std::invalid_argument("Empty placeholder at offset " + std::to_string(open));
+        }
+        auto [it, inserted] = variable_index.emplace(name, variables.size());
+        if (inserted)
+        {
+            variables.push_back(name);
+        }
+        segments.push_back(Segment{true, it->second, 0});
+        pos = close + 2;
+    }
+}
+
+const std::vector<std::string> &CompiledTemplate::get_variables() const
+{
+    return variables;
+}
+
+size_t CompiledTemplate::rendered_size(const json &vars) const
+{
+    size_t size = literals.size();
+    for (const Segment &segment : segments)
+    {
+        if (!segment.variable)
+        {
+            continue;
+        }
+        auto value = vars.find(variables[segment.offset]);
+        if (value != vars.end())
+        {
+            size += value->is_string() ? value->get_ref<const std::string &>().size() : scalar_size;
+        }
+    }
+    return size;
+}
+
+void CompiledTemplate::render(std::string &buffer, const json &vars, bool single_line) const
+{
+    for (const Segment &segment : segments)
+    {
+        if (!segment.variable)
+        {
+            buffer.append(literals, segment.offset, segment.length);
+            continue;
+        }
+        auto value = vars.find(variables[segment.offset]);
+        if (value == vars.end() || value->is_null())
+        {
+            throw std::runtime_error("Missing template variable " + variables[segment.offset]);
+        }
+        size_t start = buffer.size();
+        if (value->is_string())
+        {
+            buffer.append(value->get_ref<const std::string &>());
+        }
+        else if (value->is_number_integer())
+        {
+            fmt::format_to(std::back_inserter(buffer), "{}", value->get<int64_t>());
+        }
+        else
+        {
+            buffer.append(value->dump());
+        }
+        if (single_line)
+        {
+            flatten_line_breaks(buffer, start);
+        }
+    }
+}
+
+void flatten_line_breaks(std::string &buffer, size_t start)
+{
+    for (size_t i = start; i < buffer.size(); ++i)
+    {
+        if (buffer[i] == '\r' || buffer[i] == '\n')
+        {
+            buffer[i] = ' ';
+        }
+    }
+}
+
+// TemplateStore
+void TemplateStore::add(const std::string &id, const std::string &subject, const std::string &body)
+{
+    std::shared_ptr<EmailTemplate> email_template{new EmailTemplate{CompiledTemplate{subject}, CompiledTemplate{body}}};
+    templates[id] = std::move(email_template);
+}
+
+size_t TemplateStore::load_directory(const std::string &directory)
+{
+    size_t loaded = 0;
+    std::error_code ec;
+    for (const auto &file : std::filesystem::directory_iterator(directory, ec))
+    {
+        if (file.path().extension() != ".json")
+        {
+            continue;
+        }
+        std::string id{file.path().stem().string()};
+        std::ifstream in{file.path()};
+        json definition = json::parse(in, nullptr, false);
+        if (definition.is_discarded() || !definition.contains("subject") || !definition.contains("body") ||
+            !definition["subject"].is_string() || !definition["body"].is_string())
+        {
+            spdlog::error("Skipping email template {}: expected a JSON object with a subject and a body", file.path().string());
+            continue;
+        }
+        try
+        {
+            add(id, definition["subject"].get<std::string>(), definition["body"].get<std::string>());
+            loaded += 1;
+        }
+        catch (const std::invalid_argument &e)
+        {
+            spdlog::error("Skipping email template {}: {}", file.path().string(), e.what());
+        }
+    }
+    if (ec)
+    {
+        spdlog::error("Failed to read email templates from {}: {}", directory, ec.message());
+    }
+    return loaded;
+}
+
+const EmailTemplate *TemplateStore::find(const std::string &id) const
+{
+    auto it = templates.find(id);
+    return it == templates.end() ? nullptr : it->second.get();
+}
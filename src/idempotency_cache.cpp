@@ -0,0 +1,69 @@
+#include "../include/idempotency_cache.h"
+#include <algorithm>
+
+IdempotencyCache::IdempotencyCache(size_t capacity_, std::chrono::seconds window_) : capacity{std::max<size_t>(capacity_, 1)},
+                                                                                      window{window_}
+{
+}
+
+std::optional<std::string> IdempotencyCache::find(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock{cache_mutex};
+    auto it = items.find(key);
+    if (it == items.end())
+    {
+        return std::nullopt;
+    }
+    if (std::chrono::steady_clock::now() - it->second->stored_at >= window)
+    {
+        recent.erase(it->second);
+        items.erase(it);
+        return std::nullopt;
+    }
+    recent.splice(recent.begin(), recent, it->second);
+    return it->second->job_id;
+}
+
+void IdempotencyCache::remember(const std::string &key, const std::string &job_id, std::chrono::system_clock::time_point taken_at)
+{
+    // The age is measured on the wall clock once, the cache itself runs on the steady clock
+    auto age = std::max(std::chrono::system_clock::now() - taken_at, std::chrono::system_clock::duration::zero());
+    if (age >= window)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock{cache_mutex};
+    auto it = items.find(key);
+    if (it != items.end())
+    {
+        // Keep the time the key was first taken, so it still expires with the backend's copy
+        it->second->job_id = job_id;
+        recent.splice(recent.begin(), recent, it->second);
+        return;
+    }
+    recent.push_front(Item{key, job_id, std::chrono::steady_clock::now() - std::chrono::duration_cast<std::chrono::steady_clock::duration>(age)});
+    items.emplace(key, recent.begin());
+    if (items.size() > capacity)
+    {
+        items.erase(recent.back().key);
+        recent.pop_back();
+    }
+}
+
+void IdempotencyCache::expire()
+{
+    std::lock_guard<std::mutex> lock{cache_mutex};
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (auto it = recent.begin(); it != recent.end();)
+    {
+        if (now - it->stored_at >= window)
+        {
+            items.erase(it->key);
+            it = recent.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
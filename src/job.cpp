@@ -1,5 +1,6 @@
 #include "../include/job.h"
 #include "../include/chronotostring.h"
+#include "../include/queue_backend.h"
 #include <iostream>
 #include <sstream>
 #include <iomanip>
@@ -7,7 +8,7 @@
 #include <random>
 
 // Constructor - Assigns a unique ID and sets args
-Job::Job(const json &args_,
+Job::Job(json args_,
          const std::string &name_,
          const std::string &queue_,
          const int &attempts_,
@@ -15,22 +16,25 @@ Job::Job(const json &args_,
          std::optional<std::chrono::system_clock::time_point> last_executed_at_,
          const std::string &state_,
          std::optional<std::string> error_details_,
-         std::optional<std::string> reserved_by_) : args{args_},
-                                                    name{name_},
+         std::optional<std::string> reserved_by_) : name{name_},
+                                                    type_id{0},
                                                     queue{queue_},
+                                                    args(std::move(args_)),
                                                     attempts{attempts_},
                                                     next_execution_at{next_execution_at_},
                                                     last_executed_at{last_executed_at_},
                                                     state{state_},
                                                     error_details{error_details_},
-                                                    reserved_by{reserved_by_}
+                                                    reserved_by{reserved_by_},
+                                                    claimed_by{reserved_by_},
+                                                    dirty_fields{0}
 {
     created_at = std::chrono::system_clock::now();
     id = "job_" + generateHex(12);
 }
 
 Job::Job(const std::string &id_,
-         const json &args_,
+         json args_,
          const std::string &name_,
          const std::string &queue_,
          const int &attempts_,
@@ -39,172 +43,175 @@ Job::Job(const std::string &id_,
          const std::string &state_,
          std::optional<std::string> error_details_,
          std::optional<std::string> reserved_by_) : id{id_},
-                                                    args{args_},
                                                     name{name_},
+                                                    type_id{0},
                                                     queue{queue_},
+                                                    args(std::move(args_)),
                                                     attempts{attempts_},
                                                     next_execution_at{next_execution_at_},
                                                     last_executed_at{last_executed_at_},
                                                     state{state_},
                                                     error_details{error_details_},
-                                                    reserved_by{reserved_by_}
+                                                    reserved_by{reserved_by_},
+                                                    claimed_by{reserved_by_},
+                                                    dirty_fields{0}
 {
     created_at = std::chrono::system_clock::now();
 }
 
-void Job::save(sqlite3 *db) const
+bool Job::save(QueueBackend *backend) const
 {
-    sqlite3_stmt *stmt;
-    char *errMsg = nullptr;
-    bool connection_passed = true;
-    // Connect to database.db if no connection is passed
-    if (db==nullptr)
+    // Use the process-wide queue backend if none is passed
+    if (backend == nullptr)
     {
-        connection_passed = false;
-        if (sqlite3_open("database.db", &db) != SQLITE_OK)
+        backend = default_queue_backend();
+        if (backend == nullptr)
         {
-            spdlog::error("Failed to open database. Cannot save job with job id = {}", id);
-            return;
-        }    
-        
+            spdlog::error("No queue backend configured. Cannot save job with job id = {}", id);
+            return false;
+        }
     }
 
-    // SQL INSERT statement using prepared statements
-    const char *sql = R"(
-    INSERT INTO jobs (
-        id, name, args, queue, created_at, next_execution_at, 
-        last_executed_at, attempts, state, error_details, reserved_by
-    ) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)
-    ON CONFLICT(id) DO UPDATE SET 
-        name = excluded.name, 
-        args = excluded.args,
-        queue = excluded.queue,
-        created_at = excluded.created_at,
-        next_execution_at = excluded.next_execution_at,
-        last_executed_at = excluded.last_executed_at,
-        attempts = excluded.attempts,
-        state = excluded.state,
-        error_details = excluded.error_details,
-        reserved_by = excluded.reserved_by;
-)";
-
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    if (!backend->enqueue(*this))
     {
-        spdlog::error("Failed to prepare statement: {}, job id = {}", sqlite3_errmsg(db), id);
-        sqlite3_close(db);
-        return;
+        spdlog::error("Failed to insert job, job id = {}", id);
+        return false;
     }
+    spdlog::info("Job saved to queue: {}", id);
+    return true;
+}
 
-    // Bind values to the placeholders
-    sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_STATIC);                           // id
-    sqlite3_bind_text(stmt, 2, name.c_str(), -1, SQLITE_STATIC);                         // name
-    std::string args_str = args.dump();                                                  // Serialize JSON to string
-    sqlite3_bind_text(stmt, 3, args_str.c_str(), -1, SQLITE_STATIC);                     // args (JSON serialized to string)
-    sqlite3_bind_text(stmt, 4, queue.c_str(), -1, SQLITE_STATIC);                        // queue
-    sqlite3_bind_text(stmt, 5, chrono_to_string(created_at).c_str(), -1, SQLITE_STATIC); // created_at
+const std::string &Job::get_id() const
+{
+    return id;
+}
 
-    // Bind next_execution_at (nullable)
-    if (next_execution_at)
-    {
-        sqlite3_bind_text(stmt, 6, chrono_to_string(*next_execution_at).c_str(), -1, SQLITE_STATIC);
-    }
-    else
-    {
-        sqlite3_bind_null(stmt, 6); // NULL if no value
-    }
 
-    // Bind last_executed_at (nullable)
-    if (last_executed_at)
-    {
-        sqlite3_bind_text(stmt, 7, chrono_to_string(*last_executed_at).c_str(), -1, SQLITE_STATIC);
-    }
-    else
-    {
-        sqlite3_bind_null(stmt, 7); // NULL if no value
-    }
+std::string Job::get_name() const
+{
+    return name;
+}
 
-    sqlite3_bind_int(stmt, 8, attempts);                          // attempts
-    sqlite3_bind_text(stmt, 9, state.c_str(), -1, SQLITE_STATIC); // state
+int Job::get_type_id() const
+{
+    return type_id;
+}
 
-    // Bind error_details (nullable)
-    if (error_details)
-    {
-        sqlite3_bind_text(stmt, 10, error_details->c_str(), -1, SQLITE_STATIC);
-    }
-    else
-    {
-        sqlite3_bind_null(stmt, 10); // NULL if no value
-    }
+const json &Job::get_args() const
+{
+    return args;
+}
 
-    // Bind reserved_by (nullable)
-    if (reserved_by)
-    {
-        sqlite3_bind_text(stmt, 11, reserved_by->c_str(), -1, SQLITE_STATIC);
-    }
-    else
-    {
-        sqlite3_bind_null(stmt, 11); // NULL if no value
-    }
+std::string Job::get_queue() const
+{
+    return queue;
+}
 
-    // Execute the statement
-    if (sqlite3_step(stmt) != SQLITE_DONE)
-    {
-        spdlog::error("Failed to insert job: {}, job id = {}", sqlite3_errmsg(db),id);
-    }
-    else
-    {
-        spdlog::info("Job saved to database: {}", id);
-    }
+int Job::get_attempts() const
+{
+    return attempts;
+}
 
-    // Clean up
-    sqlite3_finalize(stmt);
-    // Only close database connection if it was opened by worker itself
-    if (!connection_passed)
-    {
-        sqlite3_close(db);
-    }
+std::chrono::system_clock::time_point Job::get_created_at() const
+{
+    return created_at;
 }
 
-std::string Job::get_id() const
+std::optional<std::chrono::system_clock::time_point> Job::get_next_execution_at() const
 {
-    return id;
+    return next_execution_at;
+}
+
+std::optional<std::chrono::system_clock::time_point> Job::get_last_executed_at() const
+{
+    return last_executed_at;
 }
 
+std::string Job::get_state() const
+{
+    return state;
+}
 
-std::string Job::get_name() const
+unsigned Job::get_dirty_fields() const
 {
-    return name;
+    return dirty_fields;
 }
 
-json Job::get_args() const
+bool Job::is_dirty(Field field) const
 {
-    return args;
+    return (dirty_fields & field) != 0;
+}
+
+void Job::clear_dirty()
+{
+    dirty_fields = 0;
+}
+
+std::optional<std::string> Job::get_error_details() const
+{
+    return error_details;
+}
+
+std::optional<std::string> Job::get_reserved_by() const
+{
+    return reserved_by;
+}
+
+std::optional<std::string> Job::get_claimed_by() const
+{
+    return claimed_by;
+}
+
+std::string Job::get_status() const
+{
+    if (state == "waiting" && reserved_by)
+    {
+        return "running";
+    }
+    return state;
+}
+
+void Job::set_type_id(int type_id_)
+{
+    type_id = type_id_;
+    dirty_fields |= field_type_id;
+}
+
+void Job::set_created_at(std::chrono::system_clock::time_point created_at_)
+{
+    created_at = created_at_;
+    dirty_fields |= field_created_at;
 }
 
 void Job::set_reserved_by(std::optional<std::string> worker_id)
 {
     reserved_by = std::move(worker_id);
+    dirty_fields |= field_reserved_by;
 }
 
 void Job::increase_attempts()
 {
     attempts += 1;
+    dirty_fields |= field_attempts;
 }
 
 void Job::set_latest_attempt_to_now()
 {
     last_executed_at = std::chrono::system_clock::now();
+    dirty_fields |= field_last_executed_at;
 }
 
 void Job::set_state(const std::string &state_)
 {
     state = state_;
+    dirty_fields |= field_state;
     //TODO: check if values are allowed and throw error if needed
 }
 
 void Job::set_queue(const std::string &queue_)
 {
     queue = queue_;
+    dirty_fields |= field_queue;
 }
 
 void Job::set_error_details(std::optional<std::string> error_msg)
@@ -217,6 +224,7 @@ void Job::set_error_details(std::optional<std::string> error_msg)
     {
         error_details = std::nullopt;
     }
+    dirty_fields |= field_error_details;
 }
 
 void Job::set_next_attempt(std::optional<std::chrono::system_clock::time_point> next_attempt)
@@ -229,4 +237,5 @@ void Job::set_next_attempt(std::optional<std::chrono::system_clock::time_point>
     {
         next_execution_at = std::nullopt;
     }
+    dirty_fields |= field_next_execution_at;
 }
@@ -0,0 +1,111 @@
+#include "../include/job_status_cache.h"
+#include "../include/chronotostring.h"
+#include <algorithm>
+
+namespace
+{
+json time_to_json(const std::optional<std::chrono::system_clock::time_point> &tp)
+{
+    if (!tp)
+    {
+        return nullptr;
+    }
+    return chrono_to_string(*tp);
+}
+
+bool is_finished(const std::string &status)
+{
+    return status == "succeeded" || status == "failed";
+}
+}
+
+JobStatusCache::JobStatusCache(size_t capacity_, std::chrono::milliseconds unfinished_ttl_) : capacity{std::max<size_t>(capacity_, 1)},
+                                                                                              unfinished_ttl{unfinished_ttl_}
+{
+}
+
+json JobStatusCache::describe(const Job &job)
+{
+    std::optional<std::string> error_details{job.get_error_details()};
+    std::optional<std::string> reserved_by{job.get_reserved_by()};
+    return json{{"id", job.get_id()},
+                {"name", job.get_name()},
+                {"queue", job.get_queue()},
+                {"state", job.get_status()},
+                {"attempts", job.get_attempts()},
+                {"created_at", time_to_json(job.get_created_at())},
+                {"next_execution_at", time_to_json(job.get_next_execution_at())},
+                {"last_executed_at", time_to_json(job.get_last_executed_at())},
+                {"error_details", error_details ? json(*error_details) : json(nullptr)},
+                {"worker", reserved_by ? json(*reserved_by) : json(nullptr)}};
+}
+
+void JobStatusCache::store(const std::string &id, json status, bool finished)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    auto it = items.find(id);
+    if (it != items.end())
+    {
+        it->second->status = std::move(status);
+        it->second->finished = finished;
+        it->second->stored_at = now;
+        recent.splice(recent.begin(), recent, it->second);
+        return;
+    }
+    recent.push_front(Item{id, std::move(status), finished, now});
+    items.emplace(id, recent.begin());
+    if (items.size() > capacity)
+    {
+        items.erase(recent.back().id);
+        recent.pop_back();
+    }
+}
+
+void JobStatusCache::update(const Job &job)
+{
+    json status = describe(job);
+    std::lock_guard<std::mutex> lock{cache_mutex};
+    store(job.get_id(), std::move(status), is_finished(job.get_state()));
+}
+
+std::optional<json> JobStatusCache::get(const std::string &id, QueueBackend &backend)
+{
+    {
+        std::lock_guard<std::mutex> lock{cache_mutex};
+        auto it = items.find(id);
+        if (it != items.end())
+        {
+            if (it->second->finished || std::chrono::steady_clock::now() - it->second->stored_at < unfinished_ttl)
+            {
+                recent.splice(recent.begin(), recent, it->second);
+                return it->second->status;
+            }
+        }
+    }
+
+    // Miss or stale entry: read through to the backend without holding the lock
+    std::chrono::steady_clock::time_point read_at = std::chrono::steady_clock::now();
+    std::unique_ptr<Job> job = backend.get_job(id);
+    if (!job)
+    {
+        // The backend may have dropped a finished job (e.g. the journal), keep serving what we had
+        std::lock_guard<std::mutex> lock{cache_mutex};
+        auto it = items.find(id);
+        if (it != items.end())
+        {
+            return it->second->status;
+        }
+        return std::nullopt;
+    }
+    json status = describe(*job);
+    std::lock_guard<std::mutex> lock{cache_mutex};
+    auto it = items.find(id);
+    // A worker may have stored a newer state while the backend was read, which the row must not replace
+    if (it != items.end() && (it->second->finished || it->second->stored_at >= read_at))
+    {
+        recent.splice(recent.begin(), recent, it->second);
+        return it->second->status;
+    }
+    store(id, status, is_finished(job->get_state()));
+    return status;
+}
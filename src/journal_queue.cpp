@@ -0,0 +1,1127 @@
+#include "../include/journal_queue.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+const char segment_magic[4] = {'E', 'T', 'Q', 'J'};
+const size_t segment_header_size = 8;           // Magic and format version
+const size_t record_header_size = 9;            // Payload length, checksum and record type
+const uint8_t snapshot_record = 1;              // Full state of a job including its arguments
+const uint8_t update_record = 2;                // State transition of a job
+const uint8_t key_record = 3;                   // Idempotency key taken by a job
+const uint8_t discard_record = 4;               // Job whose enqueue failed and that must not be replayed
+
+uint32_t checksum(uint8_t type, const char *data, size_t size)
+{
+    // FNV-1a over the record type and payload
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ type) * 16777619u;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+    }
+    return hash;
+}
+
+json time_to_json(const std::optional<std::chrono::system_clock::time_point> &tp)
+{
+    if (!tp)
+    {
+        return nullptr;
+    }
+    return std::chrono::duration_cast<std::chrono::seconds>(tp->time_since_epoch()).count();
+}
+
+std::optional<std::chrono::system_clock::time_point> time_from_json(const json &value)
+{
+    if (value.is_null())
+    {
+        return std::nullopt;
+    }
+    return std::chrono::system_clock::time_point{std::chrono::seconds{value.get<int64_t>()}};
+}
+
+json string_to_json(const std::optional<std::string> &value)
+{
+    if (!value)
+    {
+        return nullptr;
+    }
+    return *value;
+}
+
+std::optional<std::string> string_from_json(const json &value)
+{
+    if (value.is_null())
+    {
+        return std::nullopt;
+    }
+    return value.get<std::string>();
+}
+
+bool is_finished(const std::string &state)
+{
+    return state == "succeeded" || state == "failed";
+}
+
+std::string segment_name(uint32_t number)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "segment-%08u.log", number);
+    return name;
+}
+}
+
+// JournalSegment
+JournalSegment::JournalSegment(uint32_t number_, const std::string &path_, int fd_, char *data_, size_t capacity_) : number{number_},
+                                                                                                                     path{path_},
+                                                                                                                     fd{fd_},
+                                                                                                                     data{data_},
+                                                                                                                     capacity{capacity_},
+                                                                                                                     write_pos{segment_header_size},
+                                                                                                                     synced_pos{0}
+{
+}
+
+JournalSegment::~JournalSegment()
+{
+    munmap(data, capacity);
+    close(fd);
+}
+
+bool JournalSegment::sync(size_t from, size_t to) const
+{
+    if (to <= from)
+    {
+        return true;
+    }
+    // msync needs a page aligned start address
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t start = from / page * page;
+    return msync(data + start, to - start, MS_SYNC) == 0;
+}
+
+// JournalQueue
+JournalQueue::JournalQueue(const std::string &directory_,
+                           size_t segment_size_,
+                           bool sync_appends_,
+                           const std::vector<std::string> &queues_,
+                           std::chrono::seconds lease_timeout_,
+                           size_t finished_capacity_) : directory{directory_},
+                                                        segment_size{segment_size_},
+                                                        sync_appends{sync_appends_},
+                                                        compaction_ratio{0.1},
+                                                        queues{queues_},
+                                                        lease_timeout{lease_timeout_},
+                                                        appended_bytes{0},
+                                                        synced_bytes{0},
+                                                        finished_capacity{finished_capacity_},
+                                                        stopping{false},
+                                                        failed{false}
+{
+}
+
+JournalQueue::~JournalQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock{journal_mutex};
+        stopping = true;
+    }
+    flush_cv.notify_all();
+    synced_cv.notify_all();
+    stop_cv.notify_all();
+    if (flusher.joinable())
+    {
+        flusher.join();
+    }
+    if (compactor.joinable())
+    {
+        compactor.join();
+    }
+    // Make sure nothing appended after the flusher stopped is lost
+    if (active)
+    {
+        active->sync(active->synced_pos, active->write_pos);
+    }
+    spdlog::info("Closed journal: {}", directory);
+}
+
+std::shared_ptr<JournalSegment> JournalQueue::open_segment(uint32_t number, bool create)
+{
+    std::string path{directory + "/" + segment_name(number)};
+    int fd = create ? ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644) : ::open(path.c_str(), O_RDWR);
+    if (fd < 0)
+    {
+        spdlog::error("Failed to open journal segment {}: {}", path, std::strerror(errno));
+        return nullptr;
+    }
+
+    size_t capacity = segment_size;
+    if (create)
+    {
+        if (ftruncate(fd, static_cast<off_t>(capacity)) != 0)
+        {
+            spdlog::error("Failed to allocate journal segment {}: {}", path, std::strerror(errno));
+            close(fd);
+            return nullptr;
+        }
+    }
+    else
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < segment_header_size)
+        {
+            spdlog::error("Journal segment {} is truncated", path);
+            close(fd);
+            return nullptr;
+        }
+        capacity = static_cast<size_t>(st.st_size);
+    }
+
+    void *data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        spdlog::error("Failed to map journal segment {}: {}", path, std::strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    std::shared_ptr<JournalSegment> segment{new JournalSegment{number, path, fd, static_cast<char *>(data), capacity}};
+    if (create)
+    {
+        uint32_t version = 1;
+        std::memcpy(segment->data, segment_magic, sizeof(segment_magic));
+        std::memcpy(segment->data + sizeof(segment_magic), &version, sizeof(version));
+    }
+    else if (std::memcmp(segment->data, segment_magic, sizeof(segment_magic)) != 0)
+    {
+        spdlog::error("{} is not a journal segment", path);
+        return nullptr;
+    }
+    return segment;
+}
+
+// Seal the active segment and continue in a new one. Must be called with journal_mutex held.
+bool JournalQueue::roll_segment()
+{
+    // Flush the tail of the sealed segment so the flusher only ever has to look at the active one
+    if (!active->sync(active->synced_pos, active->write_pos))
+    {
+        spdlog::error("Failed to flush journal segment {}: {}", active->path, std::strerror(errno));
+        failed = true;
+        synced_cv.notify_all();
+        return false;
+    }
+    active->synced_pos = active->write_pos;
+
+    std::shared_ptr<JournalSegment> segment = open_segment(active->number + 1, true);
+    if (!segment)
+    {
+        return false;
+    }
+    segments[segment->number] = segment;
+    live_bytes[segment->number] = 0;
+    active = segment;
+    synced_bytes = appended_bytes;
+    synced_cv.notify_all();
+    return true;
+}
+
+// Append a record to the active segment. Must be called with journal_mutex held.
+std::optional<JournalQueue::Location> JournalQueue::append(uint8_t type, const std::string &payload)
+{
+    if (failed)
+    {
+        spdlog::error("Journal {} failed to flush earlier and no longer accepts records", directory);
+        return std::nullopt;
+    }
+    size_t size = record_header_size + payload.size();
+    if (size > segment_size - segment_header_size)
+    {
+        spdlog::error("Journal record of {} bytes does not fit into a segment", size);
+        return std::nullopt;
+    }
+    if (active->write_pos + size > active->capacity && !roll_segment())
+    {
+        return std::nullopt;
+    }
+
+    char *record = active->data + active->write_pos;
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    uint32_t sum = checksum(type, payload.data(), payload.size());
+    std::memcpy(record + record_header_size, payload.data(), payload.size());
+    std::memcpy(record + 4, &sum, sizeof(sum));
+    record[8] = static_cast<char>(type);
+    std::memcpy(record, &length, sizeof(length));
+
+    Location location{active->number, active->write_pos, size};
+    active->write_pos += size;
+    appended_bytes += size;
+    flush_cv.notify_one();
+    return location;
+}
+
+// Block until everything up to target has been flushed by the group flusher. Returns false when
+// the flush failed before reaching target
+bool JournalQueue::wait_for_sync(uint64_t target, std::unique_lock<std::mutex> &lock)
+{
+    if (!sync_appends)
+    {
+        return true;
+    }
+    synced_cv.wait(lock, [&]
+                   { return synced_bytes >= target || stopping || failed; });
+    return synced_bytes >= target || !failed;
+}
+
+void JournalQueue::flush_loop()
+{
+    std::unique_lock<std::mutex> lock{journal_mutex};
+    while (true)
+    {
+        flush_cv.wait(lock, [&]
+                      { return stopping || failed || appended_bytes > synced_bytes; });
+        if (failed || appended_bytes == synced_bytes)
+        {
+            break; // Stopping and nothing left to flush
+        }
+
+        // All appends made up to now are flushed together with a single msync
+        std::shared_ptr<JournalSegment> segment = active;
+        size_t from = segment->synced_pos;
+        size_t to = segment->write_pos;
+        uint64_t target = appended_bytes;
+        lock.unlock();
+        bool synced = segment->sync(from, to);
+        lock.lock();
+
+        if (!synced)
+        {
+            // The records may not be on disk, so their appenders are failed instead of acknowledged
+            spdlog::error("Failed to flush journal segment {}: {}", segment->path, std::strerror(errno));
+            failed = true;
+            synced_cv.notify_all();
+            break;
+        }
+        segment->synced_pos = std::max(segment->synced_pos, to);
+        synced_bytes = std::max(synced_bytes, target);
+        synced_cv.notify_all();
+    }
+}
+
+void JournalQueue::compact_loop()
+{
+    std::unique_lock<std::mutex> lock{journal_mutex};
+    while (!stopping)
+    {
+        stop_cv.wait_for(lock, std::chrono::seconds(1));
+        if (stopping)
+        {
+            break;
+        }
+        lock.unlock();
+        while (compact_oldest())
+        {
+        }
+        lock.lock();
+    }
+}
+
+// Reclaim the oldest sealed segment once little of it is still live. Snapshots of unfinished jobs
+// that still live in it are rewritten to the active segment first. Only the oldest segment may be
+// reclaimed, because newer segments can hold updates of jobs whose snapshot lives in older ones.
+bool JournalQueue::compact_oldest()
+{
+    std::unique_lock<std::mutex> lock{journal_mutex};
+    if (segments.size() < 2 || stopping)
+    {
+        return false;
+    }
+    std::shared_ptr<JournalSegment> oldest = segments.begin()->second;
+    // Records of enqueues still waiting for their flush are not indexed and could not be relocated
+    if (oldest == active || live_bytes[oldest->number] > compaction_ratio * oldest->capacity || unpublished[oldest->number] > 0)
+    {
+        return false;
+    }
+
+    size_t relocated = 0;
+    for (auto &[id, entry] : index)
+    {
+        if (entry.snapshot.segment != oldest->number)
+        {
+            continue;
+        }
+        std::unique_ptr<Job> job = materialize(id, entry);
+        json record = {{"id", id},
+                       {"name", entry.name},
+                       {"type_id", entry.type_id},
+                       {"args", job->get_args()},
+                       {"queue", entry.queue},
+                       {"created_at", time_to_json(entry.created_at)},
+                       {"next_execution_at", time_to_json(entry.next_execution_at)},
+                       {"last_executed_at", time_to_json(entry.last_executed_at)},
+                       {"attempts", entry.attempts},
+                       {"state", entry.state},
+                       {"error_details", string_to_json(entry.error_details)},
+                       {"reserved_by", string_to_json(entry.reserved_by)}};
+        std::optional<Location> location = append(snapshot_record, record.dump());
+        if (!location)
+        {
+            return false;
+        }
+        live_bytes[entry.snapshot.segment] -= entry.snapshot.size;
+        live_bytes[location->segment] += location->size;
+        entry.snapshot = *location;
+        relocated += 1;
+    }
+    for (auto &[key, entry] : idempotency_keys)
+    {
+        if (entry.record.segment != oldest->number)
+        {
+            continue;
+        }
+        std::optional<Location> location = append_key(key, entry);
+        if (!location)
+        {
+            return false;
+        }
+        live_bytes[entry.record.segment] -= entry.record.size;
+        live_bytes[location->segment] += location->size;
+        entry.record = *location;
+    }
+
+    // The relocated records must be on disk before the old copies are deleted
+    if (!active->sync(active->synced_pos, active->write_pos))
+    {
+        spdlog::error("Failed to flush journal segment {}, not reclaiming {}", active->path, oldest->path);
+        return false;
+    }
+    active->synced_pos = active->write_pos;
+    synced_bytes = appended_bytes;
+    synced_cv.notify_all();
+
+    segments.erase(oldest->number);
+    live_bytes.erase(oldest->number);
+    unpublished.erase(oldest->number);
+    if (unlink(oldest->path.c_str()) != 0)
+    {
+        spdlog::error("Failed to remove journal segment {}: {}", oldest->path, std::strerror(errno));
+    }
+    spdlog::info("Reclaimed journal segment {}, relocated {} jobs", oldest->path, relocated);
+    return true;
+}
+
+void JournalQueue::apply_snapshot(const std::string &id, const json &record, const Location &location)
+{
+    auto existing = index.find(id);
+    if (existing != index.end())
+    {
+        live_bytes[existing->second.snapshot.segment] -= existing->second.snapshot.size;
+        index.erase(existing);
+    }
+
+    Entry entry{location,
+                record["name"].get<std::string>(),
+                record.value("type_id", 0),
+                record["queue"].get<std::string>(),
+                time_from_json(record["created_at"]).value_or(std::chrono::system_clock::now()),
+                time_from_json(record["next_execution_at"]),
+                time_from_json(record["last_executed_at"]),
+                record["attempts"].get<int>(),
+                record["state"].get<std::string>(),
+                string_from_json(record["error_details"]),
+                string_from_json(record["reserved_by"]),
+                std::chrono::system_clock::time_point{}};
+    // Finished jobs are not indexed, their records are reclaimed with their segment
+    if (is_finished(entry.state))
+    {
+        remember_finished(id, std::move(entry));
+        return;
+    }
+    live_bytes[location.segment] += location.size;
+    index.emplace(id, std::move(entry));
+}
+
+void JournalQueue::apply_key(const json &record, const Location &location)
+{
+    std::string key{record["key"].get<std::string>()};
+    auto existing = idempotency_keys.find(key);
+    if (existing != idempotency_keys.end())
+    {
+        live_bytes[existing->second.record.segment] -= existing->second.record.size;
+    }
+    KeyEntry entry{record["id"].get<std::string>(),
+                   time_from_json(record["created_at"]).value_or(std::chrono::system_clock::now()),
+                   location};
+    live_bytes[location.segment] += location.size;
+    idempotency_keys[key] = std::move(entry);
+}
+
+// Append the record of an idempotency key. Must be called with journal_mutex held.
+std::optional<JournalQueue::Location> JournalQueue::append_key(const std::string &key, const KeyEntry &entry)
+{
+    json record = {{"id", entry.job_id},
+                   {"key", key},
+                   {"created_at", time_to_json(entry.created_at)}};
+    return append(key_record, record.dump());
+}
+
+void JournalQueue::replay(JournalSegment &segment)
+{
+    size_t pos = segment_header_size;
+    size_t records = 0;
+    while (pos + record_header_size <= segment.capacity)
+    {
+        const char *record = segment.data + pos;
+        uint32_t length;
+        uint32_t sum;
+        std::memcpy(&length, record, sizeof(length));
+        std::memcpy(&sum, record + 4, sizeof(sum));
+        uint8_t type = static_cast<uint8_t>(record[8]);
+        if (length == 0 || pos + record_header_size + length > segment.capacity)
+        {
+            break;
+        }
+        // A checksum mismatch marks a record that was torn by a crash, everything after it is discarded
+        const char *payload = record + record_header_size;
+        if (checksum(type, payload, length) != sum)
+        {
+            spdlog::warn("Journal segment {}: discarding torn record at offset {}", segment.path, pos);
+            break;
+        }
+
+        json data = json::parse(payload, payload + length);
+        std::string id{data["id"].get<std::string>()};
+        if (type == snapshot_record)
+        {
+            apply_snapshot(id, data, Location{segment.number, pos, record_header_size + length});
+        }
+        else if (type == update_record)
+        {
+            auto it = index.find(id);
+            if (it != index.end())
+            {
+                Entry &entry = it->second;
+                entry.next_execution_at = time_from_json(data["next_execution_at"]);
+                entry.last_executed_at = time_from_json(data["last_executed_at"]);
+                entry.attempts = data["attempts"].get<int>();
+                entry.state = data["state"].get<std::string>();
+                entry.error_details = string_from_json(data["error_details"]);
+                entry.reserved_by = string_from_json(data["reserved_by"]);
+                if (is_finished(entry.state))
+                {
+                    live_bytes[entry.snapshot.segment] -= entry.snapshot.size;
+                    remember_finished(id, std::move(entry));
+                    index.erase(it);
+                }
+            }
+        }
+        else if (type == key_record)
+        {
+            apply_key(data, Location{segment.number, pos, record_header_size + length});
+        }
+        else if (type == discard_record)
+        {
+            auto it = index.find(id);
+            if (it != index.end())
+            {
+                live_bytes[it->second.snapshot.segment] -= it->second.snapshot.size;
+                index.erase(it);
+            }
+        }
+        pos += record_header_size + length;
+        records += 1;
+    }
+
+    // Clear a torn tail so that it cannot be mistaken for records appended later
+    if (pos < segment.capacity)
+    {
+        size_t tail = std::min(segment.capacity - pos, record_header_size);
+        if (std::any_of(segment.data + pos, segment.data + pos + tail, [](char c)
+                        { return c != 0; }))
+        {
+            std::memset(segment.data + pos, 0, segment.capacity - pos);
+        }
+    }
+    segment.write_pos = pos;
+    segment.synced_pos = pos;
+    spdlog::info("Replayed {} records from journal segment {}", records, segment.path);
+}
+
+bool JournalQueue::open(bool reset)
+{
+    std::unique_lock<std::mutex> lock{journal_mutex};
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    if (ec)
+    {
+        spdlog::error("Failed to create journal directory {}: {}", directory, ec.message());
+        return false;
+    }
+
+    // Collect the existing segments in order
+    std::vector<uint32_t> numbers;
+    for (const auto &file : std::filesystem::directory_iterator(directory))
+    {
+        std::string name{file.path().filename().string()};
+        unsigned int number;
+        if (std::sscanf(name.c_str(), "segment-%08u.log", &number) != 1)
+        {
+            continue;
+        }
+        if (reset)
+        {
+            std::filesystem::remove(file.path(), ec);
+            continue;
+        }
+        numbers.push_back(number);
+    }
+    std::sort(numbers.begin(), numbers.end());
+
+    for (uint32_t number : numbers)
+    {
+        std::shared_ptr<JournalSegment> segment = open_segment(number, false);
+        if (!segment)
+        {
+            return false;
+        }
+        live_bytes[number] = 0;
+        replay(*segment);
+        segments[number] = segment;
+    }
+
+    if (segments.empty())
+    {
+        std::shared_ptr<JournalSegment> segment = open_segment(1, true);
+        if (!segment)
+        {
+            return false;
+        }
+        segments[1] = segment;
+        live_bytes[1] = 0;
+    }
+    active = segments.rbegin()->second;
+
+    // Jobs that were reserved when the process stopped are handed out again, oldest first
+    std::vector<std::pair<std::chrono::system_clock::time_point, std::string>> pending;
+    pending.reserve(index.size());
+    for (const auto &[id, entry] : index)
+    {
+        pending.emplace_back(entry.created_at, id);
+    }
+    std::sort(pending.begin(), pending.end());
+    for (const auto &[created_at, id] : pending)
+    {
+        make_waiting(id, index.at(id));
+    }
+
+    flusher = std::thread(&JournalQueue::flush_loop, this);
+    compactor = std::thread(&JournalQueue::compact_loop, this);
+    spdlog::info("Opened journal {} with {} segments and {} pending jobs", directory, segments.size(), index.size());
+    return true;
+}
+
+std::unique_ptr<Job> JournalQueue::materialize(const std::string &id, const Entry &entry) const
+{
+    // The snapshot of a finished job may have been reclaimed already, its arguments are not kept
+    json args;
+    if (!is_finished(entry.state))
+    {
+        const JournalSegment &segment = *segments.at(entry.snapshot.segment);
+        const char *payload = segment.data + entry.snapshot.offset + record_header_size;
+        args = std::move(json::parse(payload, payload + entry.snapshot.size - record_header_size)["args"]);
+    }
+
+    std::unique_ptr<Job> job{new Job{id,
+                                     std::move(args),
+                                     entry.name,
+                                     entry.queue,
+                                     entry.attempts,
+                                     entry.next_execution_at,
+                                     entry.last_executed_at,
+                                     entry.state,
+                                     entry.error_details,
+                                     entry.reserved_by}};
+    job->set_type_id(entry.type_id);
+    job->set_created_at(entry.created_at);
+    job->clear_dirty();
+    return job;
+}
+
+std::string JournalQueue::update_payload(const std::string &id, const Entry &entry) const
+{
+    json record = {{"id", id},
+                   {"next_execution_at", time_to_json(entry.next_execution_at)},
+                   {"last_executed_at", time_to_json(entry.last_executed_at)},
+                   {"attempts", entry.attempts},
+                   {"state", entry.state},
+                   {"error_details", string_to_json(entry.error_details)},
+                   {"reserved_by", string_to_json(entry.reserved_by)}};
+    return record.dump();
+}
+
+// Mark a job as claimable and put it into the ready or delayed jobs. Must be called with journal_mutex held.
+void JournalQueue::make_waiting(const std::string &id, Entry &entry)
+{
+    entry.state = "waiting";
+    entry.reserved_by = std::nullopt;
+    waiting[entry.queue] += 1;
+    if (entry.next_execution_at && *entry.next_execution_at > std::chrono::system_clock::now())
+    {
+        delayed.emplace(*entry.next_execution_at, id);
+    }
+    else
+    {
+        ready[entry.queue].push_back(id);
+    }
+}
+
+// Keep the state of a finished job, dropping the oldest ones beyond finished_capacity.
+// Must be called with journal_mutex held.
+void JournalQueue::remember_finished(const std::string &id, Entry entry)
+{
+    if (finished.insert_or_assign(id, std::move(entry)).second)
+    {
+        finished_order.push_back(id);
+    }
+    while (finished.size() > finished_capacity)
+    {
+        finished.erase(finished_order.front());
+        finished_order.pop_front();
+    }
+}
+
+json JournalQueue::snapshot_payload(const Job &job) const
+{
+    return {{"id", job.get_id()},
+            {"name", job.get_name()},
+            {"type_id", job.get_type_id()},
+            {"args", job.get_args()},
+            {"queue", job.get_queue()},
+            {"created_at", time_to_json(job.get_created_at())},
+            {"next_execution_at", time_to_json(job.get_next_execution_at())},
+            {"last_executed_at", time_to_json(job.get_last_executed_at())},
+            {"attempts", job.get_attempts()},
+            {"state", job.get_state()},
+            {"error_details", string_to_json(job.get_error_details())},
+            {"reserved_by", string_to_json(job.get_reserved_by())}};
+}
+
+// Index a job whose snapshot is in the journal. Must be called with journal_mutex held.
+void JournalQueue::publish(const std::string &id, const json &record, const Location &location)
+{
+    // Saving a job again replaces its previous snapshot
+    auto existing = index.find(id);
+    if (existing != index.end() && existing->second.state == "waiting" && !existing->second.reserved_by)
+    {
+        waiting[existing->second.queue] -= 1;
+    }
+    apply_snapshot(id, record, location);
+    auto entry = index.find(id);
+    if (entry != index.end() && entry->second.state == "waiting" && !entry->second.reserved_by)
+    {
+        make_waiting(id, entry->second);
+    }
+}
+
+// Mark the snapshot of a job whose enqueue failed, so that it is skipped when the journal is replayed.
+// Must be called with journal_mutex held.
+void JournalQueue::discard(const std::string &id)
+{
+    json record = {{"id", id}};
+    if (!append(discard_record, record.dump()))
+    {
+        spdlog::error("Failed to discard job {}, it is enqueued again when the journal is replayed", id);
+    }
+}
+
+bool JournalQueue::enqueue(const Job &job)
+{
+    std::unique_lock<std::mutex> lock{journal_mutex};
+    json record = snapshot_payload(job);
+    std::optional<Location> location = append(snapshot_record, record.dump());
+    if (!location)
+    {
+        return false;
+    }
+
+    // The job is only handed to the workers once the caller can be told that it is stored
+    unpublished[location->segment] += 1;
+    bool synced = wait_for_sync(appended_bytes, lock);
+    unpublished[location->segment] -= 1;
+    if (!synced)
+    {
+        return false;
+    }
+    publish(job.get_id(), record, *location);
+    return true;
+}
+
+std::vector<std::unique_ptr<Job>> JournalQueue::claim(const std::string &worker_id, size_t max_jobs)
+{
+    std::vector<std::unique_ptr<Job>> jobs;
+    std::lock_guard<std::mutex> lock{journal_mutex};
+
+    // Move delayed jobs that are due to their queue. Rescheduling a job leaves its earlier entry
+    // behind, which is skipped unless it still matches the job's execution time
+    std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+    while (!delayed.empty() && delayed.begin()->first <= now)
+    {
+        auto it = index.find(delayed.begin()->second);
+        if (it != index.end() && it->second.state == "waiting" && !it->second.reserved_by &&
+            it->second.next_execution_at == delayed.begin()->first)
+        {
+            ready[it->second.queue].push_back(it->first);
+        }
+        delayed.erase(delayed.begin());
+    }
+
+    // Jobs whose lease expired were reserved by a worker that did not finish or release them, they
+    // are handed out again first. A lease that ended or was renewed leaves its entry behind, which is
+    // dropped once it comes first, so that the leases only grow with the jobs being executed
+    while (!leases.empty())
+    {
+        auto it = index.find(leases.front().second);
+        bool held = it != index.end() && it->second.state == "waiting" && it->second.reserved_by &&
+                    it->second.lease_expires == leases.front().first;
+        if (held && leases.front().first >= now)
+        {
+            break;
+        }
+        if (held)
+        {
+            spdlog::warn("Lease of job {} held by {} expired, handing it out again", it->first, *it->second.reserved_by);
+            it->second.reserved_by = std::nullopt;
+            waiting[it->second.queue] += 1;
+            ready[it->second.queue].push_front(it->first);
+        }
+        leases.pop_front();
+    }
+
+    // Reservations are kept in memory only: after a restart every unfinished job is waiting again
+    for (const std::string &queue : queues)
+    {
+        std::deque<std::string> &ids = ready[queue];
+        while (jobs.size() < max_jobs && !ids.empty())
+        {
+            auto it = index.find(ids.front());
+            ids.pop_front();
+            // Skip ids of jobs that were finished, claimed or rescheduled into the future in the meantime.
+            // The latter are in the delayed jobs as well
+            if (it == index.end() || it->second.state != "waiting" || it->second.reserved_by ||
+                (it->second.next_execution_at && *it->second.next_execution_at > now))
+            {
+                continue;
+            }
+            it->second.reserved_by = worker_id;
+            it->second.lease_expires = now + lease_timeout;
+            leases.emplace_back(it->second.lease_expires, it->first);
+            waiting[queue] -= 1;
+            jobs.push_back(materialize(it->first, it->second));
+        }
+    }
+    return jobs;
+}
+
+bool JournalQueue::lost_lease(const Job &job, const Entry &entry) const
+{
+    if (!job.get_claimed_by() || (entry.state == "waiting" && entry.reserved_by == job.get_claimed_by()))
+    {
+        return false;
+    }
+    spdlog::warn("Worker {} lost the lease of job {}, its result is discarded", *job.get_claimed_by(), job.get_id());
+    return true;
+}
+
+SaveResult JournalQueue::finish(const Job &job)
+{
+    std::unique_lock<std::mutex> lock{journal_mutex};
+    std::string id{job.get_id()};
+    auto it = index.find(id);
+    if (it == index.end())
+    {
+        // Finished jobs leave the index, so a worker that lost its lease may find the job gone
+        if (job.get_claimed_by() && finished.count(id))
+        {
+            spdlog::warn("Worker {} lost the lease of job {}, its result is discarded", *job.get_claimed_by(), id);
+            return SaveResult::lease_lost;
+        }
+        spdlog::error("Job {} is not in the journal", id);
+        return SaveResult::failed;
+    }
+
+    Entry &entry = it->second;
+    if (lost_lease(job, entry))
+    {
+        return SaveResult::lease_lost;
+    }
+    // The index only changes once the record is in the journal, a failed append leaves the job as it was
+    Entry updated = entry;
+    updated.next_execution_at = job.get_next_execution_at();
+    updated.last_executed_at = job.get_last_executed_at();
+    updated.attempts = job.get_attempts();
+    updated.state = job.get_state();
+    updated.error_details = job.get_error_details();
+    updated.reserved_by = job.get_reserved_by();
+    if (!append(update_record, update_payload(id, updated)))
+    {
+        return SaveResult::failed;
+    }
+    entry = std::move(updated);
+    if (is_finished(entry.state))
+    {
+        live_bytes[entry.snapshot.segment] -= entry.snapshot.size;
+        remember_finished(id, std::move(entry));
+        index.erase(it);
+    }
+    if (!wait_for_sync(appended_bytes, lock))
+    {
+        return SaveResult::failed;
+    }
+    return SaveResult::saved;
+}
+
+SaveResult JournalQueue::ack(const Job &job)
+{
+    return finish(job);
+}
+
+SaveResult JournalQueue::nack(const Job &job)
+{
+    return finish(job);
+}
+
+SaveResult JournalQueue::schedule(const Job &job, std::chrono::system_clock::time_point at)
+{
+    std::unique_lock<std::mutex> lock{journal_mutex};
+    auto it = index.find(job.get_id());
+    if (it == index.end())
+    {
+        if (job.get_claimed_by() && finished.count(job.get_id()))
+        {
+            spdlog::warn("Worker {} lost the lease of job {}, its result is discarded", *job.get_claimed_by(), job.get_id());
+            return SaveResult::lease_lost;
+        }
+        spdlog::error("Job {} is not in the journal", job.get_id());
+        return SaveResult::failed;
+    }
+
+    Entry &entry = it->second;
+    if (lost_lease(job, entry))
+    {
+        return SaveResult::lease_lost;
+    }
+    Entry updated = entry;
+    updated.next_execution_at = at;
+    updated.attempts = job.get_attempts();
+    updated.last_executed_at = job.get_last_executed_at();
+    updated.error_details = job.get_error_details();
+    updated.state = "waiting";
+    updated.reserved_by = std::nullopt;
+    if (!append(update_record, update_payload(it->first, updated)))
+    {
+        return SaveResult::failed;
+    }
+    if (entry.state == "waiting" && !entry.reserved_by)
+    {
+        waiting[entry.queue] -= 1;
+    }
+    entry = std::move(updated);
+    make_waiting(it->first, entry);
+    if (!wait_for_sync(appended_bytes, lock))
+    {
+        return SaveResult::failed;
+    }
+    return SaveResult::saved;
+}
+
+size_t JournalQueue::release(const std::vector<const Job *> &jobs)
+{
+    std::lock_guard<std::mutex> lock{journal_mutex};
+    // Reservations are not journaled, releasing them only touches the index. Walking the jobs
+    // backwards keeps them in their claim order at the front of their queues
+    size_t released = 0;
+    for (auto job = jobs.rbegin(); job != jobs.rend(); ++job)
+    {
+        auto it = index.find((*job)->get_id());
+        if (it == index.end() || it->second.state != "waiting" || it->second.reserved_by != (*job)->get_reserved_by())
+        {
+            continue;
+        }
+        it->second.reserved_by = std::nullopt;
+        waiting[it->second.queue] += 1;
+        ready[it->second.queue].push_front(it->first);
+        released += 1;
+    }
+    return released;
+}
+
+size_t JournalQueue::renew(const std::string &worker_id, const std::vector<std::string> &job_ids)
+{
+    std::lock_guard<std::mutex> lock{journal_mutex};
+    // The earlier lease entry of a renewed job no longer matches and is dropped by claim
+    std::chrono::system_clock::time_point expires = std::chrono::system_clock::now() + lease_timeout;
+    size_t renewed = 0;
+    for (const std::string &id : job_ids)
+    {
+        auto it = index.find(id);
+        if (it == index.end() || it->second.state != "waiting" || it->second.reserved_by != worker_id)
+        {
+            continue;
+        }
+        it->second.lease_expires = expires;
+        leases.emplace_back(expires, id);
+        renewed += 1;
+    }
+    return renewed;
+}
+
+bool JournalQueue::sync()
+{
+    std::unique_lock<std::mutex> lock{journal_mutex};
+    // Appends are not waited for with JOURNAL_SYNC=0, the flusher still writes them in the background
+    flush_cv.notify_all();
+    synced_cv.wait(lock, [&]
+                   { return synced_bytes >= appended_bytes || stopping || failed; });
+    return synced_bytes >= appended_bytes;
+}
+
+size_t JournalQueue::depth(const std::string &queue)
+{
+    std::lock_guard<std::mutex> lock{journal_mutex};
+    auto it = waiting.find(queue);
+    return it == waiting.end() ? 0 : it->second;
+}
+
+std::optional<IdempotencyKey> JournalQueue::enqueue_once(const Job &job, const std::string &idempotency_key)
+{
+    std::unique_lock<std::mutex> lock{journal_mutex};
+    // A submission with the same key that is still waiting for its flush decides which job holds the key
+    synced_cv.wait(lock, [&]
+                   { return pending_keys.count(idempotency_key) == 0; });
+    auto existing = idempotency_keys.find(idempotency_key);
+    if (existing != idempotency_keys.end())
+    {
+        return IdempotencyKey{existing->second.job_id, existing->second.created_at};
+    }
+
+    // Both records are appended before the job is indexed. The key record follows the snapshot, so a
+    // key replayed after a crash always refers to a stored job
+    std::string id{job.get_id()};
+    json record = snapshot_payload(job);
+    std::optional<Location> snapshot = append(snapshot_record, record.dump());
+    if (!snapshot)
+    {
+        return std::nullopt;
+    }
+    KeyEntry entry{id, job.get_created_at(), Location{}};
+    std::optional<Location> key = append_key(idempotency_key, entry);
+    if (!key)
+    {
+        // The caller is told that the job was not enqueued, so it must not come back after a restart
+        discard(id);
+        return std::nullopt;
+    }
+
+    pending_keys.insert(idempotency_key);
+    unpublished[snapshot->segment] += 1;
+    unpublished[key->segment] += 1;
+    bool synced = wait_for_sync(appended_bytes, lock);
+    pending_keys.erase(idempotency_key);
+    unpublished[snapshot->segment] -= 1;
+    unpublished[key->segment] -= 1;
+    synced_cv.notify_all();
+    if (!synced)
+    {
+        return std::nullopt;
+    }
+
+    publish(id, record, *snapshot);
+    entry.record = *key;
+    live_bytes[key->segment] += key->size;
+    idempotency_keys.emplace(idempotency_key, entry);
+    return IdempotencyKey{id, entry.created_at};
+}
+
+size_t JournalQueue::expire_idempotency_keys(std::chrono::system_clock::time_point before)
+{
+    std::lock_guard<std::mutex> lock{journal_mutex};
+    size_t expired = 0;
+    for (auto it = idempotency_keys.begin(); it != idempotency_keys.end();)
+    {
+        if (it->second.created_at >= before)
+        {
+            ++it;
+            continue;
+        }
+        // The record becomes garbage and is dropped with its segment
+        live_bytes[it->second.record.segment] -= it->second.record.size;
+        it = idempotency_keys.erase(it);
+        expired += 1;
+    }
+    return expired;
+}
+
+std::unique_ptr<Job> JournalQueue::get_job(const std::string &id)
+{
+    // Finished jobs are dropped from the index, only the most recent ones are still known
+    std::lock_guard<std::mutex> lock{journal_mutex};
+    auto it = index.find(id);
+    if (it == index.end())
+    {
+        it = finished.find(id);
+        if (it == finished.end())
+        {
+            return nullptr;
+        }
+    }
+    return materialize(it->first, it->second);
+}
+
+std::vector<std::unique_ptr<Job>> JournalQueue::list_jobs(const JobQuery &query)
+{
+    std::vector<std::unique_ptr<Job>> jobs;
+    std::lock_guard<std::mutex> lock{journal_mutex};
+    std::vector<std::pair<std::chrono::system_clock::time_point, const std::pair<const std::string, Entry> *>> matches;
+    for (const std::unordered_map<std::string, Entry> *entries : {&index, &finished})
+    {
+        for (const auto &item : *entries)
+        {
+            if (entries == &finished && index.count(item.first) > 0)
+            {
+                continue; // Enqueued again under the same id
+            }
+            const Entry &entry = item.second;
+            std::string status{entry.state == "waiting" && entry.reserved_by ? "running" : entry.state};
+            if ((query.state && *query.state != status) || (query.queue && *query.queue != entry.queue))
+            {
+                continue;
+            }
+            matches.emplace_back(entry.created_at, &item);
+        }
+    }
+    if (query.offset >= matches.size())
+    {
+        return jobs;
+    }
+
+    // Only the requested page is sorted and materialized
+    size_t end = std::min(matches.size(), query.offset + query.limit);
+    auto newest_first = [](const auto &a, const auto &b)
+    {
+        return a.first != b.first ? a.first > b.first : a.second->first < b.second->first;
+    };
+    std::partial_sort(matches.begin(), matches.begin() + end, matches.end(), newest_first);
+    for (size_t i = query.offset; i < end; ++i)
+    {
+        jobs.push_back(materialize(matches[i].second->first, matches[i].second->second));
+    }
+    return jobs;
+}
@@ -1,145 +1,265 @@
 #include <iostream>
 #include <fstream>
-#include <sqlite3.h>
 #include <nlohmann/json.hpp>
 #include "../include/email_sender.h"
 #include "../include/worker.h"
+#include "../include/worker_pool.h"
 #include "../include/queueable.h"
+#include "../include/queue_backend.h"
+#include "../include/idempotency_cache.h"
+#include "../include/admission_controller.h"
+#include "../include/job_status_cache.h"
+#include "../include/trace.h"
+#include "../include/wakeup.h"
 #include <spdlog/spdlog.h>
+#include <algorithm>
 #include <chrono>
+#include <csignal>
 #include <thread>
 #include <crow.h>
 
 using json = nlohmann::json;
 
-bool createJobsTable(sqlite3 *db)
+int main(int argc, char *argv[])
 {
-    // Drop the existing table if it exists
-    const char *sql = "DROP TABLE IF EXISTS jobs";
-    sqlite3_stmt *stmt;
-    char *errMsg = nullptr;
-
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    // The process serves the API, runs the workers or both (the default). Several processes of each
+    // role can share one SQLite or Redis backend
+    std::string role{"all"};
+    if (const char *env_role = std::getenv("APP_ROLE"))
     {
-        spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return false;
+        role = env_role;
     }
-    if (sqlite3_step(stmt) != SQLITE_DONE)
+    if (argc > 1)
     {
-        spdlog::error("Failed to drop jobs table: {}", sqlite3_errmsg(db));
+        role = argv[1];
     }
-    else
+    if (role != "all" && role != "api" && role != "worker")
     {
-        spdlog::info("Job saved to database: {}");
+        spdlog::error("Unknown role {}, expected api, worker or all", role);
+        return 1;
     }
-    
-    // Create the new jobs table
-    sql= R"(
-        CREATE TABLE jobs (
-            id TEXT PRIMARY KEY,               -- Unique job ID (string)
-            name TEXT NOT NULL,                -- Job name
-            args TEXT NOT NULL,                -- JSON-encoded arguments
-            queue TEXT DEFAULT 'default',      -- Job queue
-            created_at DATETIME DEFAULT CURRENT_TIMESTAMP, -- Creation timestamp
-            next_execution_at DATETIME,        -- When to execute next (nullable)
-            last_executed_at DATETIME,         -- Last execution timestamp (nullable)
-            attempts INTEGER DEFAULT 0,        -- Number of retry attempts
-            state TEXT DEFAULT 'waiting',      -- Job state
-            error_details TEXT,                -- Error message if failed
-            reserved_by TEXT                   -- Worker ID processing this job
-        )
-    )";
+    const bool serve_api = role != "worker";
+    const bool run_workers = role != "api";
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    // Without Crow, a worker process waits for SIGINT and SIGTERM itself. They are blocked before any
+    // thread is started, so that all threads inherit the mask and sigwait receives them
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    if (!serve_api)
     {
-        spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return false;
+        pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
     }
-    if (sqlite3_step(stmt) != SQLITE_DONE)
+
+    // Record the lifecycle of every job in a Chrome trace if TRACE_FILE is set
+    if (const char *trace_path = std::getenv("TRACE_FILE"))
     {
-        spdlog::error("Failed to create jobs table: {}", sqlite3_errmsg(db));
+        trace_open(trace_path);
     }
-    else
+
+    // Open the queue backend selected by the QUEUE_BACKEND environment variable (SQLite by default)
+    QueueBackendConfig config = queue_backend_config_from_env();
+    if (role != "all" && config.reset)
     {
-        spdlog::info("Table 'jobs' created successfully!");
+        // The other api and worker processes keep using the shared store, so only a single process
+        // running both roles may start from an empty queue
+        spdlog::error("QUEUE_RESET would drop the jobs of the other processes, it is only allowed with the role all");
+        return 1;
     }
-    return true;
-}
-
-int main()
-{
-    // Open an SQLite database (or create it if it doesn't exist)
-    sqlite3 *db;
-
-    if (sqlite3_open("database.db", &db) != SQLITE_OK)
+    if (role != "all" && config.type == "journal")
     {
-        spdlog::error("Failed to open database.");
+        spdlog::error("The journal backend is kept by a single process, run it with the role all");
         return 1;
     }
-    else
-    {// Create the jobs table
-        if (createJobsTable(db)==false){
-        return 1;}
+    std::shared_ptr<QueueBackend> backend = create_queue_backend(config);
+    if (!backend)
+    {
+        spdlog::error("Failed to open queue backend.");
+        return 1;
     }
+    set_default_queue_backend(backend);
 
-    json credentials;
+    // Initialize libcurl once, before any worker thread uses it
+    curl_global_init(CURL_GLOBAL_DEFAULT);
 
     const char *smtp_user = std::getenv("SMTP_USER");
     const char *smtp_password = std::getenv("SMTP_PW");
     const char *smtp_server = std::getenv("SMTP_SERVER");
+    const char *smtp_tls = std::getenv("SMTP_TLS");
+
+    // Email templates are registered once at startup and shared read-only with the workers
+    TemplateStore templates;
+    if (const char *template_dir = std::getenv("EMAIL_TEMPLATE_DIR"))
+    {
+        spdlog::info("Registered {} email templates from {}", templates.load_directory(template_dir), template_dir);
+    }
+
+    // Settings handed to the job handlers of every worker
+    JobContext context;
+    context.set(SmtpCredentials{smtp_server ? smtp_server : "",
+                                smtp_user ? smtp_user : "",
+                                smtp_password ? smtp_password : "",
+                                !(smtp_tls && std::string{smtp_tls} == "0")});
+    context.set(templates);
+
+    // Attachments are referenced by jobs and streamed from this directory at send time
+    std::shared_ptr<AttachmentStore> attachments;
+    if (const char *attachment_dir = std::getenv("ATTACHMENT_DIR"))
+    {
+        attachments = std::make_shared<AttachmentStore>(attachment_dir);
+        context.set(attachments);
+    }
 
-    credentials["smtp_user"] = smtp_user;
-    credentials["smtp_password"] = smtp_password;
-    credentials["smtp_server"] = smtp_server;
+    // Recently used idempotency keys, so that retried submissions are answered without asking the backend
+    IdempotencyCache idempotency{100000, config.idempotency_window};
+
+    // Bounds the work accepted from clients, see AdmissionConfig for the limits
+    AdmissionController admission{*backend, admission_config_from_env(), config.queues};
+    if (serve_api)
+    {
+        admission.start();
+    }
+
+    // Recent job states, kept up to date by the workers and read by the job status endpoints
+    JobStatusCache status_cache;
+
+    // Processes serving the API wake the idle workers of all processes after every enqueue
+    std::string wakeup_dir{"wakeup"};
+    if (const char *dir = std::getenv("WAKEUP_DIR"))
+    {
+        wakeup_dir = dir;
+    }
+    WakeupNotifier wakeup{wakeup_dir};
 
     // Crow web app
     crow::SimpleApp app;
 
-    CROW_ROUTE(app, "/submit_email").methods("POST"_method)([](const crow::request &req)
+    CROW_ROUTE(app, "/submit_email").methods("POST"_method)([&idempotency, &admission, &templates, &attachments, &wakeup](const crow::request &req)
                                                             {
-        // Parse the JSON body of the POST request
-        auto json_data = json::parse(req.body);
+        auto reject = [](int code, const std::string &message, std::chrono::seconds retry_after)
+        {
+            crow::response res(code, message);
+            res.set_header("Retry-After", std::to_string(retry_after.count()));
+            return res;
+        };
 
-        std::string recipient = json_data["recipient"];
-        std::string subject = json_data["subject"];
-        std::string body = json_data["body"];
+        // Cheap checks first, so that rejected requests cost as little as possible
+        if (std::optional<std::chrono::seconds> wait = admission.throttle(req.remote_ip_address))
+        {
+            return reject(429, "Too many requests", *wait);
+        }
+        if (req.body.size() > admission.get_config().max_body_size)
+        {
+            return crow::response(413, "Request body too large");
+        }
 
-        if(recipient.empty())
+        // Parse the JSON body of the POST request
+        json json_data = json::parse(req.body, nullptr, false);
+        if (json_data.is_discarded())
+        {
+            return crow::response(400, "Invalid JSON");
+        }
+        if (const char *error = EmailPayload::validate(json_data, &templates))
         {
-            spdlog::error("Missing recipient");
-            return crow::response(400, "Missing recipient");
+            spdlog::error("{}", error);
+            return crow::response(400, error);
         }
-        
-        if(subject.empty())
+        if (!attachments && json_data.contains("attachments"))
         {
-            spdlog::error("Missing subject");
-            return crow::response(400, "Missing subject");
+            return crow::response(400, "Attachments are not enabled");
         }
 
-        if(body.empty())
+        // Clients may retry a submission with the same Idempotency-Key header without sending the email twice
+        std::optional<std::string> idempotency_key;
+        std::string key_header = req.get_header_value("Idempotency-Key");
+        if (!key_header.empty())
         {
-            spdlog::error("Missing body");
-            return crow::response(400, "Missing body");
+            idempotency_key = key_header;
+            if (std::optional<std::string> existing = idempotency.find(key_header))
+            {
+                return crow::response(200, json{{"job_id", *existing}}.dump());
+            }
+        }
+
+        // Shed load while the queue is full or too many enqueues are already waiting for the backend
+        std::optional<AdmissionController::Slot> slot = admission.acquire();
+        if (!slot)
+        {
+            return reject(503, "Queue is at capacity", admission.get_config().overload_retry_after);
         }
 
         SendEmail q;
-        q.dispatch(json_data);
+        std::chrono::system_clock::time_point key_taken_at;
+        std::optional<std::string> job_id = q.dispatch(json_data, idempotency_key, &key_taken_at);
+        if (!job_id)
+        {
+            return crow::response(500, "Failed to enqueue email task");
+        }
+        wakeup.notify();
+        if (idempotency_key)
+        {
+            idempotency.remember(*idempotency_key, *job_id, key_taken_at);
+        }
         // Send a response
-        return crow::response(200, "Email task submitted successfully"); });
-
-    // Register the Queueable (sub)classes
-    QueueableRegistry registry;
-    //    QueueableFactory factory = []()
-    //   { return std::make_unique<Queueable>(); };
-    //    registry.registerQueueable("Queueable", factory);
-
-    //    QueueableFactory logfactory = []()
-    //    { return std::make_unique<LogQueueable>(); };
-    //    registry.registerQueueable("LogQueueable", logfactory);
-    QueueableFactory emailfactory = []() { return std::make_unique<SendEmail>() ; };
-    registry.registerQueueable("SendEmail", emailfactory);
+        return crow::response(200, json{{"job_id", *job_id}}.dump()); });
+
+    CROW_ROUTE(app, "/jobs/<string>").methods("GET"_method)([&admission, &status_cache, &backend](const crow::request &req, const std::string &id)
+                                                             {
+        if (std::optional<std::chrono::seconds> wait = admission.throttle(req.remote_ip_address))
+        {
+            crow::response res(429, "Too many requests");
+            res.set_header("Retry-After", std::to_string(wait->count()));
+            return res;
+        }
+        std::optional<json> status = status_cache.get(id, *backend);
+        if (!status)
+        {
+            return crow::response(404, "Job not found");
+        }
+        return crow::response(200, status->dump()); });
+
+    CROW_ROUTE(app, "/jobs").methods("GET"_method)([&admission, &backend](const crow::request &req)
+                                                   {
+        if (std::optional<std::chrono::seconds> wait = admission.throttle(req.remote_ip_address))
+        {
+            crow::response res(429, "Too many requests");
+            res.set_header("Retry-After", std::to_string(wait->count()));
+            return res;
+        }
+
+        JobQuery query;
+        if (const char *state = req.url_params.get("state"))
+        {
+            query.state = state;
+        }
+        if (const char *queue = req.url_params.get("queue"))
+        {
+            query.queue = queue;
+        }
+        if (const char *limit = req.url_params.get("limit"))
+        {
+            query.limit = static_cast<size_t>(std::clamp(std::atoi(limit), 1, 200));
+        }
+        if (const char *offset = req.url_params.get("offset"))
+        {
+            query.offset = static_cast<size_t>(std::max(std::atoi(offset), 0));
+        }
+
+        json jobs = json::array();
+        for (const std::unique_ptr<Job> &job : backend->list_jobs(query))
+        {
+            jobs.push_back(JobStatusCache::describe(*job));
+        }
+        json page{{"jobs", jobs}, {"limit", query.limit}, {"offset", query.offset}};
+        if (jobs.size() == query.limit)
+        {
+            page["next_offset"] = query.offset + query.limit;
+        }
+        return crow::response(200, page.dump()); });
+
+    // Register the Queueable (sub)classes. Add LogQueueable to experiment with failing jobs.
+    QueueableRegistry<SendEmail> registry;
     // sleep(30);
 
     /* json args = {{"name", "some_name"}, {"task", "email"}, {"recipient", "user@example.com"}};
@@ -155,21 +275,79 @@ int main()
     //q.dispatch(args);
     //q.dispatch(args); */
 
-    Worker w1(registry, credentials);
-    Worker w2(registry, credentials);
+    // Workers are added and retired with the backlog, see WorkerPoolConfig for the bounds
+    std::unique_ptr<WorkerPool> pool;
+    std::unique_ptr<WakeupListener> listener;
+    if (run_workers)
+    {
+        // Leases are renewed well before they expire, so that only workers that are gone lose their jobs
+        WorkerPoolConfig pool_config = worker_pool_config_from_env();
+        pool_config.lease_renewal = std::chrono::duration_cast<std::chrono::milliseconds>(config.lease_timeout) / 3;
+        pool = std::make_unique<WorkerPool>(registry, *backend, context, serve_api ? &status_cache : nullptr,
+                                            pool_config, config.queues);
+        pool->start();
+        listener = std::make_unique<WakeupListener>(wakeup_dir, [&pool]
+                                                    { pool->wake(); });
+        if (!listener->start())
+        {
+            spdlog::warn("Workers will only find new jobs by polling");
+        }
+    }
 
-    std::thread workerThread1(&Worker::run, &w1);
-    std::thread workerThread2(&Worker::run, &w2);
+    // Release expired idempotency keys once a minute
+    std::thread janitorThread;
+    if (serve_api)
+    {
+        janitorThread = std::thread([&]
+                                  {
+            while (!stopWorkers)
+            {
+                for (int i = 0; i < 60 && !stopWorkers; ++i)
+                {
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                }
+                size_t expired = backend->expire_idempotency_keys(std::chrono::system_clock::now() - config.idempotency_window);
+                if (expired > 0)
+                {
+                    spdlog::info("Released {} expired idempotency keys", expired);
+                }
+                idempotency.expire();
+            } });
+    }
 
-    app.port(8080).multithreaded().run();
-    // The app will run until stopped
+    if (serve_api)
+    {
+        app.port(8080).multithreaded().run();
+        // The app will run until stopped
+    }
+    else
+    {
+        int signal = 0;
+        sigwait(&stop_signals, &signal);
+    }
     spdlog::info("Stopping application...");
     // Set stopWorkers flag to true so that workers will exit the loop in the run() method
     stopWorkers = true;
 
-    workerThread1.join();
-    workerThread2.join();
+    admission.stop();
+    if (listener)
+    {
+        listener->stop();
+    }
+    if (pool)
+    {
+        // Waits at most SHUTDOWN_TIMEOUT_MS for the batches being sent, unsent jobs go back to the queue
+        pool->stop();
+    }
+    // Make the final state updates durable before the backend is closed
+    backend->sync();
+    trace_close();
+    if (janitorThread.joinable())
+    {
+        janitorThread.join();
+    }
 
+    curl_global_cleanup();
     spdlog::info("Application exited cleanly");
     return 0;
 }
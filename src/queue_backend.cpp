@@ -0,0 +1,106 @@
+#include "../include/queue_backend.h"
+#include "../include/sqlite_queue.h"
+#include "../include/journal_queue.h"
+#ifdef WITH_REDIS
+#include "../include/redis_queue.h"
+#endif
+#include <algorithm>
+#include <cstdlib>
+#include <spdlog/spdlog.h>
+
+namespace
+{
+std::shared_ptr<QueueBackend> default_backend;
+}
+
+QueueBackendConfig queue_backend_config_from_env()
+{
+    QueueBackendConfig config;
+    if (const char *type = std::getenv("QUEUE_BACKEND"))
+    {
+        config.type = type;
+    }
+    if (const char *reset = std::getenv("QUEUE_RESET"))
+    {
+        config.reset = std::string(reset) == "1";
+    }
+    if (const char *path = std::getenv("SQLITE_PATH"))
+    {
+        config.sqlite_path = path;
+    }
+    if (const char *host = std::getenv("REDIS_HOST"))
+    {
+        config.redis_host = host;
+    }
+    if (const char *port = std::getenv("REDIS_PORT"))
+    {
+        config.redis_port = std::atoi(port);
+    }
+    if (const char *path = std::getenv("JOURNAL_DIR"))
+    {
+        config.journal_path = path;
+    }
+    if (const char *sync = std::getenv("JOURNAL_SYNC"))
+    {
+        config.journal_sync = std::string(sync) != "0";
+    }
+    if (const char *window = std::getenv("IDEMPOTENCY_WINDOW"))
+    {
+        config.idempotency_window = std::chrono::seconds(std::atoll(window));
+    }
+    if (const char *lease = std::getenv("LEASE_TIMEOUT"))
+    {
+        config.lease_timeout = std::chrono::seconds(std::max(std::atoll(lease), 1LL));
+    }
+    return config;
+}
+
+std::shared_ptr<QueueBackend> create_queue_backend(const QueueBackendConfig &config)
+{
+    if (config.type == "sqlite")
+    {
+        std::shared_ptr<SqliteQueue> backend{new SqliteQueue{config.sqlite_path, config.queues, config.lease_timeout}};
+        if (!backend->open() || !backend->create_tables(config.reset))
+        {
+            return nullptr;
+        }
+        spdlog::info("Using SQLite queue backend at {}", config.sqlite_path);
+        return backend;
+    }
+    if (config.type == "journal")
+    {
+        std::shared_ptr<JournalQueue> backend{new JournalQueue{config.journal_path, config.journal_segment_size, config.journal_sync, config.queues,
+                                                                 config.lease_timeout}};
+        if (!backend->open(config.reset))
+        {
+            return nullptr;
+        }
+        spdlog::info("Using journal queue backend at {}", config.journal_path);
+        return backend;
+    }
+#ifdef WITH_REDIS
+    if (config.type == "redis")
+    {
+        std::shared_ptr<RedisQueue> backend{new RedisQueue{config.redis_host, config.redis_port, config.queues, config.idempotency_window,
+                                                             config.lease_timeout}};
+        if (!backend->connect() || (config.reset && !backend->flush()))
+        {
+            return nullptr;
+        }
+        spdlog::info("Using Redis queue backend at {}:{}", config.redis_host, config.redis_port);
+        return backend;
+    }
+#endif
+    spdlog::error("Unknown or unsupported queue backend: {}", config.type);
+    return nullptr;
+}
+
+void set_default_queue_backend(std::shared_ptr<QueueBackend> backend)
+{
+    default_backend = std::move(backend);
+}
+
+QueueBackend *default_queue_backend()
+{
+    return default_backend.get();
+}
@@ -1,37 +1,82 @@
 #include "../include/queueable.h"
+#include "../include/queue_backend.h"
+#include "../include/trace.h"
 
 // Queueable class
 Queueable::Queueable(/* args */)
 {
 }
 // TODO: I think dispatch needs to have the name as variable as well
-void Queueable::dispatch(const json &args, const std::string &name){
+std::optional<std::string> Queueable::dispatch(const json &args,
+                                              const std::string &name,
+                                              int type_id_,
+                                              const std::optional<std::string> &idempotency_key,
+                                              std::chrono::system_clock::time_point *key_taken_at)
+{
     Job job{args, name};
-    job.save();
-    spdlog::info("Enqueued job id={}, args = {}, name = {}", job.get_id(), job.get_args().dump(),name);
+    job.set_type_id(type_id_);
+    TraceSpan span{"dispatch", "api", &job.get_id()};
+    if (!idempotency_key)
+    {
+        if (!job.save())
+        {
+            return std::nullopt;
+        }
+        spdlog::info("Enqueued job id={}, name = {}", job.get_id(), name);
+        return job.get_id();
+    }
+
+    QueueBackend *backend = default_queue_backend();
+    if (backend == nullptr)
+    {
+        spdlog::error("No queue backend configured. Cannot save job with job id = {}", job.get_id());
+        return std::nullopt;
+    }
+    std::optional<IdempotencyKey> holder = backend->enqueue_once(job, *idempotency_key);
+    if (!holder)
+    {
+        return std::nullopt;
+    }
+    if (holder->job_id != job.get_id())
+    {
+        spdlog::info("Idempotency key {} already used by job id={}", *idempotency_key, holder->job_id);
+    }
+    else
+    {
+        spdlog::info("Enqueued job id={}, name = {}", job.get_id(), name);
+    }
+    if (key_taken_at)
+    {
+        *key_taken_at = holder->taken_at;
+    }
+    return holder->job_id;
 }
 
-void Queueable::handle(const json &args, std::optional<json> credentials)
+void Queueable::configure(const JobContext &)
 {
 }
 
-// QueueableRegistry class
-QueueableRegistry::QueueableRegistry(/* args */)
+void Queueable::handle(const json &)
 {
 }
 
-QueueableRegistry::~QueueableRegistry()
+void Queueable::handle_batch(const std::vector<const json *> &batch, std::vector<std::exception_ptr> &errors)
 {
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        try
+        {
+            handle(*batch[i]);
+        }
+        catch (...)
+        {
+            errors[i] = std::current_exception();
+        }
+    }
 }
-// Register a new class in the registry
-void QueueableRegistry::registerQueueable(const std::string &name, QueueableFactory factory)
+
+void Queueable::cancel()
 {
-    registry[name] = factory;
-}
-// Factory method. Make sure the class of the to be created object is registered first!
-std::unique_ptr<Queueable> QueueableRegistry::createQueueable(const std::string &name) const
-{    
-    return registry.at(name)();
 }
 
 // LogQueueable class
@@ -48,12 +93,12 @@ LogQueueable::~LogQueueable()
 {
 }
 
-void LogQueueable::dispatch(const json &args)
+std::optional<std::string> LogQueueable::dispatch(const json &args)
 {
-    Queueable::dispatch(args, "LogQueueable");
+    return Queueable::dispatch(args, job_name, type_id);
 }
 
-void LogQueueable::handle(const json& args, std::optional<json> credentials)
+void LogQueueable::handle(const json& args)
 {
     sleep(2);
     float r = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
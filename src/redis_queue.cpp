@@ -0,0 +1,1005 @@
+#include "../include/redis_queue.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <map>
+#include <spdlog/spdlog.h>
+#include <unordered_map>
+
+namespace
+{
+// All keys share the hash tag {etq}, so that they live in one hash slot. The scripts derive the keys of
+// jobs, queues and processing lists from ids they only learn while running, which Redis Cluster only
+// allows within the slot of the declared keys. The backend therefore needs a single Redis node or
+// the one cluster node serving that slot
+const std::string job_prefix = "{etq}:job:";
+const std::string queue_prefix = "{etq}:queue:";
+const std::string processing_prefix = "{etq}:processing:";
+const std::string scheduled_prefix = "{etq}:scheduled:";      // Delayed jobs of a queue by due time
+const std::string leases_key = "{etq}:leases";
+const std::string idempotency_prefix = "{etq}:idempotency:";
+// Idle connections kept open beyond this number are closed when they are returned, e.g. after a burst
+// of HTTP requests
+const size_t max_idle_connections = 16;
+
+// Moves the delayed jobs of the queues ARGV[5..] that are due at ARGV[1] to their queue and jobs whose
+// lease in the sorted set KEYS[2] expired before ARGV[1] back from their worker's processing list. Then
+// pops up to ARGV[2] job ids from the queues ARGV[5..] (highest priority first) onto the processing list
+// KEYS[1] of worker ARGV[4], reserves them for it and leases them until ARGV[3]. A job is never on a
+// processing list without being reserved, so that its lease can always be expired
+const char *claim_script = R"(
+for i = 5, #ARGV do
+    local scheduled = '{etq}:scheduled:' .. ARGV[i]
+    local due = redis.call('ZRANGEBYSCORE', scheduled, '-inf', ARGV[1], 'LIMIT', 0, 1000)
+    for _, id in ipairs(due) do
+        redis.call('ZREM', scheduled, id)
+        redis.call('LPUSH', '{etq}:queue:' .. ARGV[i], id)
+    end
+end
+local expired = redis.call('ZRANGEBYSCORE', KEYS[2], '-inf', '(' .. ARGV[1], 'LIMIT', 0, 1000)
+for _, id in ipairs(expired) do
+    redis.call('ZREM', KEYS[2], id)
+    local worker = redis.call('HGET', '{etq}:job:' .. id, 'reserved_by')
+    if worker and worker ~= '' and redis.call('LREM', '{etq}:processing:' .. worker, 1, id) > 0 then
+        redis.call('HSET', '{etq}:job:' .. id, 'reserved_by', '')
+        local queue = redis.call('HGET', '{etq}:job:' .. id, 'queue')
+        if not queue then queue = 'default' end
+        redis.call('RPUSH', '{etq}:queue:' .. queue, id)
+    end
+end
+local claimed = {}
+local max_jobs = tonumber(ARGV[2])
+for i = 5, #ARGV do
+    while #claimed < max_jobs do
+        local id = redis.call('RPOPLPUSH', '{etq}:queue:' .. ARGV[i], KEYS[1])
+        if not id then break end
+        redis.call('HSET', '{etq}:job:' .. id, 'reserved_by', ARGV[4])
+        redis.call('ZADD', KEYS[2], ARGV[3], id)
+        table.insert(claimed, id)
+    end
+end
+return claimed
+)";
+
+// Removes job ARGV[1] from the processing list of the worker that reserved it and ends its lease in the
+// sorted set KEYS[2], writes the field/value pairs ARGV[4..] to its hash KEYS[1] and, if ARGV[2] is not
+// empty, delays the job until that timestamp in the sorted set of its queue. A delayed job is also taken
+// out of its queue list, in case it was waiting there unclaimed. If ARGV[3] is not empty, the job must still be reserved by that worker. Returns 0 without
+// writing anything if it is not, e.g. because its lease expired and another worker claimed it
+const char *update_script = R"(
+local worker = redis.call('HGET', KEYS[1], 'reserved_by')
+if ARGV[3] ~= '' and worker ~= ARGV[3] then
+    return 0
+end
+if worker and worker ~= '' then
+    redis.call('LREM', '{etq}:processing:' .. worker, 1, ARGV[1])
+end
+redis.call('ZREM', KEYS[2], ARGV[1])
+redis.call('HSET', KEYS[1], unpack(ARGV, 4))
+if ARGV[2] ~= '' then
+    local queue = redis.call('HGET', KEYS[1], 'queue')
+    if not queue then queue = 'default' end
+    redis.call('LREM', '{etq}:queue:' .. queue, 1, ARGV[1])
+    redis.call('ZADD', '{etq}:scheduled:' .. queue, ARGV[2], ARGV[1])
+end
+return 1
+)";
+
+// Moves the jobs ARGV[1..] with the queues ARGV[n+1..] (n = #ARGV / 2) from the processing list
+// KEYS[1] back to the end of their queue lists, where they are claimed next, and ends their leases in
+// the sorted set KEYS[2]. Returns their number
+const char *release_script = R"(
+local count = #ARGV / 2
+local released = 0
+for i = 1, count do
+    if redis.call('LREM', KEYS[1], 1, ARGV[i]) > 0 then
+        redis.call('ZREM', KEYS[2], ARGV[i])
+        redis.call('HSET', '{etq}:job:' .. ARGV[i], 'reserved_by', '')
+        redis.call('RPUSH', '{etq}:queue:' .. ARGV[count + i], ARGV[i])
+        released = released + 1
+    end
+end
+return released
+)";
+
+// Moves the leases in KEYS[1] of the jobs ARGV[3..] that are still reserved by worker ARGV[1] to
+// expire at ARGV[2]. Returns their number
+const char *renew_script = R"(
+local renewed = 0
+for i = 3, #ARGV do
+    if redis.call('HGET', '{etq}:job:' .. ARGV[i], 'reserved_by') == ARGV[1] and redis.call('ZSCORE', KEYS[1], ARGV[i]) then
+        redis.call('ZADD', KEYS[1], ARGV[2], ARGV[i])
+        renewed = renewed + 1
+    end
+end
+return renewed
+)";
+
+// Takes the idempotency key KEYS[1] for job ARGV[1] for ARGV[2] seconds. Only if the key was free, the
+// field/value pairs ARGV[4..] are written to the job hash KEYS[2] and the job is delayed until ARGV[3]
+// in the sorted set KEYS[3] of its queue or, if ARGV[3] is empty, pushed onto its queue list KEYS[3]. Returns
+// {1, ARGV[1], ARGV[2]} for a new job and {0, id of the holding job, remaining TTL} if the key was
+// taken, so a key never refers to a job that does not exist
+const char *enqueue_once_script = R"(
+if redis.call('SET', KEYS[1], ARGV[1], 'NX', 'EX', ARGV[2]) then
+    redis.call('HSET', KEYS[2], unpack(ARGV, 4))
+    if ARGV[3] ~= '' then
+        redis.call('ZADD', KEYS[3], ARGV[3], ARGV[1])
+    else
+        redis.call('LPUSH', KEYS[3], ARGV[1])
+    end
+    return {1, ARGV[1], tonumber(ARGV[2])}
+end
+return {0, redis.call('GET', KEYS[1]), redis.call('TTL', KEYS[1])}
+)";
+
+std::string to_epoch(std::chrono::system_clock::time_point tp)
+{
+    return std::to_string(std::chrono::duration_cast<std::chrono::seconds>(tp.time_since_epoch()).count());
+}
+
+std::string to_epoch(const std::optional<std::chrono::system_clock::time_point> &tp)
+{
+    return tp ? to_epoch(*tp) : "";
+}
+
+// Parse a decimal integer. Returns false unless the whole value is a number
+template <typename T>
+bool parse_number(const std::string &value, T &number)
+{
+    const char *end = value.data() + value.size();
+    std::from_chars_result result = std::from_chars(value.data(), end, number);
+    return result.ec == std::errc{} && result.ptr == end;
+}
+
+// Parse a timestamp written by to_epoch. Returns false if the value is not empty and not a number
+bool from_epoch(const std::string &value, std::optional<std::chrono::system_clock::time_point> &tp)
+{
+    tp = std::nullopt;
+    if (value.empty())
+    {
+        return true;
+    }
+    long long seconds;
+    if (!parse_number(value, seconds))
+    {
+        return false;
+    }
+    tp = std::chrono::system_clock::time_point{std::chrono::seconds{seconds}};
+    return true;
+}
+
+// Hash fields describing the full state of a job
+std::vector<std::string> job_fields(const Job &job)
+{
+    return {"name", job.get_name(),
+            "type_id", std::to_string(job.get_type_id()),
+            "args", job.get_args().dump(),
+            "queue", job.get_queue(),
+            "created_at", to_epoch(job.get_created_at()),
+            "next_execution_at", to_epoch(job.get_next_execution_at()),
+            "last_executed_at", to_epoch(job.get_last_executed_at()),
+            "attempts", std::to_string(job.get_attempts()),
+            "state", job.get_state(),
+            "error_details", job.get_error_details().value_or(""),
+            "reserved_by", job.get_reserved_by().value_or("")};
+}
+
+// Hash fields of the columns changed since the job was claimed
+std::vector<std::string> changed_fields(const Job &job)
+{
+    std::vector<std::string> fields;
+    if (job.is_dirty(Job::field_type_id))
+    {
+        fields.insert(fields.end(), {"type_id", std::to_string(job.get_type_id())});
+    }
+    if (job.is_dirty(Job::field_queue))
+    {
+        fields.insert(fields.end(), {"queue", job.get_queue()});
+    }
+    if (job.is_dirty(Job::field_attempts))
+    {
+        fields.insert(fields.end(), {"attempts", std::to_string(job.get_attempts())});
+    }
+    if (job.is_dirty(Job::field_created_at))
+    {
+        fields.insert(fields.end(), {"created_at", to_epoch(job.get_created_at())});
+    }
+    if (job.is_dirty(Job::field_next_execution_at))
+    {
+        fields.insert(fields.end(), {"next_execution_at", to_epoch(job.get_next_execution_at())});
+    }
+    if (job.is_dirty(Job::field_last_executed_at))
+    {
+        fields.insert(fields.end(), {"last_executed_at", to_epoch(job.get_last_executed_at())});
+    }
+    if (job.is_dirty(Job::field_state))
+    {
+        fields.insert(fields.end(), {"state", job.get_state()});
+    }
+    if (job.is_dirty(Job::field_error_details))
+    {
+        fields.insert(fields.end(), {"error_details", job.get_error_details().value_or("")});
+    }
+    if (job.is_dirty(Job::field_reserved_by))
+    {
+        fields.insert(fields.end(), {"reserved_by", job.get_reserved_by().value_or("")});
+    }
+    return fields;
+}
+
+// Rebuild a job from the reply to HGETALL. Returns nullptr if the job is not stored, or if its hash
+// cannot be read, in which case corrupt is set
+std::unique_ptr<Job> job_from_hash(const std::string &id, const redisReply *reply, bool *corrupt = nullptr)
+{
+    if (reply == nullptr || reply->type != REDIS_REPLY_ARRAY || reply->elements == 0)
+    {
+        return nullptr;
+    }
+    auto reject = [&]() -> std::unique_ptr<Job>
+    {
+        spdlog::error("Job {} has corrupt data in Redis", id);
+        if (corrupt)
+        {
+            *corrupt = true;
+        }
+        return nullptr;
+    };
+
+    std::unordered_map<std::string, std::string> hash;
+    for (size_t i = 0; i + 1 < reply->elements; i += 2)
+    {
+        const redisReply *field = reply->element[i];
+        const redisReply *value = reply->element[i + 1];
+        if (field->type != REDIS_REPLY_STRING || value->type != REDIS_REPLY_STRING)
+        {
+            return reject();
+        }
+        hash[std::string(field->str, field->len)] = std::string(value->str, value->len);
+    }
+
+    auto optional_string = [](const std::string &value) -> std::optional<std::string>
+    {
+        if (value.empty())
+        {
+            return std::nullopt;
+        }
+        return value;
+    };
+
+    // A half-written or foreign hash must not throw, it would take down the worker that claimed it
+    json args = json::parse(hash["args"], nullptr, false);
+    int attempts = 0;
+    int type_id = 0;
+    std::optional<std::chrono::system_clock::time_point> next_execution_at, last_executed_at, created_at;
+    if (args.is_discarded() ||
+        (!hash["attempts"].empty() && !parse_number(hash["attempts"], attempts)) ||
+        (!hash["type_id"].empty() && !parse_number(hash["type_id"], type_id)) ||
+        !from_epoch(hash["next_execution_at"], next_execution_at) ||
+        !from_epoch(hash["last_executed_at"], last_executed_at) ||
+        !from_epoch(hash["created_at"], created_at))
+    {
+        return reject();
+    }
+
+    std::unique_ptr<Job> job{new Job{id,
+                                     std::move(args),
+                                     hash["name"],
+                                     hash["queue"].empty() ? "default" : hash["queue"],
+                                     attempts,
+                                     next_execution_at,
+                                     last_executed_at,
+                                     hash["state"],
+                                     optional_string(hash["error_details"]),
+                                     optional_string(hash["reserved_by"])}};
+    job->set_type_id(type_id);
+    if (created_at)
+    {
+        job->set_created_at(*created_at);
+    }
+    job->clear_dirty();
+    return job;
+}
+
+void append_argv(redisContext *ctx, const std::vector<std::string> &args)
+{
+    std::vector<const char *> argv;
+    std::vector<size_t> argvlen;
+    argv.reserve(args.size());
+    argvlen.reserve(args.size());
+    for (const std::string &arg : args)
+    {
+        argv.push_back(arg.data());
+        argvlen.push_back(arg.size());
+    }
+    redisAppendCommandArgv(ctx, static_cast<int>(args.size()), argv.data(), argvlen.data());
+}
+
+// Read the next pipelined reply. Returns false if the connection failed or Redis returned an error
+bool read_reply(redisContext *ctx, redisReply **reply)
+{
+    void *r = nullptr;
+    if (redisGetReply(ctx, &r) != REDIS_OK || r == nullptr)
+    {
+        spdlog::error("Redis connection error: {}", ctx->errstr);
+        *reply = nullptr;
+        return false;
+    }
+    *reply = static_cast<redisReply *>(r);
+    if ((*reply)->type == REDIS_REPLY_ERROR)
+    {
+        spdlog::error("Redis error: {}", (*reply)->str);
+        return false;
+    }
+    return true;
+}
+
+// Run a script loaded on connect with the given key count, keys and arguments. A server that restarted
+// or flushed its script cache answers NOSCRIPT, in which case the script is sent once more in full,
+// which also caches it again
+bool eval(redisContext *ctx, const char *script, const std::string &sha, const std::vector<std::string> &args, redisReply **reply)
+{
+    std::vector<std::string> command{"EVALSHA", sha};
+    command.insert(command.end(), args.begin(), args.end());
+    append_argv(ctx, command);
+    void *r = nullptr;
+    if (redisGetReply(ctx, &r) != REDIS_OK || r == nullptr)
+    {
+        spdlog::error("Redis connection error: {}", ctx->errstr);
+        *reply = nullptr;
+        return false;
+    }
+    *reply = static_cast<redisReply *>(r);
+    if ((*reply)->type == REDIS_REPLY_ERROR && std::strncmp((*reply)->str, "NOSCRIPT", 8) == 0)
+    {
+        freeReplyObject(*reply);
+        spdlog::warn("Redis lost the queue scripts, sending them again");
+        command[0] = "EVAL";
+        command[1] = script;
+        append_argv(ctx, command);
+        return read_reply(ctx, reply);
+    }
+    if ((*reply)->type == REDIS_REPLY_ERROR)
+    {
+        spdlog::error("Redis error: {}", (*reply)->str);
+        return false;
+    }
+    return true;
+}
+}
+
+// Connection
+RedisQueue::Connection::Connection(RedisQueue *queue_) : queue{queue_}, ctx{nullptr}
+{
+    {
+        std::lock_guard<std::mutex> lock{queue->pool_mutex};
+        if (!queue->idle.empty())
+        {
+            ctx = queue->idle.back();
+            queue->idle.pop_back();
+        }
+    }
+    if (ctx == nullptr)
+    {
+        ctx = queue->open_connection();
+    }
+}
+
+RedisQueue::Connection::~Connection()
+{
+    if (ctx == nullptr)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock{queue->pool_mutex};
+    // hiredis keeps an I/O or protocol error for good, so such a connection is never used again. The
+    // idle ones most likely lost the server as well, e.g. when it restarted, so they are closed too
+    if (ctx->err)
+    {
+        spdlog::warn("Closing {} Redis connections after error: {}", queue->idle.size() + 1, ctx->errstr);
+        redisFree(ctx);
+        for (redisContext *other : queue->idle)
+        {
+            redisFree(other);
+        }
+        queue->idle.clear();
+        return;
+    }
+    if (queue->idle.size() < max_idle_connections)
+    {
+        queue->idle.push_back(ctx);
+    }
+    else
+    {
+        redisFree(ctx);
+    }
+}
+
+redisContext *RedisQueue::Connection::get() const
+{
+    return ctx;
+}
+
+// RedisQueue
+
+RedisQueue::RedisQueue(const std::string &host_,
+                       int port_,
+                       const std::vector<std::string> &queues_,
+                       std::chrono::seconds idempotency_window_,
+                       std::chrono::seconds lease_timeout_) : host{host_},
+                                                                   port{port_},
+                                                                   queues{queues_},
+                                                                   idempotency_window{idempotency_window_},
+                                                                   lease_timeout{lease_timeout_}
+{
+}
+
+RedisQueue::~RedisQueue()
+{
+    for (redisContext *ctx : idle)
+    {
+        redisFree(ctx);
+    }
+    if (!idle.empty())
+    {
+        spdlog::info("Shut down {} Redis connections: {}:{}", idle.size(), host, port);
+    }
+    idle.clear();
+}
+
+redisContext *RedisQueue::open_connection()
+{
+    redisContext *ctx = redisConnectWithTimeout(host.c_str(), port, timeval{2, 0});
+    if (ctx == nullptr || ctx->err)
+    {
+        spdlog::error("Failed to connect to Redis at {}:{}: {}", host, port, ctx ? ctx->errstr : "out of memory");
+        if (ctx)
+        {
+            redisFree(ctx);
+        }
+        return nullptr;
+    }
+    return ctx;
+}
+
+bool RedisQueue::connect()
+{
+    Connection connection{this};
+    redisContext *ctx = connection.get();
+    if (ctx == nullptr)
+    {
+        return false;
+    }
+
+    // Load the scripts once so that claims only need to send their SHA1
+    for (auto [script, sha] : {std::make_pair(claim_script, &claim_sha), std::make_pair(update_script, &update_sha),
+                               std::make_pair(release_script, &release_sha), std::make_pair(renew_script, &renew_sha),
+                               std::make_pair(enqueue_once_script, &enqueue_once_sha)})
+    {
+        redisReply *reply = static_cast<redisReply *>(redisCommand(ctx, "SCRIPT LOAD %s", script));
+        if (reply == nullptr || reply->type != REDIS_REPLY_STRING)
+        {
+            spdlog::error("Failed to load Redis script: {}", reply ? reply->str : ctx->errstr);
+            if (reply)
+            {
+                freeReplyObject(reply);
+            }
+            return false;
+        }
+        *sha = std::string(reply->str, reply->len);
+        freeReplyObject(reply);
+    }
+    spdlog::info("Established Redis connection: {}:{}", host, port);
+    return true;
+}
+
+bool RedisQueue::flush()
+{
+    Connection connection{this};
+    redisContext *ctx = connection.get();
+    if (ctx == nullptr)
+    {
+        return false;
+    }
+    std::string cursor{"0"};
+    do
+    {
+        redisReply *reply = static_cast<redisReply *>(redisCommand(ctx, "SCAN %s MATCH {etq}:* COUNT 1000", cursor.c_str()));
+        if (reply == nullptr || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2)
+        {
+            spdlog::error("Failed to scan Redis keys");
+            if (reply)
+            {
+                freeReplyObject(reply);
+            }
+            return false;
+        }
+        cursor = reply->element[0]->str;
+        redisReply *keys = reply->element[1];
+        for (size_t i = 0; i < keys->elements; ++i)
+        {
+            redisAppendCommand(ctx, "UNLINK %b", keys->element[i]->str, keys->element[i]->len);
+        }
+        size_t pending = keys->elements;
+        freeReplyObject(reply);
+        for (size_t i = 0; i < pending; ++i)
+        {
+            redisReply *r;
+            read_reply(ctx, &r);
+            if (r)
+            {
+                freeReplyObject(r);
+            }
+        }
+    } while (cursor != "0");
+    return true;
+}
+
+bool RedisQueue::enqueue(const Job &job)
+{
+    Connection connection{this};
+    redisContext *ctx = connection.get();
+    if (ctx == nullptr)
+    {
+        return false;
+    }
+    std::string id{job.get_id()};
+    std::optional<std::chrono::system_clock::time_point> next_execution_at{job.get_next_execution_at()};
+
+    // Store the job and make it claimable in a single transaction, sent as one pipeline
+    std::vector<std::string> hset{"HSET", job_prefix + id};
+    std::vector<std::string> fields{job_fields(job)};
+    hset.insert(hset.end(), fields.begin(), fields.end());
+
+    redisAppendCommand(ctx, "MULTI");
+    append_argv(ctx, hset);
+    if (next_execution_at && *next_execution_at > std::chrono::system_clock::now())
+    {
+        append_argv(ctx, {"ZADD", scheduled_prefix + job.get_queue(), to_epoch(*next_execution_at), id});
+    }
+    else
+    {
+        append_argv(ctx, {"LPUSH", queue_prefix + job.get_queue(), id});
+    }
+    redisAppendCommand(ctx, "EXEC");
+
+    bool saved = true;
+    for (int i = 0; i < 4; ++i)
+    {
+        redisReply *reply;
+        saved = read_reply(ctx, &reply) && saved;
+        if (reply)
+        {
+            freeReplyObject(reply);
+        }
+    }
+    return saved;
+}
+
+std::vector<std::unique_ptr<Job>> RedisQueue::claim(const std::string &worker_id, size_t max_jobs)
+{
+    std::vector<std::unique_ptr<Job>> jobs;
+    Connection connection{this};
+    redisContext *ctx = connection.get();
+    if (ctx == nullptr)
+    {
+        return jobs;
+    }
+
+    std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+    std::vector<std::string> args{"2", processing_prefix + worker_id, leases_key,
+                                  to_epoch(now), std::to_string(max_jobs), to_epoch(now + lease_timeout), worker_id};
+    args.insert(args.end(), queues.begin(), queues.end());
+
+    redisReply *reply;
+    if (!eval(ctx, claim_script, claim_sha, args, &reply) || reply->type != REDIS_REPLY_ARRAY)
+    {
+        spdlog::error("Worker {}. Failed to claim jobs from Redis.", worker_id);
+        if (reply)
+        {
+            freeReplyObject(reply);
+        }
+        return jobs;
+    }
+
+    std::vector<std::string> ids;
+    for (size_t i = 0; i < reply->elements; ++i)
+    {
+        ids.emplace_back(reply->element[i]->str, reply->element[i]->len);
+    }
+    freeReplyObject(reply);
+
+    // The script reserved the claimed jobs already, fetch them in one round trip
+    for (const std::string &id : ids)
+    {
+        append_argv(ctx, {"HGETALL", job_prefix + id});
+    }
+    std::vector<std::string> corrupt;
+    for (const std::string &id : ids)
+    {
+        redisReply *hgetall_reply;
+        read_reply(ctx, &hgetall_reply);
+        bool unreadable = false;
+        std::unique_ptr<Job> job{job_from_hash(id, hgetall_reply, &unreadable)};
+        if (job)
+        {
+            jobs.push_back(std::move(job));
+        }
+        else if (unreadable)
+        {
+            corrupt.push_back(id);
+        }
+        else
+        {
+            spdlog::error("Worker {}. Claimed job {} has no stored data.", worker_id, id);
+        }
+        if (hgetall_reply)
+        {
+            freeReplyObject(hgetall_reply);
+        }
+    }
+
+    // Jobs that cannot be read would be claimed over and over, so they are failed right away
+    for (const std::string &id : corrupt)
+    {
+        std::vector<std::string> fail{"2", job_prefix + id, leases_key, id, "", worker_id,
+                                      "state", "failed", "reserved_by", "", "error_details", "Corrupt job data"};
+        redisReply *fail_reply;
+        if (!eval(ctx, update_script, update_sha, fail, &fail_reply) || fail_reply->type != REDIS_REPLY_INTEGER)
+        {
+            spdlog::error("Worker {}. Failed to fail corrupt job {} in Redis", worker_id, id);
+        }
+        if (fail_reply)
+        {
+            freeReplyObject(fail_reply);
+        }
+    }
+    return jobs;
+}
+
+SaveResult RedisQueue::update(const Job &job, const std::vector<std::string> &fields, const std::string &score)
+{
+    if (fields.empty())
+    {
+        return SaveResult::saved; // Nothing changed
+    }
+    Connection connection{this};
+    redisContext *ctx = connection.get();
+    if (ctx == nullptr)
+    {
+        return SaveResult::failed;
+    }
+    std::string id{job.get_id()};
+    std::vector<std::string> args{"2", job_prefix + id, leases_key, id, score, job.get_claimed_by().value_or("")};
+    args.insert(args.end(), fields.begin(), fields.end());
+
+    redisReply *reply;
+    SaveResult result = SaveResult::failed;
+    if (eval(ctx, update_script, update_sha, args, &reply) && reply->type == REDIS_REPLY_INTEGER)
+    {
+        result = reply->integer == 1 ? SaveResult::saved : SaveResult::lease_lost;
+    }
+    if (reply)
+    {
+        freeReplyObject(reply);
+    }
+    if (result == SaveResult::lease_lost)
+    {
+        spdlog::warn("Worker {} lost the lease of job {}, its result is discarded", job.get_claimed_by().value_or(""), id);
+    }
+    else if (result == SaveResult::failed)
+    {
+        spdlog::error("Failed to update job in Redis, job id = {}", id);
+    }
+    return result;
+}
+
+SaveResult RedisQueue::ack(const Job &job)
+{
+    return update(job, changed_fields(job));
+}
+
+SaveResult RedisQueue::nack(const Job &job)
+{
+    return update(job, changed_fields(job));
+}
+
+SaveResult RedisQueue::schedule(const Job &job, std::chrono::system_clock::time_point at)
+{
+    return update(job,
+                  {"state", "waiting",
+                   "reserved_by", "",
+                   "next_execution_at", to_epoch(at),
+                   "attempts", std::to_string(job.get_attempts()),
+                   "last_executed_at", to_epoch(job.get_last_executed_at()),
+                   "error_details", job.get_error_details().value_or("")},
+                  to_epoch(at));
+}
+
+size_t RedisQueue::release(const std::vector<const Job *> &jobs)
+{
+    // Jobs are claimed from the end of the queue lists, so the last one is pushed back first.
+    // All jobs of one worker are released with a single script call
+    std::map<std::string, std::vector<const Job *>> by_worker;
+    for (auto job = jobs.rbegin(); job != jobs.rend(); ++job)
+    {
+        if ((*job)->get_reserved_by())
+        {
+            by_worker[*(*job)->get_reserved_by()].push_back(*job);
+        }
+    }
+
+    Connection connection{this};
+    redisContext *ctx = connection.get();
+    if (ctx == nullptr)
+    {
+        return 0;
+    }
+    size_t released = 0;
+    for (const auto &[worker, worker_jobs] : by_worker)
+    {
+        std::vector<std::string> args{"2", processing_prefix + worker, leases_key};
+        for (const Job *job : worker_jobs)
+        {
+            args.push_back(job->get_id());
+        }
+        for (const Job *job : worker_jobs)
+        {
+            args.push_back(job->get_queue());
+        }
+        redisReply *reply;
+        if (eval(ctx, release_script, release_sha, args, &reply) && reply->type == REDIS_REPLY_INTEGER)
+        {
+            released += static_cast<size_t>(reply->integer);
+        }
+        else
+        {
+            spdlog::error("Failed to release the jobs of worker {} in Redis", worker);
+        }
+        if (reply)
+        {
+            freeReplyObject(reply);
+        }
+    }
+    return released;
+}
+
+size_t RedisQueue::renew(const std::string &worker_id, const std::vector<std::string> &job_ids)
+{
+    if (job_ids.empty())
+    {
+        return 0;
+    }
+    std::vector<std::string> args{"1", leases_key, worker_id, to_epoch(std::chrono::system_clock::now() + lease_timeout)};
+    args.insert(args.end(), job_ids.begin(), job_ids.end());
+
+    Connection connection{this};
+    redisContext *ctx = connection.get();
+    if (ctx == nullptr)
+    {
+        return 0;
+    }
+    redisReply *reply;
+    size_t renewed = 0;
+    if (eval(ctx, renew_script, renew_sha, args, &reply) && reply->type == REDIS_REPLY_INTEGER)
+    {
+        renewed = static_cast<size_t>(reply->integer);
+    }
+    else
+    {
+        spdlog::error("Failed to renew the leases of worker {} in Redis", worker_id);
+    }
+    if (reply)
+    {
+        freeReplyObject(reply);
+    }
+    return renewed;
+}
+
+bool RedisQueue::sync()
+{
+    // Durability is up to the persistence settings of the Redis server
+    return true;
+}
+
+size_t RedisQueue::depth(const std::string &queue)
+{
+    Connection connection{this};
+    redisContext *ctx = connection.get();
+    if (ctx == nullptr)
+    {
+        return 0;
+    }
+    // Delayed jobs are waiting as well, like in the other backends
+    append_argv(ctx, {"LLEN", queue_prefix + queue});
+    append_argv(ctx, {"ZCARD", scheduled_prefix + queue});
+    size_t count = 0;
+    bool counted = true;
+    for (int i = 0; i < 2; ++i)
+    {
+        redisReply *reply;
+        if (read_reply(ctx, &reply) && reply->type == REDIS_REPLY_INTEGER)
+        {
+            count += static_cast<size_t>(reply->integer);
+        }
+        else
+        {
+            counted = false;
+        }
+        if (reply)
+        {
+            freeReplyObject(reply);
+        }
+    }
+    if (!counted)
+    {
+        spdlog::error("Failed to read depth of queue {} from Redis", queue);
+    }
+    return count;
+}
+
+std::optional<IdempotencyKey> RedisQueue::enqueue_once(const Job &job, const std::string &idempotency_key)
+{
+    Connection connection{this};
+    redisContext *ctx = connection.get();
+    if (ctx == nullptr)
+    {
+        return std::nullopt;
+    }
+    std::string id{job.get_id()};
+    std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+    std::optional<std::chrono::system_clock::time_point> next_execution_at{job.get_next_execution_at()};
+    bool delayed = next_execution_at && *next_execution_at > now;
+
+    // Taking the key and storing the job happen in one script, like enqueue does in one transaction
+    std::vector<std::string> args{"3", idempotency_prefix + idempotency_key, job_prefix + id,
+                                  (delayed ? scheduled_prefix : queue_prefix) + job.get_queue(),
+                                  id, std::to_string(idempotency_window.count()), delayed ? to_epoch(*next_execution_at) : ""};
+    std::vector<std::string> fields{job_fields(job)};
+    args.insert(args.end(), fields.begin(), fields.end());
+
+    redisReply *reply;
+    std::optional<IdempotencyKey> holder;
+    if (eval(ctx, enqueue_once_script, enqueue_once_sha, args, &reply) && reply->type == REDIS_REPLY_ARRAY && reply->elements == 3 &&
+        reply->element[0]->type == REDIS_REPLY_INTEGER && reply->element[1]->type == REDIS_REPLY_STRING &&
+        reply->element[2]->type == REDIS_REPLY_INTEGER)
+    {
+        holder = IdempotencyKey{std::string(reply->element[1]->str, reply->element[1]->len), now};
+        // A taken key had its TTL set to the full window when it was taken
+        long long ttl = reply->element[2]->integer;
+        if (reply->element[0]->integer == 0 && ttl >= 0)
+        {
+            holder->taken_at = now - (idempotency_window - std::chrono::seconds(ttl));
+        }
+    }
+    else
+    {
+        spdlog::error("Failed to enqueue job with idempotency key in Redis, job id = {}", id);
+    }
+    if (reply)
+    {
+        freeReplyObject(reply);
+    }
+    return holder;
+}
+
+size_t RedisQueue::expire_idempotency_keys(std::chrono::system_clock::time_point)
+{
+    // Keys are created with a TTL, so Redis expires them on its own
+    return 0;
+}
+
+std::unique_ptr<Job> RedisQueue::get_job(const std::string &id)
+{
+    Connection connection{this};
+    redisContext *ctx = connection.get();
+    if (ctx == nullptr)
+    {
+        return nullptr;
+    }
+    append_argv(ctx, {"HGETALL", job_prefix + id});
+    redisReply *reply;
+    std::unique_ptr<Job> job;
+    if (read_reply(ctx, &reply))
+    {
+        job = job_from_hash(id, reply);
+    }
+    if (reply)
+    {
+        freeReplyObject(reply);
+    }
+    return job;
+}
+
+std::vector<std::unique_ptr<Job>> RedisQueue::list_jobs(const JobQuery &query)
+{
+    // There is no secondary index on the job state, so listing scans all job hashes. It is meant for
+    // occasional support queries, status polling of single jobs goes through get_job.
+    std::vector<std::unique_ptr<Job>> jobs;
+    std::vector<std::pair<long long, std::string>> matches;
+    Connection connection{this};
+    redisContext *ctx = connection.get();
+    if (ctx == nullptr)
+    {
+        return jobs;
+    }
+    std::string cursor{"0"};
+    do
+    {
+        append_argv(ctx, {"SCAN", cursor, "MATCH", job_prefix + "*", "COUNT", "1000"});
+        redisReply *reply;
+        if (!read_reply(ctx, &reply) || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2)
+        {
+            spdlog::error("Failed to scan Redis jobs");
+            if (reply)
+            {
+                freeReplyObject(reply);
+            }
+            return jobs;
+        }
+        cursor = reply->element[0]->str;
+        std::vector<std::string> ids;
+        redisReply *keys = reply->element[1];
+        for (size_t i = 0; i < keys->elements; ++i)
+        {
+            ids.emplace_back(keys->element[i]->str + job_prefix.size(), keys->element[i]->len - job_prefix.size());
+        }
+        freeReplyObject(reply);
+
+        // Fetch the fields needed for filtering in one round trip
+        for (const std::string &id : ids)
+        {
+            append_argv(ctx, {"HMGET", job_prefix + id, "state", "reserved_by", "queue", "created_at"});
+        }
+        for (const std::string &id : ids)
+        {
+            redisReply *fields;
+            if (read_reply(ctx, &fields) && fields->type == REDIS_REPLY_ARRAY && fields->elements == 4)
+            {
+                auto field = [&](size_t i)
+                {
+                    redisReply *value = fields->element[i];
+                    return value->type == REDIS_REPLY_STRING ? std::string(value->str, value->len) : std::string();
+                };
+                std::string status{field(0) == "waiting" && !field(1).empty() ? "running" : field(0)};
+                std::string created_at{field(3)};
+                if ((!query.state || *query.state == status) && (!query.queue || *query.queue == field(2)))
+                {
+                    matches.emplace_back(created_at.empty() ? 0 : std::stoll(created_at), id);
+                }
+            }
+            if (fields)
+            {
+                freeReplyObject(fields);
+            }
+        }
+    } while (cursor != "0");
+
+    if (query.offset >= matches.size())
+    {
+        return jobs;
+    }
+    size_t end = std::min(matches.size(), query.offset + query.limit);
+    std::partial_sort(matches.begin(), matches.begin() + end, matches.end(), [](const auto &a, const auto &b)
+                      { return a.first != b.first ? a.first > b.first : a.second < b.second; });
+    for (size_t i = query.offset; i < end; ++i)
+    {
+        append_argv(ctx, {"HGETALL", job_prefix + matches[i].second});
+    }
+    for (size_t i = query.offset; i < end; ++i)
+    {
+        redisReply *reply;
+        if (read_reply(ctx, &reply))
+        {
+            if (std::unique_ptr<Job> job = job_from_hash(matches[i].second, reply))
+            {
+                jobs.push_back(std::move(job));
+            }
+        }
+        if (reply)
+        {
+            freeReplyObject(reply);
+        }
+    }
+    return jobs;
+}
@@ -0,0 +1,589 @@
+#include "../include/smtp_session.h"
+#include "../include/trace.h"
+#include <algorithm>
+#include <cctype>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string_view>
+#include <sys/socket.h>
+
+namespace
+{
+const size_t io_buffer_size = 64 * 1024;
+
+bool starts_with_keyword(std::string_view line, std::string_view keyword)
+{
+    return line.size() >= keyword.size() &&
+           std::equal(keyword.begin(), keyword.end(), line.begin(), [](char a, char b)
+                      { return a == std::toupper(static_cast<unsigned char>(b)); });
+}
+
+// Addresses are written into commands, so they must not be able to end the command early
+bool valid_address(const std::string &address)
+{
+    return !address.empty() && address.find_first_of("\r\n<>") == std::string::npos;
+}
+}
+
+// SmtpResult
+bool SmtpResult::delivered() const
+{
+    return code == 250;
+}
+
+bool SmtpResult::is_permanent() const
+{
+    return code >= 500;
+}
+
+// SmtpSession
+SmtpSession::SmtpSession(const SmtpCredentials &credentials_, std::chrono::milliseconds timeout_) : credentials{credentials_},
+                                                                                                     timeout{timeout_},
+                                                                                                     curl{nullptr},
+                                                                                                     socket{CURL_SOCKET_BAD},
+                                                                                                     cancelled{false},
+                                                                                                     started{0},
+                                                                                                     pipelining{false},
+                                                                                                     chunking{false},
+                                                                                                     reading_ehlo{false},
+                                                                                                     transaction_open{false},
+                                                                                                     awaiting_data{false},
+                                                                                                     data_traced_until{0},
+                                                                                                     buffer(io_buffer_size),
+                                                                                                     content_buffer(io_buffer_size)
+{
+}
+
+SmtpSession::~SmtpSession()
+{
+    close();
+}
+
+// curl hands the server's replies during connect to the header callback, which picks the
+// extensions out of the last EHLO reply
+size_t SmtpSession::capture_reply(char *ptr, size_t size, size_t nmemb, void *userp)
+{
+    SmtpSession *session = static_cast<SmtpSession *>(userp);
+    std::string_view line{ptr, size * nmemb};
+    if (line.size() >= 4 && line.substr(0, 3) == "250")
+    {
+        if (!session->reading_ehlo)
+        {
+            // A new EHLO reply, e.g. the one after STARTTLS, replaces the earlier one
+            session->pipelining = false;
+            session->chunking = false;
+            session->reading_ehlo = true;
+        }
+        std::string_view keyword{line.substr(4)};
+        session->pipelining = session->pipelining || starts_with_keyword(keyword, "PIPELINING");
+        session->chunking = session->chunking || starts_with_keyword(keyword, "CHUNKING");
+        if (line[3] == ' ')
+        {
+            session->reading_ehlo = false;
+        }
+    }
+    return size * nmemb;
+}
+
+// curl progress callback, aborts a connect in progress once the session was cancelled
+int SmtpSession::check_cancelled(void *userp, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+    return static_cast<SmtpSession *>(userp)->cancelled ? 1 : 0;
+}
+
+void SmtpSession::connect()
+{
+    close();
+    curl = curl_easy_init();
+    if (curl == nullptr)
+    {
+        throw std::runtime_error("Failed to initialize curl");
+    }
+    pipelining = false;
+    chunking = false;
+    reading_ehlo = false;
+
+    // curl runs the greeting, EHLO, STARTTLS and AUTH and then hands over the connection
+    curl_easy_setopt(curl, CURLOPT_URL, credentials.server.c_str());
+    if (!credentials.user.empty())
+    {
+        curl_easy_setopt(curl, CURLOPT_USERNAME, credentials.user.c_str());
+        curl_easy_setopt(curl, CURLOPT_PASSWORD, credentials.password.c_str());
+    }
+    curl_easy_setopt(curl, CURLOPT_USE_SSL, credentials.require_tls ? (long)CURLUSESSL_ALL : (long)CURLUSESSL_TRY);
+    curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, static_cast<long>(timeout.count()));
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, capture_reply);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, check_cancelled);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+
+    int64_t started = trace_enabled() ? trace_now() : 0;
+    CURLcode res = curl_easy_perform(curl);
+    if (res != CURLE_OK)
+    {
+        std::string error{curl_easy_strerror(res)};
+        curl_easy_cleanup(curl);
+        curl = nullptr;
+        throw std::runtime_error("Failed to connect to SMTP server: " + error);
+    }
+    {
+        std::lock_guard<std::mutex> lock{socket_mutex};
+        curl_easy_getinfo(curl, CURLINFO_ACTIVESOCKET, &socket);
+    }
+
+    if (started != 0)
+    {
+        // Connect includes the name lookup and the TLS handshake, auth the greeting, EHLO and AUTH
+        curl_off_t connect_time = 0, app_connect = 0, total = 0;
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect_time);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &app_connect);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+        curl_off_t connected = std::max(connect_time, app_connect);
+        trace_complete("smtp connect", "smtp", started, connected);
+        trace_complete("smtp auth", "smtp", started + connected, std::max(total - connected, curl_off_t{0}));
+    }
+    spdlog::info("Connected to SMTP server {} (pipelining: {}, chunking: {})", credentials.server, pipelining, chunking);
+}
+
+// Whether a connection kept from an earlier batch can still be used. Between batches the server
+// has nothing to say, so a readable socket means it closed the connection or announced that it
+// will, e.g. with a 421 after its idle timeout. The bytes are read through curl, since with TLS
+// they may also be a record without data, such as a session ticket
+bool SmtpSession::is_alive()
+{
+    pollfd fd{socket, POLLIN, 0};
+    int ready = poll(&fd, 1, 0);
+    if (ready == 0)
+    {
+        return true;
+    }
+    if (ready < 0 || (fd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+    {
+        return false;
+    }
+    try
+    {
+        return !receive();
+    }
+    catch (const std::exception &)
+    {
+        return false;
+    }
+}
+
+void SmtpSession::close()
+{
+    if (curl)
+    {
+        // Best effort, the server closes idle connections anyway
+        size_t sent = 0;
+        curl_easy_send(curl, "QUIT\r\n", 6, &sent);
+        {
+            // The socket must not be shut down by cancel() once curl closed it
+            std::lock_guard<std::mutex> lock{socket_mutex};
+            socket = CURL_SOCKET_BAD;
+        }
+        curl_easy_cleanup(curl);
+        curl = nullptr;
+    }
+    transaction_open = false;
+    awaiting_data = false;
+    pending.clear();
+    output.clear();
+    input.clear();
+}
+
+void SmtpSession::cancel()
+{
+    std::lock_guard<std::mutex> lock{socket_mutex};
+    cancelled = true;
+    // Wakes a poll waiting for the server, the owning thread then fails the batch and closes
+    if (socket != CURL_SOCKET_BAD)
+    {
+        ::shutdown(socket, SHUT_RDWR);
+    }
+}
+
+bool SmtpSession::is_connected() const
+{
+    return curl != nullptr;
+}
+
+bool SmtpSession::supports_pipelining() const
+{
+    return pipelining;
+}
+
+bool SmtpSession::supports_chunking() const
+{
+    return chunking;
+}
+
+// Wait until the socket is readable, or writable if for_writing is set. Replies arriving while
+// a large batch is written are read right away, so that neither side blocks on a full buffer
+void SmtpSession::wait(bool for_writing)
+{
+    pollfd fd{socket, static_cast<short>(POLLIN | (for_writing ? POLLOUT : 0)), 0};
+    int ready = poll(&fd, 1, static_cast<int>(timeout.count()));
+    if (ready == 0)
+    {
+        throw std::runtime_error("Timed out waiting for the SMTP server");
+    }
+    if (ready < 0 || (fd.revents & (POLLERR | POLLNVAL)))
+    {
+        throw std::runtime_error("Connection to the SMTP server failed");
+    }
+    if (for_writing && (fd.revents & (POLLIN | POLLHUP)))
+    {
+        receive();
+    }
+}
+
+// Append the bytes available on the connection to input. Returns false if there were none
+bool SmtpSession::receive()
+{
+    size_t received = 0;
+    CURLcode res = curl_easy_recv(curl, buffer.data(), buffer.size(), &received);
+    if (res == CURLE_AGAIN)
+    {
+        return false;
+    }
+    if (res != CURLE_OK)
+    {
+        throw std::runtime_error(std::string("Failed to read from SMTP server: ") + curl_easy_strerror(res));
+    }
+    if (received == 0)
+    {
+        throw std::runtime_error("SMTP server closed the connection");
+    }
+    input.append(buffer.data(), received);
+    return true;
+}
+
+void SmtpSession::write(const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t sent = 0;
+        CURLcode res = curl_easy_send(curl, data, size, &sent);
+        if (res == CURLE_AGAIN)
+        {
+            wait(true);
+            continue;
+        }
+        if (res != CURLE_OK)
+        {
+            throw std::runtime_error(std::string("Failed to write to SMTP server: ") + curl_easy_strerror(res));
+        }
+        data += sent;
+        size -= sent;
+    }
+}
+
+void SmtpSession::flush()
+{
+    if (!output.empty())
+    {
+        write(output.data(), output.size());
+        output.clear();
+    }
+}
+
+// Write the message. After DATA, lines starting with a dot get a second one (RFC 5321 4.5.2);
+// BDAT chunks are sent as they are. Returns whether the content ended with a line break
+bool SmtpSession::write_content(MessageStream &content, bool dot_stuffing)
+{
+    std::vector<char> &chunk = content_buffer;
+    bool line_start = true;
+    size_t size;
+    content.rewind();
+    while ((size = content.read(chunk.data(), chunk.size())) > 0)
+    {
+        if (!dot_stuffing)
+        {
+            write(chunk.data(), size);
+            continue;
+        }
+        stuffed.clear();
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (line_start && chunk[i] == '.')
+            {
+                stuffed.push_back('.');
+            }
+            stuffed.push_back(chunk[i]);
+            line_start = chunk[i] == '\n';
+        }
+        write(stuffed.data(), stuffed.size());
+    }
+    return line_start;
+}
+
+std::pair<int, std::string> SmtpSession::read_reply()
+{
+    std::string text;
+    while (true)
+    {
+        size_t end;
+        while ((end = input.find("\r\n")) == std::string::npos)
+        {
+            if (!receive())
+            {
+                wait(false);
+            }
+        }
+        std::string line{input, 0, end};
+        input.erase(0, end + 2);
+        if (line.size() < 3 || !std::all_of(line.begin(), line.begin() + 3, ::isdigit))
+        {
+            throw std::runtime_error("Malformed reply from SMTP server: " + line);
+        }
+        text.append(text.empty() ? "" : " ").append(line.size() > 4 ? line.substr(4) : "");
+        if (line.size() == 3 || line[3] != '-')
+        {
+            return {std::stoi(line.substr(0, 3)), text};
+        }
+    }
+}
+
+void SmtpSession::queue(const std::string &command, size_t message, Step step)
+{
+    output.append(command);
+    pending.push_back(Pending{message, step});
+}
+
+// Write the queued commands and read all outstanding replies, attributing each to its message
+void SmtpSession::collect(std::vector<SmtpResult> &results)
+{
+    flush();
+    while (!pending.empty())
+    {
+        auto [code, text] = read_reply();
+        if (code == 421)
+        {
+            // The server is closing the connection, the messages it did not decide are sent again
+            throw std::runtime_error("SMTP server closed the connection: " + text);
+        }
+        Pending done = pending.front();
+        pending.pop_front();
+        SmtpResult &result = results[done.message];
+        bool accepted = code / 100 == 2;
+        bool undecided = result.code == 0;
+        switch (done.step)
+        {
+        case reset:
+            if (!accepted)
+            {
+                throw std::runtime_error("SMTP server refused RSET: " + text);
+            }
+            transaction_open = false;
+            break;
+        case mail:
+            transaction_open = transaction_open || accepted;
+            if (!accepted && undecided)
+            {
+                result = SmtpResult{code, text};
+            }
+            break;
+        case recipient:
+            if (!accepted && undecided)
+            {
+                result = SmtpResult{code, text};
+            }
+            break;
+        case data:
+            awaiting_data = code == 354;
+            if (code != 354 && undecided)
+            {
+                result = SmtpResult{code, text};
+                trace_data(done.message);
+            }
+            break;
+        case end_of_data:
+            // The end of the data ends the transaction, whether the message was accepted or not
+            transaction_open = false;
+            if (undecided)
+            {
+                result = SmtpResult{code, text};
+            }
+            trace_data(done.message);
+            break;
+        case chunk:
+            transaction_open = transaction_open && !accepted;
+            if (undecided)
+            {
+                result = SmtpResult{code, text};
+            }
+            trace_data(done.message);
+            break;
+        }
+    }
+}
+
+// Record the span from the start of a message's data, or the end of the previous message's data
+// if that came later, to the reply deciding it. With pipelining the uploads overlap, so the spans
+// of a batch split its time between the messages instead of overlapping
+void SmtpSession::trace_data(size_t message)
+{
+    if (message >= data_started.size() || data_started[message] == 0)
+    {
+        return;
+    }
+    int64_t start = std::max(data_started[message], data_traced_until);
+    data_traced_until = trace_now();
+    trace_complete("smtp data", "smtp", start, data_traced_until - start);
+    data_started[message] = 0;
+}
+
+void SmtpSession::transact(const std::vector<SmtpMessage> &messages, std::vector<SmtpResult> &results)
+{
+    data_started.assign(trace_enabled() ? messages.size() : 0, 0);
+    data_traced_until = 0;
+    for (size_t i = 0; i < messages.size(); ++i)
+    {
+        if (cancelled)
+        {
+            throw std::runtime_error("SMTP session cancelled");
+        }
+        started = i + 1;
+        if (results[i].code != 0)
+        {
+            // Decided over a connection that was lost later
+            continue;
+        }
+        const SmtpMessage &message = messages[i];
+        if (!valid_address(*message.from) || !valid_address(*message.recipient))
+        {
+            results[i] = SmtpResult{501, "Invalid address"};
+            continue;
+        }
+
+        // A transaction left open by a rejected recipient or chunk would make the next MAIL fail.
+        // While replies are outstanding that cannot be ruled out, so a RSET is pipelined as well
+        bool undecided = std::any_of(pending.begin(), pending.end(), [](const Pending &p)
+                                     { return p.step != end_of_data && p.step != reset; });
+        if (transaction_open || undecided)
+        {
+            queue("RSET\r\n", i, reset);
+        }
+        queue("MAIL FROM:<" + *message.from + ">\r\n", i, mail);
+        if (!pipelining)
+        {
+            collect(results);
+            if (results[i].code != 0)
+            {
+                continue;
+            }
+        }
+        queue("RCPT TO:<" + *message.recipient + ">\r\n", i, recipient);
+        if (!pipelining)
+        {
+            collect(results);
+            if (results[i].code != 0)
+            {
+                continue;
+            }
+        }
+
+        if (chunking)
+        {
+            // The whole message is one chunk, sent right behind its envelope
+            if (!data_started.empty())
+            {
+                data_started[i] = trace_now();
+            }
+            queue("BDAT " + std::to_string(message.content->size()) + " LAST\r\n", i, chunk);
+            flush();
+            write_content(*message.content, false);
+            if (!pipelining)
+            {
+                collect(results);
+            }
+            continue;
+        }
+
+        // DATA has to wait for its 354, so without CHUNKING every message costs one round trip.
+        // The end of its data is sent together with the envelope of the next message
+        if (!data_started.empty())
+        {
+            data_started[i] = trace_now();
+        }
+        queue("DATA\r\n", i, data);
+        collect(results);
+        if (results[i].code != 0)
+        {
+            // Servers should refuse DATA without a recipient; one that did not gets an empty message
+            if (awaiting_data)
+            {
+                queue(".\r\n", i, end_of_data);
+                awaiting_data = false;
+            }
+            continue;
+        }
+        awaiting_data = false;
+        bool line_end = write_content(*message.content, true);
+        queue(line_end ? ".\r\n" : "\r\n.\r\n", i, end_of_data);
+        if (!pipelining)
+        {
+            collect(results);
+        }
+    }
+    collect(results);
+}
+
+std::vector<SmtpResult> SmtpSession::send(const std::vector<SmtpMessage> &messages)
+{
+    TraceSpan span{"smtp batch", "smtp"};
+    std::vector<SmtpResult> results(messages.size(), SmtpResult{0, ""});
+    for (int attempt = 0;; ++attempt)
+    {
+        bool connected = false;
+        started = 0;
+        try
+        {
+            if (cancelled)
+            {
+                throw std::runtime_error("SMTP session cancelled");
+            }
+            if (is_connected() && !is_alive())
+            {
+                spdlog::info("SMTP server closed the connection kept from the last batch, reconnecting");
+                close();
+            }
+            if (!is_connected())
+            {
+                connect();
+            }
+            connected = true;
+            transact(messages, results);
+            break;
+        }
+        catch (const std::exception &e)
+        {
+            close();
+            // A connection lost after it was set up is not the fault of the messages. Those without
+            // a reply are sent once more over a new connection, those that were decided keep their result
+            if (connected && attempt == 0 && !cancelled)
+            {
+                spdlog::warn("SMTP connection lost ({}), reconnecting", e.what());
+                continue;
+            }
+            spdlog::error("SMTP batch failed: {}", e.what());
+            for (size_t i = 0; i < results.size(); ++i)
+            {
+                if (results[i].code == 0)
+                {
+                    results[i].reply = e.what();
+                    results[i].cancelled = cancelled && i >= started;
+                }
+            }
+            break;
+        }
+    }
+    // A cancel only aborts the batch it interrupted, or the next one if it came in between
+    cancelled = false;
+    return results;
+}
@@ -0,0 +1,939 @@
+#include "../include/sqlite_queue.h"
+#include "../include/chronotostring.h"
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+namespace
+{
+// Columns read by job_from_row, in this order
+const std::string job_columns = "id, name, type_id, args, queue, created_at, next_execution_at, last_executed_at, attempts, state, error_details, reserved_by";
+
+std::optional<std::string> optional_text(sqlite3_stmt *stmt, int column)
+{
+    const unsigned char *text = sqlite3_column_text(stmt, column);
+    if (text == nullptr)
+    {
+        return std::nullopt;
+    }
+    return std::string(reinterpret_cast<const char *>(text));
+}
+
+std::optional<std::chrono::system_clock::time_point> optional_time(sqlite3_stmt *stmt, int column)
+{
+    std::optional<std::string> text{optional_text(stmt, column)};
+    if (!text)
+    {
+        return std::nullopt;
+    }
+    return string_to_chrono(*text);
+}
+
+// Columns of the fields a state transition may change
+const std::pair<Job::Field, const char *> state_columns[] = {
+    {Job::field_type_id, "type_id"},
+    {Job::field_queue, "queue"},
+    {Job::field_attempts, "attempts"},
+    {Job::field_created_at, "created_at"},
+    {Job::field_next_execution_at, "next_execution_at"},
+    {Job::field_last_executed_at, "last_executed_at"},
+    {Job::field_state, "state"},
+    {Job::field_error_details, "error_details"},
+    {Job::field_reserved_by, "reserved_by"},
+};
+
+void bind_optional_text(sqlite3_stmt *stmt, int index, const std::optional<std::string> &value)
+{
+    if (value)
+    {
+        sqlite3_bind_text(stmt, index, value->c_str(), -1, SQLITE_TRANSIENT);
+    }
+    else
+    {
+        sqlite3_bind_null(stmt, index);
+    }
+}
+
+void bind_optional_time(sqlite3_stmt *stmt, int index, const std::optional<std::chrono::system_clock::time_point> &value)
+{
+    bind_optional_text(stmt, index, value ? std::optional<std::string>{chrono_to_string(*value)} : std::nullopt);
+}
+
+void bind_field(sqlite3_stmt *stmt, int index, const Job &job, Job::Field field)
+{
+    switch (field)
+    {
+    case Job::field_type_id:
+        sqlite3_bind_int(stmt, index, job.get_type_id());
+        break;
+    case Job::field_queue:
+        sqlite3_bind_text(stmt, index, job.get_queue().c_str(), -1, SQLITE_TRANSIENT);
+        break;
+    case Job::field_attempts:
+        sqlite3_bind_int(stmt, index, job.get_attempts());
+        break;
+    case Job::field_created_at:
+        sqlite3_bind_text(stmt, index, chrono_to_string(job.get_created_at()).c_str(), -1, SQLITE_TRANSIENT);
+        break;
+    case Job::field_next_execution_at:
+        bind_optional_time(stmt, index, job.get_next_execution_at());
+        break;
+    case Job::field_last_executed_at:
+        bind_optional_time(stmt, index, job.get_last_executed_at());
+        break;
+    case Job::field_state:
+        sqlite3_bind_text(stmt, index, job.get_state().c_str(), -1, SQLITE_TRANSIENT);
+        break;
+    case Job::field_error_details:
+        bind_optional_text(stmt, index, job.get_error_details());
+        break;
+    case Job::field_reserved_by:
+        bind_optional_text(stmt, index, job.get_reserved_by());
+        break;
+    }
+}
+
+// Rebuild a job from a row holding job_columns. Returns nullptr if its arguments are not valid JSON
+std::unique_ptr<Job> job_from_row(sqlite3_stmt *stmt)
+{
+    json args = json::parse(optional_text(stmt, 3).value_or("null"), nullptr, false);
+    if (args.is_discarded())
+    {
+        spdlog::error("Job {} has corrupt arguments", optional_text(stmt, 0).value_or(""));
+        return nullptr;
+    }
+    std::unique_ptr<Job> job{new Job{optional_text(stmt, 0).value_or(""),
+                                     std::move(args),
+                                     optional_text(stmt, 1).value_or(""),
+                                     optional_text(stmt, 4).value_or("default"),
+                                     sqlite3_column_int(stmt, 8),
+                                     optional_time(stmt, 6),
+                                     optional_time(stmt, 7),
+                                     optional_text(stmt, 9).value_or("waiting"),
+                                     optional_text(stmt, 10),
+                                     optional_text(stmt, 11)}};
+    job->set_type_id(sqlite3_column_int(stmt, 2));
+    if (std::optional<std::chrono::system_clock::time_point> created_at = optional_time(stmt, 5))
+    {
+        job->set_created_at(*created_at);
+    }
+    job->clear_dirty();
+    return job;
+}
+}
+
+SqliteQueue::SqliteQueue(const std::string &path_,
+                         const std::vector<std::string> &queues_,
+                         std::chrono::seconds lease_timeout_) : path{path_}, db{nullptr}, queues{queues_}, lease_timeout{lease_timeout_}, leases_checked{}
+{
+}
+
+SqliteQueue::~SqliteQueue()
+{
+    if (db)
+    {
+        sqlite3_close_v2(db);
+        db = nullptr;
+        spdlog::info("Shut down database connection: {}", path);
+    }
+}
+
+bool SqliteQueue::open()
+{
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK)
+    {
+        spdlog::error("Failed to open database {}: {}", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        db = nullptr;
+        return false;
+    }
+    // Wait for locks held by other connections instead of failing right away
+    sqlite3_busy_timeout(db, 5000);
+    // Processes serving the API and running workers share the database. With a write-ahead log
+    // their reads do not block on each other's writes; claims stay atomic single statements
+    char *errMsg = nullptr;
+    if (sqlite3_exec(db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, &errMsg) != SQLITE_OK)
+    {
+        spdlog::warn("Failed to enable the write-ahead log on {}: {}", path, errMsg);
+        sqlite3_free(errMsg);
+    }
+    spdlog::info("Established database connection: {}", path);
+    return true;
+}
+
+bool SqliteQueue::create_tables(bool drop_existing)
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    char *errMsg = nullptr;
+
+    if (drop_existing)
+    {
+        // Drop the existing tables if they exist
+        if (sqlite3_exec(db, "DROP TABLE IF EXISTS jobs; DROP TABLE IF EXISTS idempotency_keys;", nullptr, nullptr, &errMsg) != SQLITE_OK)
+        {
+            spdlog::error("Failed to drop tables: {}", errMsg);
+            sqlite3_free(errMsg);
+            return false;
+        }
+    }
+
+    // Create the jobs table
+    const char *sql = R"(
+        CREATE TABLE IF NOT EXISTS jobs (
+            id TEXT PRIMARY KEY,               -- Unique job ID (string)
+            name TEXT NOT NULL,                -- Job name
+            type_id INTEGER DEFAULT 0,         -- Type id of the Queueable subclass handling the job
+            args TEXT NOT NULL,                -- JSON-encoded arguments
+            queue TEXT DEFAULT 'default',      -- Job queue
+            created_at DATETIME DEFAULT CURRENT_TIMESTAMP, -- Creation timestamp
+            next_execution_at DATETIME,        -- When to execute next (nullable)
+            last_executed_at DATETIME,         -- Last execution timestamp (nullable)
+            attempts INTEGER DEFAULT 0,        -- Number of retry attempts
+            state TEXT DEFAULT 'waiting',      -- Job state
+            error_details TEXT,                -- Error message if failed
+            reserved_by TEXT,                  -- Worker ID processing this job
+            reserved_at DATETIME               -- Start of the reservation, which expires after the lease timeout
+        )
+    )";
+
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &errMsg) != SQLITE_OK)
+    {
+        spdlog::error("Failed to create jobs table: {}", errMsg);
+        sqlite3_free(errMsg);
+        return false;
+    }
+    spdlog::info("Table 'jobs' created successfully!");
+    if (!add_lease_column())
+    {
+        return false;
+    }
+
+    // Finished jobs stay in the table, so depth and claim only look at the waiting jobs through
+    // partial indexes. Their cost does not grow with the number of finished jobs. Claims walk the
+    // waiting jobs of one queue oldest first, which replaced the earlier indexes on queue and age
+    const char *index_sql = R"(
+        DROP INDEX IF EXISTS jobs_waiting_by_queue;
+        DROP INDEX IF EXISTS jobs_waiting_by_age;
+        CREATE INDEX IF NOT EXISTS jobs_waiting_by_queue_age ON jobs (queue, created_at)
+            WHERE state = 'waiting' AND reserved_by IS NULL;
+        CREATE INDEX IF NOT EXISTS jobs_leases ON jobs (reserved_at)
+            WHERE state = 'waiting' AND reserved_by IS NOT NULL;
+    )";
+
+    if (sqlite3_exec(db, index_sql, nullptr, nullptr, &errMsg) != SQLITE_OK)
+    {
+        spdlog::error("Failed to create jobs indexes: {}", errMsg);
+        sqlite3_free(errMsg);
+        return false;
+    }
+
+    // Create the idempotency key table
+    const char *keys_sql = R"(
+        CREATE TABLE IF NOT EXISTS idempotency_keys (
+            key TEXT PRIMARY KEY,              -- Client supplied idempotency key
+            job_id TEXT NOT NULL,              -- Job enqueued with this key
+            created_at INTEGER NOT NULL        -- Unix time the key was taken, used for expiry
+        );
+        CREATE INDEX IF NOT EXISTS idempotency_keys_created_at ON idempotency_keys (created_at);
+    )";
+
+    if (sqlite3_exec(db, keys_sql, nullptr, nullptr, &errMsg) != SQLITE_OK)
+    {
+        spdlog::error("Failed to create idempotency_keys table: {}", errMsg);
+        sqlite3_free(errMsg);
+        return false;
+    }
+    return true;
+}
+
+bool SqliteQueue::upsert(const Job &job)
+{
+    sqlite3_stmt *stmt;
+    std::string id{job.get_id()};
+
+    // SQL INSERT statement using prepared statements
+    const char *sql = R"(
+    INSERT INTO jobs (
+        id, name, args, queue, created_at, next_execution_at,
+        last_executed_at, attempts, state, error_details, reserved_by, type_id
+    ) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)
+    ON CONFLICT(id) DO UPDATE SET
+        name = excluded.name,
+        type_id = excluded.type_id,
+        args = excluded.args,
+        queue = excluded.queue,
+        created_at = excluded.created_at,
+        next_execution_at = excluded.next_execution_at,
+        last_executed_at = excluded.last_executed_at,
+        attempts = excluded.attempts,
+        state = excluded.state,
+        error_details = excluded.error_details,
+        reserved_by = excluded.reserved_by;
+)";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}, job id = {}", sqlite3_errmsg(db), id);
+        return false;
+    }
+
+    // Bind values to the placeholders
+    sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);                                    // id
+    sqlite3_bind_text(stmt, 2, job.get_name().c_str(), -1, SQLITE_TRANSIENT);                        // name
+    sqlite3_bind_text(stmt, 3, job.get_args().dump().c_str(), -1, SQLITE_TRANSIENT);                 // args (JSON serialized to string)
+    sqlite3_bind_text(stmt, 4, job.get_queue().c_str(), -1, SQLITE_TRANSIENT);                       // queue
+    sqlite3_bind_text(stmt, 5, chrono_to_string(job.get_created_at()).c_str(), -1, SQLITE_TRANSIENT); // created_at
+
+    // Bind next_execution_at (nullable)
+    std::optional<std::chrono::system_clock::time_point> next_execution_at{job.get_next_execution_at()};
+    if (next_execution_at)
+    {
+        sqlite3_bind_text(stmt, 6, chrono_to_string(*next_execution_at).c_str(), -1, SQLITE_TRANSIENT);
+    }
+    else
+    {
+        sqlite3_bind_null(stmt, 6); // NULL if no value
+    }
+
+    // Bind last_executed_at (nullable)
+    std::optional<std::chrono::system_clock::time_point> last_executed_at{job.get_last_executed_at()};
+    if (last_executed_at)
+    {
+        sqlite3_bind_text(stmt, 7, chrono_to_string(*last_executed_at).c_str(), -1, SQLITE_TRANSIENT);
+    }
+    else
+    {
+        sqlite3_bind_null(stmt, 7); // NULL if no value
+    }
+
+    sqlite3_bind_int(stmt, 8, job.get_attempts());                                // attempts
+    sqlite3_bind_text(stmt, 9, job.get_state().c_str(), -1, SQLITE_TRANSIENT);     // state
+
+    // Bind error_details (nullable)
+    std::optional<std::string> error_details{job.get_error_details()};
+    if (error_details)
+    {
+        sqlite3_bind_text(stmt, 10, error_details->c_str(), -1, SQLITE_TRANSIENT);
+    }
+    else
+    {
+        sqlite3_bind_null(stmt, 10); // NULL if no value
+    }
+
+    // Bind reserved_by (nullable)
+    std::optional<std::string> reserved_by{job.get_reserved_by()};
+    if (reserved_by)
+    {
+        sqlite3_bind_text(stmt, 11, reserved_by->c_str(), -1, SQLITE_TRANSIENT);
+    }
+    else
+    {
+        sqlite3_bind_null(stmt, 11); // NULL if no value
+    }
+
+    sqlite3_bind_int(stmt, 12, job.get_type_id());                                // type_id
+
+    // Execute the statement
+    bool saved = true;
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+    {
+        spdlog::error("Failed to insert job: {}, job id = {}", sqlite3_errmsg(db), id);
+        saved = false;
+    }
+
+    // Clean up
+    sqlite3_finalize(stmt);
+    return saved;
+}
+
+bool SqliteQueue::enqueue(const Job &job)
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    return upsert(job);
+}
+
+// Databases created before reservations had a lease get the reserved_at column. Their reservations
+// start now, so the jobs of workers that are gone are handed out again after one lease timeout
+bool SqliteQueue::add_lease_column()
+{
+    sqlite3_stmt *stmt;
+    const char *sql = "SELECT COUNT(*) FROM pragma_table_info('jobs') WHERE name = 'reserved_at';";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        return false;
+    }
+    bool exists = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) > 0;
+    sqlite3_finalize(stmt);
+    if (exists)
+    {
+        return true;
+    }
+
+    char *errMsg = nullptr;
+    const char *alter_sql = R"(
+        ALTER TABLE jobs ADD COLUMN reserved_at DATETIME;
+        UPDATE jobs SET reserved_at = CURRENT_TIMESTAMP WHERE reserved_by IS NOT NULL;
+    )";
+    if (sqlite3_exec(db, alter_sql, nullptr, nullptr, &errMsg) != SQLITE_OK)
+    {
+        spdlog::error("Failed to add the reserved_at column: {}", errMsg);
+        sqlite3_free(errMsg);
+        return false;
+    }
+    spdlog::info("Added the reserved_at column to table 'jobs'");
+    return true;
+}
+
+// Drop the reservations whose lease expired, e.g. because their worker was killed. Leases are
+// stored in whole seconds, so this runs at most once a second. Returns the number of dropped
+// reservations. Must be called with db_mutex held
+size_t SqliteQueue::expire_leases()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now - leases_checked < std::chrono::seconds(1))
+    {
+        return 0;
+    }
+    leases_checked = now;
+    sqlite3_stmt *stmt;
+    const char *sql = R"(
+        UPDATE jobs
+        SET reserved_by = NULL, reserved_at = NULL
+        WHERE state = 'waiting' AND reserved_by IS NOT NULL AND reserved_at < ?;
+    )";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        return 0;
+    }
+    // Times are stored in whole seconds. Comparing strictly keeps a lease for at least its full length
+    sqlite3_bind_text(stmt, 1, chrono_to_string(std::chrono::system_clock::now() - lease_timeout).c_str(), -1, SQLITE_TRANSIENT);
+    size_t expired = 0;
+    if (sqlite3_step(stmt) == SQLITE_DONE)
+    {
+        expired = static_cast<size_t>(sqlite3_changes(db));
+    }
+    else
+    {
+        spdlog::error("Failed to expire leases: {}", sqlite3_errmsg(db));
+    }
+    sqlite3_finalize(stmt);
+    if (expired > 0)
+    {
+        spdlog::warn("Handing out {} jobs again whose lease expired", expired);
+    }
+    return expired;
+}
+
+std::vector<std::unique_ptr<Job>> SqliteQueue::claim(const std::string &worker_id, size_t max_jobs)
+{
+    std::vector<std::unique_ptr<Job>> jobs;
+    std::lock_guard<std::mutex> lock{db_mutex};
+    expire_leases();
+
+    // SQL statement to reserve the oldest due jobs of one queue for this worker
+    sqlite3_stmt *stmt;
+    std::string sql{R"(
+        UPDATE jobs
+        SET reserved_by = ?, reserved_at = CURRENT_TIMESTAMP
+        WHERE id IN (
+            SELECT id FROM jobs
+            WHERE queue = ?
+            AND reserved_by IS NULL
+            AND state = 'waiting'
+            AND (next_execution_at IS NULL OR next_execution_at <= CURRENT_TIMESTAMP)
+            ORDER BY created_at ASC         -- Retrieve jobs which were created first
+            LIMIT ?
+        )
+        RETURNING )" + job_columns + ";"};
+
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Worker {}. Failed to fetch job from database: {}", worker_id, sqlite3_errmsg(db));
+        return jobs;
+    }
+    // The queues are claimed from in priority order, in one transaction so that a claim is a single write
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Worker {}. Failed to begin transaction: {}", worker_id, sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return jobs;
+    }
+
+    bool claimed = true;
+    std::vector<std::string> corrupt;  // Claimed rows that cannot be executed
+    for (const std::string &queue : queues)
+    {
+        if (jobs.size() >= max_jobs)
+        {
+            break;
+        }
+        // Bind worker_id as a TEXT value
+        sqlite3_bind_text(stmt, 1, worker_id.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, queue.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(max_jobs - jobs.size()));
+        size_t first = jobs.size();
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            if (std::unique_ptr<Job> job = job_from_row(stmt))
+            {
+                jobs.push_back(std::move(job));
+            }
+            else
+            {
+                corrupt.push_back(optional_text(stmt, 0).value_or(""));
+            }
+        }
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE)
+        {
+            spdlog::error("Worker {}. Failed to claim jobs of queue {}: {}", worker_id, queue, sqlite3_errmsg(db));
+            claimed = false;
+            break;
+        }
+        // RETURNING hands out the rows in no particular order
+        std::stable_sort(jobs.begin() + first, jobs.end(), [](const std::unique_ptr<Job> &a, const std::unique_ptr<Job> &b)
+                         { return a->get_created_at() < b->get_created_at(); });
+    }
+    sqlite3_finalize(stmt);
+
+    // Jobs whose arguments cannot be read would be claimed over and over, so they are failed right away
+    if (claimed && !corrupt.empty())
+    {
+        const char *fail_sql = "UPDATE jobs SET state = 'failed', reserved_by = NULL, error_details = 'Corrupt arguments' WHERE id = ?;";
+        if (sqlite3_prepare_v2(db, fail_sql, -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            spdlog::error("Worker {}. Failed to prepare statement: {}", worker_id, sqlite3_errmsg(db));
+            claimed = false;
+        }
+        else
+        {
+            for (const std::string &id : corrupt)
+            {
+                sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
+                if (sqlite3_step(stmt) != SQLITE_DONE)
+                {
+                    spdlog::error("Worker {}. Failed to fail job {}: {}", worker_id, id, sqlite3_errmsg(db));
+                    claimed = false;
+                    break;
+                }
+                sqlite3_reset(stmt);
+            }
+            sqlite3_finalize(stmt);
+        }
+    }
+
+    if (!claimed || sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        if (claimed)
+        {
+            spdlog::error("Worker {}. Failed to commit claim: {}", worker_id, sqlite3_errmsg(db));
+        }
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        jobs.clear();
+    }
+    return jobs;
+}
+
+// Write only the columns changed since the job was claimed. Name, args and created_at, which make
+// up most of a row, are never rewritten by a state transition
+SaveResult SqliteQueue::update_fields(const Job &job)
+{
+    unsigned dirty = job.get_dirty_fields();
+    if (dirty == 0)
+    {
+        return SaveResult::saved;
+    }
+    std::string sql{"UPDATE jobs SET "};
+    for (const auto &[field, column] : state_columns)
+    {
+        if (dirty & field)
+        {
+            sql.append(column).append(" = ?, ");
+        }
+    }
+    sql.resize(sql.size() - 2);
+    sql.append(" WHERE id = ?");
+    // A worker whose lease expired must not overwrite the job once another worker claimed it
+    std::optional<std::string> claimed_by{job.get_claimed_by()};
+    sql.append(claimed_by ? " AND reserved_by = ?;" : ";");
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}, job id = {}", sqlite3_errmsg(db), job.get_id());
+        return SaveResult::failed;
+    }
+    int index = 1;
+    for (const auto &[field, column] : state_columns)
+    {
+        if (dirty & field)
+        {
+            bind_field(stmt, index++, job, field);
+        }
+    }
+    sqlite3_bind_text(stmt, index, job.get_id().c_str(), -1, SQLITE_TRANSIENT);
+    if (claimed_by)
+    {
+        sqlite3_bind_text(stmt, index + 1, claimed_by->c_str(), -1, SQLITE_TRANSIENT);
+    }
+
+    SaveResult result = SaveResult::saved;
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+    {
+        spdlog::error("Failed to update job: {}, job id = {}", sqlite3_errmsg(db), job.get_id());
+        result = SaveResult::failed;
+    }
+    else if (sqlite3_changes(db) == 0)
+    {
+        result = lost_or_missing(job);
+    }
+    sqlite3_finalize(stmt);
+    return result;
+}
+
+SaveResult SqliteQueue::lost_or_missing(const Job &job)
+{
+    if (job.get_claimed_by())
+    {
+        spdlog::warn("Worker {} lost the lease of job {}, its result is discarded", *job.get_claimed_by(), job.get_id());
+        return SaveResult::lease_lost;
+    }
+    spdlog::error("Failed to update job: not found, job id = {}", job.get_id());
+    return SaveResult::failed;
+}
+
+SaveResult SqliteQueue::ack(const Job &job)
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    return update_fields(job);
+}
+
+SaveResult SqliteQueue::nack(const Job &job)
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    return update_fields(job);
+}
+
+SaveResult SqliteQueue::schedule(const Job &job, std::chrono::system_clock::time_point at)
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    sqlite3_stmt *stmt;
+    std::string sql{R"(
+        UPDATE jobs
+        SET state = 'waiting', reserved_by = NULL, reserved_at = NULL, next_execution_at = ?,
+            attempts = ?, last_executed_at = ?, error_details = ?
+        WHERE id = ?)"};
+    std::optional<std::string> claimed_by{job.get_claimed_by()};
+    sql.append(claimed_by ? " AND reserved_by = ?;" : ";");
+
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}, job id = {}", sqlite3_errmsg(db), job.get_id());
+        return SaveResult::failed;
+    }
+    sqlite3_bind_text(stmt, 1, chrono_to_string(at).c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 2, job.get_attempts());
+    bind_optional_time(stmt, 3, job.get_last_executed_at());
+    bind_optional_text(stmt, 4, job.get_error_details());
+    sqlite3_bind_text(stmt, 5, job.get_id().c_str(), -1, SQLITE_TRANSIENT);
+    if (claimed_by)
+    {
+        sqlite3_bind_text(stmt, 6, claimed_by->c_str(), -1, SQLITE_TRANSIENT);
+    }
+
+    SaveResult result = SaveResult::saved;
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+    {
+        spdlog::error("Failed to schedule job: {}, job id = {}", sqlite3_errmsg(db), job.get_id());
+        result = SaveResult::failed;
+    }
+    else if (sqlite3_changes(db) == 0)
+    {
+        result = lost_or_missing(job);
+    }
+    sqlite3_finalize(stmt);
+    return result;
+}
+
+size_t SqliteQueue::release(const std::vector<const Job *> &jobs)
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    // One transaction for all jobs, so that a shutdown costs a single write
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to begin transaction: {}", sqlite3_errmsg(db));
+        return 0;
+    }
+    sqlite3_stmt *stmt;
+    const char *sql = "UPDATE jobs SET reserved_by = NULL, reserved_at = NULL WHERE id = ? AND reserved_by = ?;";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        return 0;
+    }
+
+    // Claims do not touch created_at, so the jobs keep their place in the claim order
+    size_t released = 0;
+    for (const Job *job : jobs)
+    {
+        sqlite3_bind_text(stmt, 1, job->get_id().c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, job->get_reserved_by().value_or("").c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) == SQLITE_DONE)
+        {
+            released += static_cast<size_t>(sqlite3_changes(db));
+        }
+        else
+        {
+            spdlog::error("Failed to release job: {}, job id = {}", sqlite3_errmsg(db), job->get_id());
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+    sqlite3_finalize(stmt);
+    if (sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to commit released jobs: {}", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        return 0;
+    }
+    return released;
+}
+
+size_t SqliteQueue::renew(const std::string &worker_id, const std::vector<std::string> &job_ids)
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to begin transaction: {}", sqlite3_errmsg(db));
+        return 0;
+    }
+    sqlite3_stmt *stmt;
+    const char *sql = "UPDATE jobs SET reserved_at = CURRENT_TIMESTAMP WHERE id = ? AND reserved_by = ? AND state = 'waiting';";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        return 0;
+    }
+
+    size_t renewed = 0;
+    for (const std::string &id : job_ids)
+    {
+        sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, worker_id.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) == SQLITE_DONE)
+        {
+            renewed += static_cast<size_t>(sqlite3_changes(db));
+        }
+        else
+        {
+            spdlog::error("Failed to renew lease: {}, job id = {}", sqlite3_errmsg(db), id);
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+    sqlite3_finalize(stmt);
+    if (sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to commit renewed leases: {}", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        return 0;
+    }
+    return renewed;
+}
+
+bool SqliteQueue::sync()
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    // Commits are durable already, copy the write-ahead log back into the database file so that
+    // the next process does not have to replay it
+    if (sqlite3_wal_checkpoint_v2(db, nullptr, SQLITE_CHECKPOINT_PASSIVE, nullptr, nullptr) != SQLITE_OK)
+    {
+        spdlog::warn("Failed to checkpoint {}: {}", path, sqlite3_errmsg(db));
+        return false;
+    }
+    return true;
+}
+
+size_t SqliteQueue::depth(const std::string &queue)
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    sqlite3_stmt *stmt;
+    const char *sql = "SELECT COUNT(*) FROM jobs WHERE state = 'waiting' AND reserved_by IS NULL AND queue = ?;";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, queue.c_str(), -1, SQLITE_TRANSIENT);
+
+    size_t count = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        count = static_cast<size_t>(sqlite3_column_int64(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    return count;
+}
+
+std::optional<IdempotencyKey> SqliteQueue::enqueue_once(const Job &job, const std::string &idempotency_key)
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    std::string id{job.get_id()};
+
+    // Take the key and store the job in one transaction, so a key never points to a missing job
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to begin transaction: {}, job id = {}", sqlite3_errmsg(db), id);
+        return std::nullopt;
+    }
+
+    sqlite3_stmt *stmt;
+    const char *sql = R"(
+        INSERT INTO idempotency_keys (key, job_id, created_at) VALUES (?, ?, ?)
+        ON CONFLICT(key) DO NOTHING;
+    )";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}, job id = {}", sqlite3_errmsg(db), id);
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        return std::nullopt;
+    }
+    sqlite3_bind_text(stmt, 1, idempotency_key.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 3, std::chrono::duration_cast<std::chrono::seconds>(job.get_created_at().time_since_epoch()).count());
+    bool inserted = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_finalize(stmt);
+    if (!inserted)
+    {
+        spdlog::error("Failed to store idempotency key: {}, job id = {}", sqlite3_errmsg(db), id);
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        return std::nullopt;
+    }
+
+    std::optional<IdempotencyKey> holder;
+    if (sqlite3_changes(db) == 1)
+    {
+        if (upsert(job))
+        {
+            holder = IdempotencyKey{id, job.get_created_at()};
+        }
+    }
+    else if (sqlite3_prepare_v2(db, "SELECT job_id, created_at FROM idempotency_keys WHERE key = ?;", -1, &stmt, nullptr) == SQLITE_OK)
+    {
+        // The key is taken, report the job that holds it
+        sqlite3_bind_text(stmt, 1, idempotency_key.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            holder = IdempotencyKey{reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)),
+                                    std::chrono::system_clock::time_point{std::chrono::seconds{sqlite3_column_int64(stmt, 1)}}};
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    if (!holder || sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to enqueue job with idempotency key: {}, job id = {}", sqlite3_errmsg(db), id);
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        return std::nullopt;
+    }
+    return holder;
+}
+
+size_t SqliteQueue::expire_idempotency_keys(std::chrono::system_clock::time_point before)
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "DELETE FROM idempotency_keys WHERE created_at < ?;", -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        return 0;
+    }
+    sqlite3_bind_int64(stmt, 1, std::chrono::duration_cast<std::chrono::seconds>(before.time_since_epoch()).count());
+
+    size_t expired = 0;
+    if (sqlite3_step(stmt) == SQLITE_DONE)
+    {
+        expired = static_cast<size_t>(sqlite3_changes(db));
+    }
+    else
+    {
+        spdlog::error("Failed to expire idempotency keys: {}", sqlite3_errmsg(db));
+    }
+    sqlite3_finalize(stmt);
+    return expired;
+}
+
+std::unique_ptr<Job> SqliteQueue::get_job(const std::string &id)
+{
+    std::lock_guard<std::mutex> lock{db_mutex};
+    sqlite3_stmt *stmt;
+    std::string sql{"SELECT " + job_columns + " FROM jobs WHERE id = ?;"};
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}, job id = {}", sqlite3_errmsg(db), id);
+        return nullptr;
+    }
+    sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
+
+    std::unique_ptr<Job> job;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        job = job_from_row(stmt);
+    }
+    sqlite3_finalize(stmt);
+    return job;
+}
+
+std::vector<std::unique_ptr<Job>> SqliteQueue::list_jobs(const JobQuery &query)
+{
+    std::vector<std::unique_ptr<Job>> jobs;
+    std::string sql{"SELECT " + job_columns + " FROM jobs WHERE 1"};
+    bool bind_state = false;
+    if (query.state == "waiting" || query.state == "running")
+    {
+        // Reserved jobs keep the waiting state until they are finished
+        sql += query.state == "waiting" ? " AND state = 'waiting' AND reserved_by IS NULL" : " AND state = 'waiting' AND reserved_by IS NOT NULL";
+    }
+    else if (query.state)
+    {
+        sql += " AND state = ?1";
+        bind_state = true;
+    }
+    if (query.queue)
+    {
+        sql += " AND queue = ?2";
+    }
+    sql += " ORDER BY created_at DESC, id LIMIT ?3 OFFSET ?4;";
+
+    std::lock_guard<std::mutex> lock{db_mutex};
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        return jobs;
+    }
+    if (bind_state)
+    {
+        sqlite3_bind_text(stmt, 1, query.state->c_str(), -1, SQLITE_TRANSIENT);
+    }
+    if (query.queue)
+    {
+        sqlite3_bind_text(stmt, 2, query.queue->c_str(), -1, SQLITE_TRANSIENT);
+    }
+    sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(query.limit));
+    sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(query.offset));
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        if (std::unique_ptr<Job> job = job_from_row(stmt))
+        {
+            jobs.push_back(std::move(job));
+        }
+    }
+    sqlite3_finalize(stmt);
+    return jobs;
+}
@@ -0,0 +1,218 @@
+#include "../include/trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <fmt/format.h>
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+
+std::atomic<bool> tracing_enabled{false};
+
+namespace
+{
+const size_t buffer_events = 4096;      // Events a thread buffers before writing them out
+
+struct TraceEvent
+{
+    const char *name;
+    const char *category;
+    char phase;                         // X: span of a thread, b/e: begin and end of an async span
+    int64_t timestamp;
+    int64_t duration;
+    std::string id;
+};
+
+struct ThreadBuffer
+{
+    std::mutex mutex;                   // Only contended while trace_close() drains the buffer
+    int tid;
+    std::vector<TraceEvent> events;
+};
+
+std::mutex file_mutex;
+std::FILE *trace_file = nullptr;
+bool first_event = true;
+std::string line;                       // Reused to format events, guarded by file_mutex
+
+std::mutex buffers_mutex;
+std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+int next_tid = 1;
+
+void write_events(int tid, std::vector<TraceEvent> &events)
+{
+    std::lock_guard<std::mutex> lock{file_mutex};
+    if (trace_file == nullptr)
+    {
+        events.clear();
+        return;
+    }
+    for (const TraceEvent &event : events)
+    {
+        line.clear();
+        fmt::format_to(std::back_inserter(line), "{}{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"{}\",\"ts\":{},\"pid\":{},\"tid\":{}",
+                       first_event ? "" : ",\n", event.name, event.category, event.phase, event.timestamp, getpid(), tid);
+        if (event.phase == 'X')
+        {
+            fmt::format_to(std::back_inserter(line), ",\"dur\":{}", event.duration);
+            if (!event.id.empty())
+            {
+                line.append(",\"args\":{\"job\":").append(nlohmann::json(event.id).dump()).append("}");
+            }
+        }
+        else
+        {
+            line.append(",\"id\":").append(nlohmann::json(event.id).dump());
+        }
+        line.append("}");
+        std::fwrite(line.data(), 1, line.size(), trace_file);
+        first_event = false;
+    }
+    events.clear();
+}
+
+// Flushes the buffer of a thread when the thread exits and forgets it, since the autoscaler keeps
+// starting and retiring worker threads
+struct LocalBuffer
+{
+    std::shared_ptr<ThreadBuffer> buffer;
+
+    ~LocalBuffer()
+    {
+        if (buffer)
+        {
+            {
+                std::lock_guard<std::mutex> lock{buffer->mutex};
+                write_events(buffer->tid, buffer->events);
+            }
+            std::lock_guard<std::mutex> lock{buffers_mutex};
+            buffers.erase(std::remove(buffers.begin(), buffers.end(), buffer), buffers.end());
+        }
+    }
+};
+
+thread_local LocalBuffer local;
+
+ThreadBuffer &thread_buffer()
+{
+    if (!local.buffer)
+    {
+        local.buffer = std::make_shared<ThreadBuffer>();
+        local.buffer->events.reserve(buffer_events);
+        std::lock_guard<std::mutex> lock{buffers_mutex};
+        local.buffer->tid = next_tid++;
+        buffers.push_back(local.buffer);
+    }
+    return *local.buffer;
+}
+
+void record(TraceEvent event)
+{
+    ThreadBuffer &buffer = thread_buffer();
+    std::lock_guard<std::mutex> lock{buffer.mutex};
+    buffer.events.push_back(std::move(event));
+    if (buffer.events.size() >= buffer_events)
+    {
+        write_events(buffer.tid, buffer.events);
+    }
+}
+}
+
+bool trace_open(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock{file_mutex};
+    trace_file = std::fopen(path.c_str(), "w");
+    if (trace_file == nullptr)
+    {
+        spdlog::error("Failed to open trace file {}", path);
+        return false;
+    }
+    // JSON array format, the closing bracket is written by trace_close()
+    std::fputs("[\n", trace_file);
+    first_event = true;
+    tracing_enabled = true;
+    spdlog::info("Writing job traces to {}", path);
+    return true;
+}
+
+void trace_close()
+{
+    if (!trace_enabled())
+    {
+        return;
+    }
+    tracing_enabled = false;
+    {
+        std::lock_guard<std::mutex> lock{buffers_mutex};
+        for (const std::shared_ptr<ThreadBuffer> &buffer : buffers)
+        {
+            std::lock_guard<std::mutex> buffer_lock{buffer->mutex};
+            write_events(buffer->tid, buffer->events);
+        }
+    }
+    std::lock_guard<std::mutex> lock{file_mutex};
+    std::fputs("\n]\n", trace_file);
+    std::fclose(trace_file);
+    trace_file = nullptr;
+}
+
+int64_t trace_now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void trace_thread_name(const std::string &name)
+{
+    if (!trace_enabled())
+    {
+        return;
+    }
+    // Metadata events need args of their own, so they are written right away
+    int tid = thread_buffer().tid;
+    std::lock_guard<std::mutex> lock{file_mutex};
+    if (trace_file == nullptr)
+    {
+        return;
+    }
+    std::string event = fmt::format("{}{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":{},\"tid\":{},\"args\":{{\"name\":{}}}}}",
+                                    first_event ? "" : ",\n", getpid(), tid, nlohmann::json(name).dump());
+    std::fwrite(event.data(), 1, event.size(), trace_file);
+    first_event = false;
+}
+
+void trace_complete(const char *name, const char *category, int64_t start_us, int64_t duration_us, const std::string &id)
+{
+    if (trace_enabled())
+    {
+        record(TraceEvent{name, category, 'X', start_us, duration_us, id});
+    }
+}
+
+void trace_async(const char *name, const char *category, const std::string &id, int64_t start_us, int64_t end_us)
+{
+    if (trace_enabled())
+    {
+        record(TraceEvent{name, category, 'b', start_us, 0, id});
+        record(TraceEvent{name, category, 'e', end_us, 0, id});
+    }
+}
+
+// TraceSpan
+TraceSpan::TraceSpan(const char *name_, const char *category_, const std::string *id_) : name{name_},
+                                                                                          category{category_},
+                                                                                          id{id_},
+                                                                                          start{trace_enabled() ? trace_now() : 0}
+{
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (start != 0 && trace_enabled())
+    {
+        static const std::string no_id;
+        trace_complete(name, category, start, trace_now() - start, id ? *id : no_id);
+    }
+}
@@ -0,0 +1,200 @@
+#include "../include/wakeup.h"
+#include "../include/randomhex.h"
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+const char *socket_prefix = "worker-";
+const char *socket_suffix = ".sock";
+
+// Returns false if the path does not fit into sun_path
+bool make_address(const std::string &path, sockaddr_un &address)
+{
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// Whether a process still receives on the socket at address. A full receive buffer counts as listening
+bool is_listening(const sockaddr_un &address)
+{
+    int probe_fd = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (probe_fd < 0)
+    {
+        return true;
+    }
+    bool listening = ::sendto(probe_fd, "", 0, MSG_DONTWAIT, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0 ||
+                     errno == EAGAIN || errno == EWOULDBLOCK;
+    ::close(probe_fd);
+    return listening;
+}
+}
+
+// WakeupNotifier
+WakeupNotifier::WakeupNotifier(const std::string &directory_) : directory{directory_}
+{
+    socket_fd = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0)
+    {
+        spdlog::error("Failed to create wakeup socket: {}", std::strerror(errno));
+    }
+}
+
+WakeupNotifier::~WakeupNotifier()
+{
+    if (socket_fd >= 0)
+    {
+        ::close(socket_fd);
+    }
+}
+
+void WakeupNotifier::scan()
+{
+    peers.clear();
+    std::error_code error;
+    for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(directory, error))
+    {
+        std::string name{entry.path().filename().string()};
+        if (name.rfind(socket_prefix, 0) != 0 || name.size() <= std::strlen(socket_suffix) ||
+            name.compare(name.size() - std::strlen(socket_suffix), std::string::npos, socket_suffix) != 0)
+        {
+            continue;
+        }
+        sockaddr_un address;
+        if (make_address(entry.path().string(), address))
+        {
+            peers.push_back(address);
+        }
+    }
+    scanned_at = std::chrono::steady_clock::now();
+}
+
+void WakeupNotifier::notify()
+{
+    if (socket_fd < 0)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock{peers_mutex};
+    if (std::chrono::steady_clock::now() - scanned_at >= std::chrono::seconds(1))
+    {
+        scan();
+    }
+    for (auto it = peers.begin(); it != peers.end();)
+    {
+        if (::sendto(socket_fd, "", 0, MSG_DONTWAIT, reinterpret_cast<const sockaddr *>(&*it), sizeof(sockaddr_un)) < 0 &&
+            (errno == ECONNREFUSED || errno == ENOENT))
+        {
+            // Nobody listens anymore, the process exited without removing its socket
+            if (errno == ECONNREFUSED)
+            {
+                ::unlink(it->sun_path);
+            }
+            it = peers.erase(it);
+            continue;
+        }
+        // EAGAIN means the listener has wakeups pending already
+        ++it;
+    }
+}
+
+// WakeupListener
+WakeupListener::WakeupListener(const std::string &directory, std::function<void()> on_wakeup_) : socket_fd{-1},
+                                                                                                on_wakeup{std::move(on_wakeup_)},
+                                                                                                stopping{false}
+{
+    // Pids repeat across PID namespaces sharing the directory, e.g. containers, so a random part keeps the names apart
+    std::string name{socket_prefix + std::to_string(::getpid()) + "-" + generateHex(8) + socket_suffix};
+    path = (std::filesystem::path(directory) / name).string();
+}
+
+WakeupListener::~WakeupListener()
+{
+    stop();
+}
+
+bool WakeupListener::start()
+{
+    sockaddr_un address;
+    if (!make_address(path, address))
+    {
+        spdlog::error("Wakeup socket path {} is too long", path);
+        return false;
+    }
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+    // A socket of the same name is only replaced if nobody receives on it anymore
+    if (std::filesystem::exists(path, error))
+    {
+        if (is_listening(address))
+        {
+            spdlog::error("Wakeup socket {} is in use by another process", path);
+            return false;
+        }
+        ::unlink(path.c_str());
+    }
+    socket_fd = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0 || ::bind(socket_fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        spdlog::error("Failed to bind wakeup socket {}: {}", path, std::strerror(errno));
+        if (socket_fd >= 0)
+        {
+            ::close(socket_fd);
+            socket_fd = -1;
+        }
+        return false;
+    }
+    stopping = false;
+    thread = std::thread(&WakeupListener::run, this);
+    spdlog::info("Listening for wakeups on {}", path);
+    return true;
+}
+
+void WakeupListener::stop()
+{
+    stopping = true;
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+    if (socket_fd >= 0)
+    {
+        ::close(socket_fd);
+        ::unlink(path.c_str());
+        socket_fd = -1;
+    }
+}
+
+void WakeupListener::run()
+{
+    char buffer[16];
+    while (!stopping)
+    {
+        pollfd fd{socket_fd, POLLIN, 0};
+        if (poll(&fd, 1, 200) <= 0)
+        {
+            continue;
+        }
+        // One callback for all wakeups that arrived in the meantime
+        bool woken = false;
+        while (::recv(socket_fd, buffer, sizeof(buffer), MSG_DONTWAIT) >= 0)
+        {
+            woken = true;
+        }
+        if (woken)
+        {
+            on_wakeup();
+        }
+    }
+}
@@ -1,181 +1,462 @@
 #include "../include/worker.h"
+#include "../include/trace.h"
 
+#include <algorithm>
 #include <chrono>
 #include <spdlog/spdlog.h>
-#include <unistd.h>
 
 // Atomic flag to stop workers gracefully
 std::atomic<bool> stopWorkers{false};
 
-Worker::Worker(const QueueableRegistry &registry_, std::optional<json> credentials) : registry{&registry_}, smtp_credentials{credentials}
+namespace
 {
-    polling_interval = 5; // Check for new jobs every 5s
-    worker_id = "wrk_" + generateHex(8);
+// Whether the handler gave the job back instead of executing it, see JobDeferred
+bool is_deferred(const std::exception_ptr &error)
+{
+    try
+    {
+        std::rethrow_exception(error);
+    }
+    catch (const JobDeferred &)
+    {
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
 }
 
-Worker::~Worker()
+// Whether the job failed for a reason that may pass, see JobRetry
+bool is_retryable(const std::exception_ptr &error)
 {
-    // Close the database connection if an error occurs or if the worker is destroyed
-    if (db)
+    try
     {
-        sqlite3_close_v2(db);
-        db = nullptr;
-        spdlog::info("Shut down database connection: Worker {}", worker_id);
+        std::rethrow_exception(error);
+    }
+    catch (const JobRetry &)
+    {
+        return true;
+    }
+    catch (...)
+    {
+        return false;
     }
 }
+}
+
+Worker::Worker(const QueueableRegistryBase &registry_,
+               QueueBackend &backend_,
+               const JobContext &context_,
+               JobStatusCache *status_cache_,
+               std::chrono::milliseconds polling_interval_,
+               size_t batch_size_,
+               int max_attempts_,
+               std::chrono::milliseconds retry_delay_) : polling_interval{polling_interval_},
+                                     batch_size{std::max<size_t>(batch_size_, 1)},
+                                     max_attempts{std::max(max_attempts_, 1)},
+                                     retry_delay{retry_delay_},
+                                                               backend{&backend_},
+                                                               registry{&registry_},
+                                                               context{context_},
+                                                               status_cache{status_cache_},
+                                                               stopping{false},
+                                                               stopped{false},
+                                                               woken{false}
+{
+    worker_id = "wrk_" + generateHex(8);
+    TraceSpan span{"create handlers", "worker"};
+    handlers = registry->create_handlers(context);
+}
+
+Worker::~Worker()
+{
+}
 
 
 void Worker::run()
 {
     spdlog::info("Worker {} ready", worker_id);
-    if (sqlite3_open("database.db", &db) != SQLITE_OK)
-    {
-        spdlog::error("Failed to open database. Worker id = {}", worker_id);
-        return;
-    }
-    else{
-        spdlog::info("Established database connection: worker {}", worker_id);
-    }
-    int counter = 0;
+    trace_thread_name("worker " + worker_id);
+    // An idle worker backs off from a short wait up to the polling interval, so that it reacts
+    // quickly at the end of a burst but hardly wakes up while the queue stays empty
+    const std::chrono::milliseconds min_wait{std::min(polling_interval, std::chrono::milliseconds(50))};
+    std::chrono::milliseconds idle_wait{min_wait};
     do
     {
-        std::unique_ptr<Job> job = next_job(db);
-        if (job != 0)
+        std::vector<std::unique_ptr<Job>> jobs = next_jobs();
+        if (!jobs.empty())
         {
-            spdlog::info("Worker {} executing job: {} with name = {}", worker_id, job->get_id(), job->get_name());
-            execute_job(*job);
-            cleanup_job(*job);
-            counter += 1;
+            hold_leases(jobs);
+            execute_batch(jobs); // Records the outcomes through cleanup_job
+            hold_leases({});
+            idle_wait = min_wait;
         }
         else
         {
-            sleep(polling_interval);
-            counter += 1;
+            std::unique_lock<std::mutex> lock{wake_mutex};
+            wake_condition.wait_for(lock, idle_wait, [this]
+                                    { return stopping || woken; });
+            idle_wait = woken ? min_wait : std::min(idle_wait * 2, polling_interval);
+            woken = false;
         }
-    } while (!stopWorkers);
-    spdlog::info("Worker {} shutting down connection to database", worker_id);
+    } while (!stopWorkers && !stopping);
     spdlog::info("Shutting down Worker {}", worker_id);
+    stopped = true;
+}
+
+void Worker::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock{wake_mutex};
+        stopping = true;
+    }
+    wake_condition.notify_all();
+}
+
+void Worker::wake()
+{
+    {
+        std::lock_guard<std::mutex> lock{wake_mutex};
+        woken = true;
+    }
+    wake_condition.notify_all();
+}
+
+void Worker::hold_leases(const std::vector<std::unique_ptr<Job>> &jobs)
+{
+    std::lock_guard<std::mutex> lock{lease_mutex};
+    leased.clear();
+    for (const std::unique_ptr<Job> &job : jobs)
+    {
+        leased.push_back(job->get_id());
+    }
+    leased_at = std::chrono::steady_clock::now();
+}
+
+void Worker::renew_leases(std::chrono::milliseconds older_than)
+{
+    std::vector<std::string> ids;
+    {
+        std::lock_guard<std::mutex> lock{lease_mutex};
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (leased.empty() || now - leased_at < older_than)
+        {
+            return;
+        }
+        ids = leased;
+        leased_at = now;
+    }
+    // Jobs finished in the meantime are no longer reserved and are skipped by the backend
+    size_t renewed = backend->renew(worker_id, ids);
+    spdlog::info("Worker {}. Renewed the leases of {} of {} jobs", worker_id, renewed, ids.size());
+}
+
+bool Worker::is_stopped() const
+{
+    return stopped;
+}
+
+const WorkerStats &Worker::get_stats() const
+{
+    return stats;
 }
 
-std::unique_ptr<Job> Worker::next_job(sqlite3 *db){
-    // SQL statement to retrieve job from database
-    sqlite3_stmt *stmt;
-    const char *sql = R"(
-        UPDATE Jobs 
-        SET reserved_by = ? 
-        WHERE id = (
-            SELECT id FROM jobs 
-            WHERE reserved_by IS NULL 
-            AND state = 'waiting'
-            AND (next_execution_at IS NULL OR next_execution_at <= CURRENT_TIMESTAMP)
-            ORDER BY created_at ASC         -- Retrieve job which was created first
-            LIMIT 1
-        )
-        RETURNING id, args, name, state;
-    )";
-
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK)
-    {
-        // Bind worker_id as a TEXT value
-        sqlite3_bind_text(stmt, 1, worker_id.c_str(), -1, SQLITE_STATIC);
-        if (sqlite3_step(stmt) == SQLITE_ROW)
+std::vector<std::unique_ptr<Job>> Worker::next_jobs()
+{
+    int64_t claim_started = trace_enabled() ? trace_now() : 0;
+    std::vector<std::unique_ptr<Job>> jobs = backend->claim(worker_id, batch_size);
+    if (claim_started != 0 && !jobs.empty())
+    {
+        int64_t claimed = trace_now();
+        trace_complete("claim", "worker", claim_started, claimed - claim_started, jobs.front()->get_id());
+        for (const std::unique_ptr<Job> &job : jobs)
         {
-            std::string id = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-            std::string args_str = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-            json args = nlohmann::json::parse(args_str);
-            std::string name = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
-            std::unique_ptr<Job> job{new Job{id, args, name}};
-            spdlog::info("Worker {}. Fetched next job: {}", worker_id, job->get_id());
-            sqlite3_finalize(stmt);
-            return job;
+            int64_t created = std::chrono::duration_cast<std::chrono::microseconds>(job->get_created_at().time_since_epoch()).count();
+            trace_async("queued", "job", job->get_id(), std::min(created, claim_started), claimed);
         }
-        else
+    }
+    if (jobs.empty())
+    {
+        spdlog::debug("Worker {}. No pending jobs found.", worker_id);
+        return jobs;
+    }
+    spdlog::info("Worker {}. Fetched {} jobs, first: {}", worker_id, jobs.size(), jobs.front()->get_id());
+    if (status_cache)
+    {
+        for (const std::unique_ptr<Job> &job : jobs)
         {
-            spdlog::warn("Worker {}. No pending jobs found.", worker_id);
-            sqlite3_finalize(stmt);
-            return nullptr;
+            status_cache->update(*job);
         }
     }
-    else
+    return jobs;
+}
+
+Queueable *Worker::find_handler(Job &job)
+{
+    // Jobs stored without a type id are resolved by their name once
+    int type_id{job.get_type_id()};
+    if (type_id == 0)
+    {
+        type_id = registry->lookup_type_id(job.get_name());
+        job.set_type_id(type_id);
+    }
+    Queueable *handler = (type_id > 0 && static_cast<size_t>(type_id) < handlers.size()) ? handlers[type_id].get() : nullptr;
+    if (handler == nullptr)
+    {
+        spdlog::error("Worker {} could not execute job with id = {}, class name = {} not registered", worker_id, job.get_id(), job.get_name());
+        std::string error_msg = "Could not execute job of type " + job.get_name() + " since it was not registered";
+        job.set_error_details(error_msg);
+        cleanup_job(job, false);
+    }
+    return handler;
+}
+
+void Worker::fail_job(Job &job, const std::exception_ptr &error)
+{
+    try
+    {
+        std::rethrow_exception(error);
+    }
+    catch (const std::exception &e)
+    {
+        spdlog::error("Worker {} could not execute job with id = {}, caught exception with message '{}'", worker_id, job.get_id(), e.what());
+        std::string error_msg = "Could not execute job of type " + job.get_name() + ", caught exception of type " + e.what();
+        job.set_error_details(error_msg);
+    }
+    catch (...)
+    {
+        spdlog::error("Worker {} could not execute job with id = {}, caught exception of unknown type", worker_id, job.get_id());
+        std::string error_msg = "Could not execute job of type " + job.get_name() + ", caught exception of unknown type.";
+        job.set_error_details(error_msg);
+    }
+    cleanup_job(job, false);
+}
+
+void Worker::retry_job(Job &job, const std::exception_ptr &error)
+{
+    if (job.get_attempts() + 1 >= max_attempts)
+    {
+        fail_job(job, error);
+        return;
+    }
+    std::string reason;
+    try
+    {
+        std::rethrow_exception(error);
+    }
+    catch (const std::exception &e)
+    {
+        reason = e.what();
+    }
+    job.set_reserved_by(std::nullopt);
+    job.increase_attempts();
+    job.set_latest_attempt_to_now();
+    job.set_state("waiting");
+    job.set_error_details(reason);
+    // The delay doubles with every attempt, so a server that stays unavailable is not hammered
+    std::chrono::milliseconds delay{retry_delay * (1LL << std::min(job.get_attempts() - 1, 20))};
+    std::chrono::system_clock::time_point at{std::chrono::system_clock::now() + delay};
+    job.set_next_attempt(at);
+    spdlog::warn("Worker {}. Job {} will be retried in {} ms after attempt {}: {}", worker_id, job.get_id(), delay.count(), job.get_attempts(), reason);
+    SaveResult saved = backend->schedule(job, at);
+    if (saved == SaveResult::lease_lost)
     {
-        spdlog::error("Worker {}. Failed to fetch job from database.", worker_id);
-        return nullptr;
+        return; // Another worker claimed the job again and reports its status from now on
     }
+    if (saved == SaveResult::saved)
+    {
+        job.clear_dirty();
+    }
+    if (status_cache)
+    {
+        status_cache->update(job);
+    }
+}
 
-    sqlite3_finalize(stmt);
-    return nullptr;
+void Worker::job_failed(Job &job, const std::exception_ptr &error)
+{
+    stats.failures += 1;
+    if (is_retryable(error))
+    {
+        retry_job(job, error);
+        return;
+    }
+    fail_job(job, error);
 }
 
 void Worker::execute_job(Job &job)
 {
-    std::string name{job.get_name()};
-    // Create the object which performs the task and handle possible exceptions that are thrown during creation
+    TraceSpan span{"execute", "worker", &job.get_id()};
+    Queueable *handler = find_handler(job);
+    if (handler == nullptr)
+    {
+        return;
+    }
+
+    // Execute the task with the handler of this worker and handle possible exceptions that are thrown
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    std::exception_ptr error;
     try
     {
-        std::unique_ptr<Queueable> q = registry->createQueueable(name);
-        if (name=="SendEmail")
-        {
-            spdlog::info("Worker {} sending email", worker_id);
-            q->handle(job.get_args(), smtp_credentials);
-        }
-        else
+        handler->handle(job.get_args());
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    stats.busy_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+    stats.jobs += 1;
+    if (error && is_deferred(error))
+    {
+        release_jobs({&job});
+        return;
+    }
+    if (error)
+    {
+        job_failed(job, error);
+        return;
+    }
+    spdlog::info("Worker {}. Processed job id = {}, result = succeeded, name = {}", worker_id, job.get_id(), job.get_name());
+    cleanup_job(job);
+}
+
+void Worker::execute_batch(std::vector<std::unique_ptr<Job>> &jobs)
+{
+    std::vector<Job *> released;
+    if (is_draining())
+    {
+        // Claimed while the worker was asked to stop
+        for (std::unique_ptr<Job> &job : jobs)
         {
-            spdlog::info("Executing some other type of job");
-            q->handle(job.get_args()); // Execute task
+            released.push_back(job.get());
         }
-        spdlog::info("Worker {}. Processed job id = {}, result = succeeded, name = {}", worker_id, job.get_id(), job.get_name());
-        cleanup_job(job);
+        release_jobs(released);
+        return;
     }
-    catch (const std::out_of_range &e)
+    if (jobs.size() == 1)
     {
-        spdlog::error("Worker {} could not execute job with id = {}, class name = {} not registered", worker_id, job.get_id(), name);
-        std::string error_msg = "Could not create class with name " + name + " since it was not registered ";
-        job.set_error_details(error_msg);
-        cleanup_job(job, false);
+        spdlog::info("Worker {} executing job: {} with name = {}", worker_id, jobs.front()->get_id(), jobs.front()->get_name());
+        execute_job(*jobs.front());
         return;
     }
-    catch (const std::bad_function_call &e)
+
+    // Jobs of unregistered types are failed here and skipped below
+    std::vector<Queueable *> job_handlers;
+    job_handlers.reserve(jobs.size());
+    for (std::unique_ptr<Job> &job : jobs)
     {
-        spdlog::error("Worker {} could not execute job with id = {}, factory for class with name = {} not properly defined", worker_id, job.get_id(), name);
-        std::string error_msg = "Could not create class with name " + name + " since its factory was not properly defined";
-        job.set_error_details(error_msg);
-        cleanup_job(job, false);
-        return;
+        job_handlers.push_back(find_handler(*job));
     }
-    catch(...)
+
+    std::vector<Job *> group;
+    std::vector<const json *> args;
+    std::vector<std::exception_ptr> errors;
+    size_t next = 0;
+    while (next < jobs.size())
     {
-        std::exception_ptr exPtr = std::current_exception();
-        try 
+        // Collect the run of jobs sharing the handler of the first one
+        Queueable *handler = job_handlers[next];
+        group.clear();
+        while (next < jobs.size() && job_handlers[next] == handler)
+        {
+            group.push_back(jobs[next].get());
+            ++next;
+        }
+        if (handler == nullptr)
+        {
+            continue;
+        }
+        if (is_draining())
+        {
+            // Jobs not started yet go back to the queue, all in one call below
+            released.insert(released.end(), group.begin(), group.end());
+            continue;
+        }
+
+        TraceSpan span{"execute batch", "worker", &group.front()->get_id()};
+        spdlog::info("Worker {} executing {} jobs with name = {}", worker_id, group.size(), group.front()->get_name());
+        args.clear();
+        for (Job *job : group)
+        {
+            args.push_back(&job->get_args());
+        }
+        errors.assign(group.size(), nullptr);
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        try
         {
-            if (exPtr)
+            handler->handle_batch(args, errors);
+        }
+        catch (...)
+        {
+            // A handler failing as a whole fails the jobs it did not decide
+            for (std::exception_ptr &error : errors)
             {
-                std::rethrow_exception(exPtr);
+                error = error ? error : std::current_exception();
             }
         }
-        catch (const std::exception &e)
+        stats.busy_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+        stats.jobs += group.size();
+        for (size_t i = 0; i < group.size(); ++i)
         {
-            spdlog::error("Worker {} could not execute job with id = {}, caught exception with message '{}'", worker_id, job.get_id(), e.what());
-            std::string error_msg = "Could not create class with name " + name + ", caught exception of type " + e.what();
-            job.set_error_details(error_msg);
-            cleanup_job(job, false);
-            return;
+            if (errors[i] && is_deferred(errors[i]))
+            {
+                released.push_back(group[i]);
+            }
+            else if (errors[i])
+            {
+                job_failed(*group[i], errors[i]);
+            }
+            else
+            {
+                spdlog::info("Worker {}. Processed job id = {}, result = succeeded, name = {}", worker_id, group[i]->get_id(), group[i]->get_name());
+                cleanup_job(*group[i]);
+            }
         }
-        catch (...)
+    }
+    if (!released.empty())
+    {
+        release_jobs(released);
+    }
+}
+
+void Worker::release_jobs(const std::vector<Job *> &jobs)
+{
+    std::vector<const Job *> claimed{jobs.begin(), jobs.end()};
+    size_t released = backend->release(claimed);
+    spdlog::info("Worker {}. Released {} of {} unstarted jobs back to the queue", worker_id, released, jobs.size());
+    for (Job *job : jobs)
+    {
+        job->set_reserved_by(std::nullopt);
+        job->clear_dirty();
+        if (status_cache)
         {
-            spdlog::error("Worker {} could not execute job with id = {}, caught exception of unknown type", job.get_id());
-            std::string error_msg = "Could not create class with name " + name + ", caught exception of unknown type.";
-            job.set_error_details(error_msg);
-            cleanup_job(job, false);
-            return;
+            status_cache->update(*job);
+        }
+    }
+}
+
+void Worker::cancel()
+{
+    for (std::unique_ptr<Queueable> &handler : handlers)
+    {
+        if (handler)
+        {
+            handler->cancel();
         }
     }
 }
 
+bool Worker::is_draining() const
+{
+    return stopping || stopWorkers;
+}
+
 void Worker::cleanup_job(Job &job, bool succeeded)
 {
+    TraceSpan span{"cleanup", "worker", &job.get_id()};
     job.set_reserved_by(std::nullopt);  // Set job as not reserved by any worker
     job.increase_attempts();
-    std::chrono::system_clock::time_point time = std::chrono::system_clock::now();
     job.set_latest_attempt_to_now();
     if (succeeded){
         job.set_state("succeeded");
@@ -185,5 +466,18 @@ void Worker::cleanup_job(Job &job, bool succeeded)
         job.set_state("failed");
     }
     spdlog::info("Worker {}. Done cleaning up job {} with name = {}, saving...", worker_id, job.get_id(), job.get_name());
-    job.save(db);
+    // Only the fields changed above are written, once per attempt
+    SaveResult saved = succeeded ? backend->ack(job) : backend->nack(job);
+    if (saved == SaveResult::lease_lost)
+    {
+        return; // Another worker claimed the job again and reports its status from now on
+    }
+    if (saved == SaveResult::saved)
+    {
+        job.clear_dirty();
+    }
+    if (status_cache)
+    {
+        status_cache->update(job);
+    }
 }
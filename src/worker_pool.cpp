@@ -0,0 +1,299 @@
+#include "../include/worker_pool.h"
+#include <algorithm>
+#include <cstdlib>
+#include <spdlog/spdlog.h>
+
+WorkerPoolConfig worker_pool_config_from_env()
+{
+    WorkerPoolConfig config;
+    if (const char *min_workers = std::getenv("MIN_WORKERS"))
+    {
+        config.min_workers = static_cast<size_t>(std::max(std::atoll(min_workers), 1LL));
+    }
+    if (const char *max_workers = std::getenv("MAX_WORKERS"))
+    {
+        config.max_workers = static_cast<size_t>(std::max(std::atoll(max_workers), 1LL));
+    }
+    if (const char *interval = std::getenv("POLL_INTERVAL_MS"))
+    {
+        config.polling_interval = std::chrono::milliseconds(std::max(std::atoll(interval), 1LL));
+    }
+    if (const char *timeout = std::getenv("SHUTDOWN_TIMEOUT_MS"))
+    {
+        config.drain_timeout = std::chrono::milliseconds(std::max(std::atoll(timeout), 0LL));
+    }
+    if (const char *batch_size = std::getenv("WORKER_BATCH"))
+    {
+        config.batch_size = static_cast<size_t>(std::max(std::atoll(batch_size), 1LL));
+    }
+    if (const char *max_attempts = std::getenv("MAX_ATTEMPTS"))
+    {
+        config.max_attempts = static_cast<int>(std::max(std::atoll(max_attempts), 1LL));
+    }
+    if (const char *delay = std::getenv("RETRY_DELAY_MS"))
+    {
+        config.retry_delay = std::chrono::milliseconds(std::max(std::atoll(delay), 0LL));
+    }
+    config.max_workers = std::max(config.max_workers, config.min_workers);
+    return config;
+}
+
+// ScalingPolicy
+ScalingPolicy::ScalingPolicy(const WorkerPoolConfig &config_) : config{config_},
+                                                                 grow_streak{0},
+                                                                 shrink_streak{0},
+                                                                 healthy_streak{0},
+                                                                 baseline_latency_us{0},
+                                                                 ceiling{config_.max_workers}
+{
+}
+
+size_t ScalingPolicy::next_size(const ScalingSample &sample)
+{
+    size_t workers = std::clamp(sample.workers, config.min_workers, config.max_workers);
+    if (sample.jobs > 0)
+    {
+        double latency_us = static_cast<double>(sample.busy_us) / sample.jobs;
+        double failure_share = static_cast<double>(sample.failures) / sample.jobs;
+        bool saturated = baseline_latency_us > 0 &&
+                         (latency_us > baseline_latency_us * config.saturation_latency ||
+                          failure_share > config.saturation_failures);
+
+        // The baseline follows the lowest latency, and drifts up slowly so that a server that has
+        // become permanently slower is not mistaken for a saturated one forever
+        if (baseline_latency_us == 0 || latency_us < baseline_latency_us)
+        {
+            baseline_latency_us = latency_us;
+        }
+        else
+        {
+            baseline_latency_us += (latency_us - baseline_latency_us) * 0.01;
+        }
+
+        if (saturated)
+        {
+            if (ceiling > workers)
+            {
+                spdlog::warn("SMTP backend saturated at {} workers ({:.0f}ms per job, {:.0f}% failed), not growing further",
+                             workers, latency_us / 1000, failure_share * 100);
+            }
+            ceiling = workers;
+            healthy_streak = 0;
+            grow_streak = 0;
+        }
+        else if (ceiling < config.max_workers && ++healthy_streak >= config.shrink_samples)
+        {
+            ceiling = config.max_workers;
+            healthy_streak = 0;
+        }
+    }
+
+    double utilization = sample.interval.count() > 0
+                             ? static_cast<double>(sample.busy_us) / (static_cast<double>(sample.interval.count()) * workers)
+                             : 0;
+    grow_streak = sample.depth > config.backlog_per_worker * workers ? grow_streak + 1 : 0;
+    shrink_streak = sample.depth == 0 && utilization < 0.5 ? shrink_streak + 1 : 0;
+
+    size_t limit = std::min(ceiling, config.max_workers);
+    if (grow_streak >= config.grow_samples && workers < limit)
+    {
+        // Grow towards the size the backlog asks for, at most doubling per step so that one
+        // sample cannot overshoot what the SMTP server takes
+        grow_streak = 0;
+        size_t wanted = (sample.depth + config.backlog_per_worker - 1) / config.backlog_per_worker;
+        return std::min(limit, std::max(workers + 1, std::min(wanted, workers * 2)));
+    }
+    if (shrink_streak >= config.shrink_samples && workers > config.min_workers)
+    {
+        shrink_streak = 0;
+        return workers - 1;
+    }
+    return workers;
+}
+
+size_t ScalingPolicy::get_ceiling() const
+{
+    return ceiling;
+}
+
+// WorkerPool
+WorkerPool::WorkerPool(const QueueableRegistryBase &registry_,
+                       QueueBackend &backend_,
+                       const JobContext &context_,
+                       JobStatusCache *status_cache_,
+                       const WorkerPoolConfig &config_,
+                       const std::vector<std::string> &queues_) : registry{&registry_},
+                                                                  backend{&backend_},
+                                                                  context{context_},
+                                                                  status_cache{status_cache_},
+                                                                  config{config_},
+                                                                  queues{queues_},
+                                                                  policy{config_},
+                                                                  stopping{false}
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+void WorkerPool::start()
+{
+    while (members.size() < config.min_workers)
+    {
+        add_worker();
+    }
+    controller = std::thread(&WorkerPool::control, this);
+}
+
+void WorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock{controller_mutex};
+        stopping = true;
+    }
+    controller_wake.notify_all();
+    if (controller.joinable())
+    {
+        controller.join();
+    }
+    while (!members.empty())
+    {
+        retire_worker();
+    }
+
+    // Idle workers exit right away, the others once their batch is done or the deadline has passed
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + config.drain_timeout;
+    auto running = [this]
+    {
+        return std::count_if(retired.begin(), retired.end(), [](const Member &member)
+                             { return !member.worker->is_stopped(); });
+    };
+    while (running() > 0 && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (running() > 0)
+    {
+        spdlog::warn("Cancelling {} workers still running after {} ms", running(), config.drain_timeout.count());
+        for (Member &member : retired)
+        {
+            if (!member.worker->is_stopped())
+            {
+                member.worker->cancel();
+            }
+        }
+    }
+    join_retired(true);
+}
+
+void WorkerPool::wake()
+{
+    std::lock_guard<std::mutex> lock{members_mutex};
+    for (Member &member : members)
+    {
+        member.worker->wake();
+    }
+}
+
+void WorkerPool::add_worker()
+{
+    Member member{std::make_unique<Worker>(*registry, *backend, context, status_cache, config.polling_interval, config.batch_size,
+                                           config.max_attempts, config.retry_delay),
+                  std::thread{}, 0, 0, 0, false};
+    member.thread = std::thread(&Worker::run, member.worker.get());
+    std::lock_guard<std::mutex> lock{members_mutex};
+    members.push_back(std::move(member));
+}
+
+void WorkerPool::retire_worker()
+{
+    std::lock_guard<std::mutex> lock{members_mutex};
+    members.back().worker->stop();
+    retired.push_back(std::move(members.back()));
+    members.pop_back();
+}
+
+void WorkerPool::join_retired(bool wait)
+{
+    for (auto it = retired.begin(); it != retired.end();)
+    {
+        if (wait || it->counted)
+        {
+            it->thread.join();
+            it = retired.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+ScalingSample WorkerPool::sample(std::chrono::microseconds interval)
+{
+    ScalingSample sample{members.size(), 0, 0, 0, 0, interval};
+    for (const std::string &queue : queues)
+    {
+        sample.depth += backend->depth(queue);
+    }
+    // Retired workers still count until their last batch has been sampled, so that shrinking the pool
+    // does not drop the jobs they finish from the latency and failure share
+    for (std::vector<Member> *group : {&members, &retired})
+    {
+        for (Member &member : *group)
+        {
+            // A worker sets its stopped flag after its last stats update, so checking it first is safe
+            bool stopped = member.worker->is_stopped();
+            const WorkerStats &stats = member.worker->get_stats();
+            uint64_t jobs = stats.jobs, failures = stats.failures, busy_us = stats.busy_us;
+            sample.jobs += jobs - member.jobs;
+            sample.failures += failures - member.failures;
+            sample.busy_us += busy_us - member.busy_us;
+            member.jobs = jobs;
+            member.failures = failures;
+            member.busy_us = busy_us;
+            member.counted = stopped;
+        }
+    }
+    return sample;
+}
+
+void WorkerPool::control()
+{
+    std::chrono::steady_clock::time_point sampled_at = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock{controller_mutex};
+    while (!controller_wake.wait_for(lock, config.scale_interval, [this]
+                                     { return stopping; }))
+    {
+        lock.unlock();
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        ScalingSample current = sample(std::chrono::duration_cast<std::chrono::microseconds>(now - sampled_at));
+        sampled_at = now;
+
+        size_t target = policy.next_size(current);
+        if (target != members.size())
+        {
+            spdlog::info("Resizing worker pool from {} to {} workers ({} waiting jobs)", members.size(), target, current.depth);
+        }
+        while (members.size() < target)
+        {
+            add_worker();
+        }
+        while (members.size() > target)
+        {
+            retire_worker();
+        }
+        join_retired(false);
+        // Retired workers may still be executing their last batch
+        for (std::vector<Member> *group : {&members, &retired})
+        {
+            for (Member &member : *group)
+            {
+                member.worker->renew_leases(config.lease_renewal);
+            }
+        }
+        lock.lock();
+    }
+}
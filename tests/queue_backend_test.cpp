@@ -0,0 +1,533 @@
+// Conformance tests every queue backend has to pass. The Redis backend needs a redis-server at
+// REDIS_HOST:REDIS_PORT, whose {etq}:* keys are dropped by every test. Without one, it exits with 77.
+// Usage: queue_backend_test <sqlite|journal|redis>
+#include "../include/queue_backend.h"
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <spdlog/spdlog.h>
+#include <sqlite3.h>
+#include <thread>
+#ifdef WITH_REDIS
+#include <hiredis/hiredis.h>
+#endif
+
+namespace
+{
+int failures = 0;
+std::string backend_type;
+const char *sqlite_path = "queue_backend_test.db";
+
+#define CHECK(condition)                                                                          \
+    do                                                                                            \
+    {                                                                                             \
+        if (!(condition))                                                                         \
+        {                                                                                         \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            failures += 1;                                                                        \
+        }                                                                                         \
+    } while (0)
+
+using Clock = std::chrono::system_clock;
+
+// Open the backend, by default with an empty queue so that every test starts from scratch
+std::shared_ptr<QueueBackend> open_backend(const std::string &type, bool reset = true,
+                                           std::chrono::seconds lease_timeout = std::chrono::seconds(60),
+                                           size_t journal_segment_size = 64 * 1024 * 1024)
+{
+    QueueBackendConfig config = queue_backend_config_from_env();
+    config.type = type;
+    config.reset = reset;
+    config.lease_timeout = lease_timeout;
+    config.sqlite_path = sqlite_path;
+    config.journal_path = "queue_backend_test_journal";
+    config.journal_segment_size = journal_segment_size;
+    config.queues = {"high", "default"};
+    return create_queue_backend(config);
+}
+
+// Overwrite the stored arguments of a job with invalid JSON, as a half-written or foreign record would
+// leave them. Returns false for the journal backend, whose records are checksummed as a whole
+bool corrupt_args(const std::string &id)
+{
+    if (backend_type == "sqlite")
+    {
+        sqlite3 *db;
+        sqlite3_stmt *stmt;
+        bool corrupted = false;
+        if (sqlite3_open(sqlite_path, &db) == SQLITE_OK &&
+            sqlite3_prepare_v2(db, "UPDATE jobs SET args = '{not json' WHERE id = ?;", -1, &stmt, nullptr) == SQLITE_OK)
+        {
+            sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
+            corrupted = sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(db) == 1;
+            sqlite3_finalize(stmt);
+        }
+        sqlite3_close(db);
+        return corrupted;
+    }
+#ifdef WITH_REDIS
+    if (backend_type == "redis")
+    {
+        QueueBackendConfig config = queue_backend_config_from_env();
+        redisContext *ctx = redisConnect(config.redis_host.c_str(), config.redis_port);
+        if (ctx == nullptr)
+        {
+            return false;
+        }
+        std::string key{"{etq}:job:" + id};
+        redisReply *reply = static_cast<redisReply *>(redisCommand(ctx, "HSET %s args {not-json", key.c_str()));
+        bool corrupted = reply != nullptr && reply->type == REDIS_REPLY_INTEGER;
+        if (reply)
+        {
+            freeReplyObject(reply);
+        }
+        redisFree(ctx);
+        return corrupted;
+    }
+#endif
+    return false;
+}
+
+// Enqueue a job created the given number of seconds ago, so that claims have a defined order
+std::unique_ptr<Job> enqueue(QueueBackend &backend, int age, const std::string &queue = "default")
+{
+    std::unique_ptr<Job> job{new Job{json{{"age", age}}, "SendEmail", queue}};
+    job->set_created_at(Clock::now() - std::chrono::seconds(age));
+    CHECK(backend.enqueue(*job));
+    return job;
+}
+
+// Record the outcome of a claimed job the way Worker::cleanup_job does
+void finish(QueueBackend &backend, Job &job, bool succeeded)
+{
+    job.set_reserved_by(std::nullopt);
+    job.increase_attempts();
+    job.set_latest_attempt_to_now();
+    job.set_state(succeeded ? "succeeded" : "failed");
+    CHECK((succeeded ? backend.ack(job) : backend.nack(job)) == SaveResult::saved);
+    job.clear_dirty();
+}
+
+void test_enqueue_and_get_job(QueueBackend &backend)
+{
+    std::unique_ptr<Job> job = enqueue(backend, 0);
+    std::unique_ptr<Job> stored = backend.get_job(job->get_id());
+    CHECK(stored != nullptr);
+    if (stored)
+    {
+        CHECK(stored->get_name() == "SendEmail");
+        CHECK(stored->get_args() == job->get_args());
+        CHECK(stored->get_queue() == "default");
+        CHECK(stored->get_status() == "waiting");
+        CHECK(stored->get_attempts() == 0);
+        CHECK(!stored->get_reserved_by());
+    }
+    CHECK(backend.get_job("job_unknown") == nullptr);
+    CHECK(backend.depth() == 1);
+}
+
+void test_claim_oldest_first(QueueBackend &backend)
+{
+    std::unique_ptr<Job> oldest = enqueue(backend, 30);
+    std::unique_ptr<Job> middle = enqueue(backend, 20);
+    std::unique_ptr<Job> newest = enqueue(backend, 10);
+
+    std::vector<std::unique_ptr<Job>> claimed = backend.claim("wrk_a", 2);
+    CHECK(claimed.size() == 2);
+    if (claimed.size() == 2)
+    {
+        CHECK(claimed[0]->get_id() == oldest->get_id());
+        CHECK(claimed[1]->get_id() == middle->get_id());
+        CHECK(claimed[0]->get_reserved_by() == std::optional<std::string>{"wrk_a"});
+        CHECK(claimed[0]->get_dirty_fields() == 0);
+    }
+    CHECK(backend.depth() == 1);
+
+    std::vector<std::unique_ptr<Job>> rest = backend.claim("wrk_b", 5);
+    CHECK(rest.size() == 1);
+    CHECK(rest.size() == 1 && rest[0]->get_id() == newest->get_id());
+    CHECK(backend.claim("wrk_c", 5).empty());
+    CHECK(backend.depth() == 0);
+
+    std::unique_ptr<Job> stored = backend.get_job(oldest->get_id());
+    CHECK(stored && stored->get_status() == "running");
+}
+
+void test_claim_by_priority(QueueBackend &backend)
+{
+    // The backends serve the queues high and default, in this order
+    std::unique_ptr<Job> old_default = enqueue(backend, 30, "default");
+    std::unique_ptr<Job> unserved = enqueue(backend, 25, "other");
+    std::unique_ptr<Job> old_high = enqueue(backend, 25, "high");
+    std::unique_ptr<Job> new_high = enqueue(backend, 20, "high");
+
+    std::vector<std::unique_ptr<Job>> claimed = backend.claim("wrk_a", 5);
+    CHECK(claimed.size() == 3);
+    if (claimed.size() == 3)
+    {
+        CHECK(claimed[0]->get_id() == old_high->get_id());
+        CHECK(claimed[1]->get_id() == new_high->get_id());
+        CHECK(claimed[2]->get_id() == old_default->get_id());
+    }
+    CHECK(backend.claim("wrk_b", 5).empty());
+    std::unique_ptr<Job> stored = backend.get_job(unserved->get_id());
+    CHECK(stored && stored->get_status() == "waiting");
+}
+
+void test_ack_and_nack(QueueBackend &backend)
+{
+    enqueue(backend, 20);
+    enqueue(backend, 10);
+    std::vector<std::unique_ptr<Job>> claimed = backend.claim("wrk_a", 2);
+    CHECK(claimed.size() == 2);
+    if (claimed.size() != 2)
+    {
+        return;
+    }
+    finish(backend, *claimed[0], true);
+    finish(backend, *claimed[1], false);
+
+    // Finished jobs are never claimed again
+    CHECK(backend.claim("wrk_a", 5).empty());
+    CHECK(backend.depth() == 0);
+    std::unique_ptr<Job> succeeded = backend.get_job(claimed[0]->get_id());
+    std::unique_ptr<Job> failed = backend.get_job(claimed[1]->get_id());
+    CHECK(succeeded && succeeded->get_status() == "succeeded" && succeeded->get_attempts() == 1);
+    CHECK(failed && failed->get_status() == "failed" && failed->get_attempts() == 1);
+}
+
+void test_finished_after_restart(QueueBackend &backend)
+{
+    enqueue(backend, 0);
+    std::vector<std::unique_ptr<Job>> claimed = backend.claim("wrk_a", 1);
+    CHECK(claimed.size() == 1);
+    if (claimed.empty())
+    {
+        return;
+    }
+    finish(backend, *claimed[0], true);
+
+    // Open the same store a second time, as a restarted process would
+    std::shared_ptr<QueueBackend> reopened = open_backend(backend_type, false);
+    CHECK(reopened != nullptr);
+    if (reopened)
+    {
+        std::unique_ptr<Job> stored = reopened->get_job(claimed[0]->get_id());
+        CHECK(stored && stored->get_status() == "succeeded");
+        CHECK(reopened->claim("wrk_b", 1).empty());
+    }
+}
+
+void test_release(QueueBackend &backend)
+{
+    std::unique_ptr<Job> first = enqueue(backend, 20);
+    enqueue(backend, 10);
+    std::vector<std::unique_ptr<Job>> claimed = backend.claim("wrk_a", 2);
+    CHECK(claimed.size() == 2);
+    CHECK(backend.depth() == 0);
+
+    std::vector<const Job *> jobs;
+    for (const std::unique_ptr<Job> &job : claimed)
+    {
+        jobs.push_back(job.get());
+    }
+    CHECK(backend.release(jobs) == 2);
+    CHECK(backend.depth() == 2);
+
+    // Released jobs keep their state and are claimed again in the same order
+    std::vector<std::unique_ptr<Job>> again = backend.claim("wrk_b", 1);
+    CHECK(again.size() == 1 && again[0]->get_id() == first->get_id());
+    CHECK(again.size() == 1 && again[0]->get_attempts() == 0 && again[0]->get_state() == "waiting");
+
+    // Only the worker holding a reservation can release it
+    CHECK(backend.release(jobs) == 0);
+    CHECK(backend.depth() == 1);
+}
+
+void test_schedule(QueueBackend &backend)
+{
+    std::unique_ptr<Job> job = enqueue(backend, 0);
+    std::vector<std::unique_ptr<Job>> claimed = backend.claim("wrk_a", 1);
+    CHECK(claimed.size() == 1);
+    if (claimed.empty())
+    {
+        return;
+    }
+
+    // A job scheduled an hour ahead must not be claimed, whatever the local time zone
+    CHECK(backend.schedule(*claimed[0], Clock::now() + std::chrono::hours(1)) == SaveResult::saved);
+    CHECK(backend.claim("wrk_a", 1).empty());
+    // A delayed job is still part of the backlog
+    CHECK(backend.depth() == 1);
+    std::unique_ptr<Job> stored = backend.get_job(job->get_id());
+    CHECK(stored && stored->get_status() == "waiting" && stored->get_next_execution_at());
+
+    // Once it is due, it can be claimed again. The claim is over, so the job is scheduled anew like a waiting one
+    CHECK(stored && backend.schedule(*stored, Clock::now() - std::chrono::seconds(1)) == SaveResult::saved);
+    std::vector<std::unique_ptr<Job>> due = backend.claim("wrk_b", 1);
+    CHECK(due.size() == 1 && due[0]->get_id() == job->get_id());
+}
+
+void test_schedule_retry(QueueBackend &backend)
+{
+    std::unique_ptr<Job> job = enqueue(backend, 0);
+    std::vector<std::unique_ptr<Job>> claimed = backend.claim("wrk_a", 1);
+    CHECK(claimed.size() == 1);
+    if (claimed.empty())
+    {
+        return;
+    }
+
+    // A retried job keeps its attempts and the reason of its last failure, as Worker::retry_job does
+    Job &retried = *claimed[0];
+    retried.set_reserved_by(std::nullopt);
+    retried.increase_attempts();
+    retried.set_latest_attempt_to_now();
+    retried.set_error_details("451 try again later");
+    CHECK(backend.schedule(retried, Clock::now() - std::chrono::seconds(1)) == SaveResult::saved);
+    std::vector<std::unique_ptr<Job>> again = backend.claim("wrk_b", 1);
+    CHECK(again.size() == 1);
+    if (again.size() == 1)
+    {
+        CHECK(again[0]->get_id() == job->get_id());
+        CHECK(again[0]->get_attempts() == 1);
+        CHECK(again[0]->get_last_executed_at().has_value());
+        CHECK(again[0]->get_error_details() == std::optional<std::string>{"451 try again later"});
+    }
+}
+
+void test_reschedule(QueueBackend &backend)
+{
+    // A waiting job that is scheduled is no longer claimable right away
+    std::unique_ptr<Job> waiting = enqueue(backend, 10);
+    CHECK(backend.schedule(*waiting, Clock::now() + std::chrono::hours(1)) == SaveResult::saved);
+    CHECK(backend.claim("wrk_a", 1).empty());
+
+    // Only the latest schedule of a job counts
+    std::unique_ptr<Job> job = enqueue(backend, 0);
+    std::vector<std::unique_ptr<Job>> claimed = backend.claim("wrk_a", 1);
+    CHECK(claimed.size() == 1 && claimed[0]->get_id() == job->get_id());
+    if (claimed.empty())
+    {
+        return;
+    }
+    CHECK(backend.schedule(*claimed[0], Clock::now() + std::chrono::milliseconds(300)) == SaveResult::saved);
+    std::unique_ptr<Job> stored = backend.get_job(job->get_id());
+    CHECK(stored && backend.schedule(*stored, Clock::now() + std::chrono::hours(1)) == SaveResult::saved);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    CHECK(backend.claim("wrk_a", 1).empty());
+}
+
+// Run with a lease of one second
+void test_expired_lease(QueueBackend &backend)
+{
+    std::unique_ptr<Job> job = enqueue(backend, 0);
+    std::vector<std::unique_ptr<Job>> claimed = backend.claim("wrk_killed", 1);
+    CHECK(claimed.size() == 1);
+    if (claimed.empty())
+    {
+        return;
+    }
+    CHECK(backend.claim("wrk_b", 1).empty());
+
+    // The worker never finishes or releases the job, as if it was killed
+    std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+    std::vector<std::unique_ptr<Job>> again = backend.claim("wrk_b", 1);
+    CHECK(again.size() == 1);
+    if (again.size() == 1)
+    {
+        CHECK(again[0]->get_id() == job->get_id());
+        CHECK(again[0]->get_reserved_by() == std::optional<std::string>{"wrk_b"});
+        CHECK(again[0]->get_attempts() == 0);
+    }
+
+    // A worker that lost its lease can neither release the job any more nor store its result
+    CHECK(backend.release({claimed[0].get()}) == 0);
+    claimed[0]->set_reserved_by(std::nullopt);
+    claimed[0]->set_state("succeeded");
+    CHECK(backend.ack(*claimed[0]) == SaveResult::lease_lost);
+    CHECK(backend.schedule(*claimed[0], Clock::now()) == SaveResult::lease_lost);
+    CHECK(backend.depth() == 0);
+    std::unique_ptr<Job> stored = backend.get_job(job->get_id());
+    CHECK(stored && stored->get_reserved_by() == std::optional<std::string>{"wrk_b"} && stored->get_state() == "waiting");
+
+    // The worker holding the job now stores its result
+    if (again.size() == 1)
+    {
+        finish(backend, *again[0], true);
+        stored = backend.get_job(job->get_id());
+        CHECK(stored && stored->get_status() == "succeeded");
+    }
+}
+
+void test_renewed_lease(QueueBackend &backend)
+{
+    std::unique_ptr<Job> job = enqueue(backend, 0);
+    std::vector<std::unique_ptr<Job>> claimed = backend.claim("wrk_a", 1);
+    CHECK(claimed.size() == 1);
+    if (claimed.empty())
+    {
+        return;
+    }
+
+    // A running batch keeps its job for longer than the lease as long as it is renewed
+    for (int i = 0; i < 3; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(700));
+        CHECK(backend.renew("wrk_a", {job->get_id()}) == 1);
+    }
+    CHECK(backend.claim("wrk_b", 1).empty());
+    CHECK(backend.renew("wrk_b", {job->get_id()}) == 0);
+    CHECK(backend.renew("wrk_a", {"unknown"}) == 0);
+
+    // Once the worker stops renewing, the job is claimed again
+    std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+    std::vector<std::unique_ptr<Job>> again = backend.claim("wrk_b", 1);
+    CHECK(again.size() == 1 && again[0]->get_id() == job->get_id());
+    CHECK(backend.renew("wrk_a", {job->get_id()}) == 0);
+}
+
+void test_corrupt_job(QueueBackend &backend)
+{
+    std::unique_ptr<Job> corrupt = enqueue(backend, 20);
+    std::unique_ptr<Job> intact = enqueue(backend, 10);
+    if (!corrupt_args(corrupt->get_id()))
+    {
+        return;
+    }
+
+    // A job that cannot be read is failed by the claim instead of being handed out again and again
+    std::vector<std::unique_ptr<Job>> claimed = backend.claim("wrk_a", 5);
+    CHECK(claimed.size() == 1 && claimed[0]->get_id() == intact->get_id());
+    CHECK(backend.claim("wrk_b", 5).empty());
+    CHECK(backend.depth() == 0);
+}
+
+void test_depth_per_queue(QueueBackend &backend)
+{
+    enqueue(backend, 30, "high");
+    enqueue(backend, 20, "default");
+    enqueue(backend, 10, "default");
+    CHECK(backend.depth("high") == 1);
+    CHECK(backend.depth("default") == 2);
+    CHECK(backend.depth("unknown") == 0);
+
+    CHECK(backend.claim("wrk_a", 3).size() == 3);
+    CHECK(backend.depth("high") == 0);
+    CHECK(backend.depth("default") == 0);
+}
+
+void test_enqueue_once(QueueBackend &backend)
+{
+    Job first{json{{"n", 1}}, "SendEmail"};
+    Job second{json{{"n", 2}}, "SendEmail"};
+    std::optional<IdempotencyKey> taken = backend.enqueue_once(first, "key-1");
+    CHECK(taken && taken->job_id == first.get_id());
+    std::optional<IdempotencyKey> duplicate = backend.enqueue_once(second, "key-1");
+    CHECK(duplicate && duplicate->job_id == first.get_id());
+    // A duplicate reports when the key was first taken, so that caches in front of the backend expire it in time
+    if (taken && duplicate)
+    {
+        CHECK(duplicate->taken_at - taken->taken_at < std::chrono::seconds(2));
+        CHECK(taken->taken_at - duplicate->taken_at < std::chrono::seconds(2));
+        CHECK(Clock::now() - taken->taken_at < std::chrono::seconds(5));
+    }
+    CHECK(backend.get_job(second.get_id()) == nullptr);
+    CHECK(backend.depth() == 1);
+}
+
+// Run with journal segments of 1 MB, so that the key record of the journal backend does not fit
+void test_enqueue_once_failed_key(QueueBackend &backend)
+{
+    Job job{json{{"n", 1}}, "SendEmail"};
+    std::string key(2 * 1024 * 1024, 'k');
+    std::optional<IdempotencyKey> taken = backend.enqueue_once(job, key);
+    if (taken)
+    {
+        // Backends without a size limit store the key like any other
+        CHECK(taken->job_id == job.get_id());
+        CHECK(backend.depth() == 1);
+        return;
+    }
+
+    // A job whose enqueue failed must never be sent, neither now nor after a restart
+    CHECK(backend.get_job(job.get_id()) == nullptr);
+    CHECK(backend.depth() == 0);
+    CHECK(backend.claim("wrk_a", 1).empty());
+    std::shared_ptr<QueueBackend> reopened = open_backend(backend_type, false, std::chrono::seconds(60), 1024 * 1024);
+    CHECK(reopened != nullptr);
+    if (reopened)
+    {
+        CHECK(reopened->get_job(job.get_id()) == nullptr);
+        CHECK(reopened->claim("wrk_a", 1).empty());
+    }
+
+    // The client's retry is enqueued normally
+    std::optional<IdempotencyKey> retried = backend.enqueue_once(job, "key-1");
+    CHECK(retried && retried->job_id == job.get_id());
+    CHECK(backend.depth() == 1);
+}
+
+struct TestCase
+{
+    const char *name;
+    std::function<void(QueueBackend &)> run;
+    std::chrono::seconds lease_timeout{60};
+    size_t journal_segment_size{64 * 1024 * 1024};
+};
+
+const TestCase tests[] = {
+    {"enqueue and get_job", test_enqueue_and_get_job},
+    {"claim oldest first", test_claim_oldest_first},
+    {"claim by priority", test_claim_by_priority},
+    {"ack and nack", test_ack_and_nack},
+    {"finished after restart", test_finished_after_restart},
+    {"release", test_release},
+    {"schedule", test_schedule},
+    {"schedule a retry", test_schedule_retry},
+    {"reschedule", test_reschedule},
+    {"expired lease", test_expired_lease, std::chrono::seconds(1)},
+    {"renewed lease", test_renewed_lease, std::chrono::seconds(1)},
+    {"corrupt job", test_corrupt_job},
+    {"depth per queue", test_depth_per_queue},
+    {"enqueue_once", test_enqueue_once},
+    {"enqueue_once with a failed key append", test_enqueue_once_failed_key, std::chrono::seconds(60), 1024 * 1024},
+};
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: queue_backend_test <sqlite|journal|redis>" << std::endl;
+        return 2;
+    }
+    std::string type{argv[1]};
+    backend_type = type;
+    spdlog::set_level(spdlog::level::warn);
+    // Stored times must not depend on the local time zone, so the tests run outside UTC
+    setenv("TZ", "America/Los_Angeles", 1);
+    tzset();
+
+    // Without a reachable server the Redis suite is reported as skipped (see SKIP_RETURN_CODE in CMakeLists.txt)
+    if (type == "redis" && !open_backend(type, false))
+    {
+        std::cout << "skipped redis: no server reachable at REDIS_HOST:REDIS_PORT" << std::endl;
+        return 77;
+    }
+
+    for (const auto &[name, test, lease_timeout, journal_segment_size] : tests)
+    {
+        std::shared_ptr<QueueBackend> backend = open_backend(type, true, lease_timeout, journal_segment_size);
+        if (!backend)
+        {
+            std::cerr << "Could not open the " << type << " backend" << std::endl;
+            return 1;
+        }
+        int failed_before = failures;
+        test(*backend);
+        std::cout << (failures == failed_before ? "ok     " : "FAILED ") << type << ": " << name << std::endl;
+    }
+    return failures == 0 ? 0 : 1;
+}